@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "perf_counters.h"
+#include "statistics.h"
+#include "statistics_set.h"
+
+// Keeps the compiler from optimizing away a result only a benchmark looks at
+template <typename T>
+inline void do_not_optimize(T& value) {
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct BenchmarkOptions {
+	size_t warmup{3};      // untimed runs before the measured ones
+	size_t iterations{20}; // measured runs, one sample each
+	bool counters{false};  // also count hardware events, if the system allows
+};
+
+// Hardware event averaged over the measured runs, per element
+struct BenchmarkCounter {
+	std::string name;
+	double per_element{0};
+};
+
+// Timings of one benchmark in nanoseconds, summarized by the statistics.h
+// accumulators: percentiles are exact, the samples are few.
+struct BenchmarkResult {
+	std::string name;
+	size_t elements{0};
+	size_t warmup{0};
+	size_t iterations{0};
+	double min{0};
+	double median{0};
+	double p95{0};
+	double mean{0};
+	double stddev{0};
+	std::vector<BenchmarkCounter> counters; // empty unless counted
+};
+
+// Runs `setup()` and then `body()` for every iteration and times `body()`
+// alone with steady_clock, so copying or generating the input doesn't count.
+// The hardware counters, if asked for, are enabled around `body()` only.
+template <typename Setup, typename Body>
+BenchmarkResult run_benchmark(std::string name, size_t elements, const BenchmarkOptions& options,
+		Setup&& setup, Body&& body) {
+	using clock = std::chrono::steady_clock;
+	for (size_t i = 0; i < options.warmup; ++i) {
+		setup();
+		body();
+	}
+
+	DynamicStatisticsSet statistics;
+	PctGroup percentiles{Pct::Mode::Exact};
+	statistics.add(std::make_unique<Min>());
+	statistics.add(std::make_unique<Mean>());
+	statistics.add(std::make_unique<Std>());
+	statistics.add(percentiles.add(50, "median"));
+	statistics.add(percentiles.add(95, "p95"));
+	std::unique_ptr<PerfCounters> counters;
+	if (options.counters) {
+		counters = std::make_unique<PerfCounters>();
+	}
+	std::vector<double> totals;
+	for (size_t i = 0; i < options.iterations; ++i) {
+		setup();
+		if (counters) {
+			counters->start();
+		}
+		auto start = clock::now();
+		body();
+		auto end = clock::now();
+		if (counters) {
+			counters->stop(totals);
+		}
+		statistics.update(std::chrono::duration<double, std::nano>(end - start).count());
+	}
+
+	BenchmarkResult result;
+	result.name = std::move(name);
+	result.elements = elements;
+	result.warmup = options.warmup;
+	result.iterations = options.iterations;
+	std::vector<double> values;
+	statistics.for_each([&](const IStatistics& statistic) { values.push_back(statistic.eval()); });
+	result.min = values[0];
+	result.mean = values[1];
+	result.stddev = values[2];
+	result.median = values[3];
+	result.p95 = values[4];
+	double per_element = 1.0 / (static_cast<double>(options.iterations) * std::max<size_t>(elements, 1));
+	for (size_t i = 0; i < totals.size(); ++i) {
+		result.counters.push_back({counters->names()[i], totals[i] * per_element});
+	}
+	return result;
+}
+
+// Human readable duration ("1.23 ms")
+inline std::string format_duration(double nanoseconds) {
+	const char* units[] = {"ns", "us", "ms", "s"};
+	size_t unit = 0;
+	while (unit < 3 && nanoseconds >= 1000) {
+		nanoseconds /= 1000;
+		++unit;
+	}
+	char text[32];
+	std::snprintf(text, sizeof(text), "%.3g %s", nanoseconds, units[unit]);
+	return text;
+}
+
+inline void print_result(std::ostream& out, const BenchmarkResult& result) {
+	out << result.name << " (" << result.elements << " elements, " << result.iterations << " runs): "
+		<< "min " << format_duration(result.min) << ", median " << format_duration(result.median)
+		<< ", p95 " << format_duration(result.p95) << ", stddev " << format_duration(result.stddev)
+		<< "\n";
+	if (!result.counters.empty()) {
+		out << "    per element:";
+		for (size_t i = 0; i < result.counters.size(); ++i) {
+			char value[32];
+			std::snprintf(value, sizeof(value), "%.3g", result.counters[i].per_element);
+			out << (i == 0 ? " " : ", ") << result.counters[i].name << " " << value;
+		}
+		out << "\n";
+	}
+}
+
+inline std::string json_escape(const std::string& text) {
+	std::string escaped;
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+		}
+		escaped += c;
+	}
+	return escaped;
+}
+
+// Results as a JSON document for regression tracking; times are in ns
+inline void write_json(std::ostream& out, const std::vector<BenchmarkResult>& results) {
+	std::streamsize precision = out.precision(10);
+	out << "{\n  \"unit\": \"ns\",\n  \"benchmarks\": [";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const BenchmarkResult& result = results[i];
+		out << (i == 0 ? "\n" : ",\n")
+			<< "    {\"name\": \"" << json_escape(result.name) << "\""
+			<< ", \"elements\": " << result.elements
+			<< ", \"warmup\": " << result.warmup
+			<< ", \"iterations\": " << result.iterations
+			<< ", \"min\": " << result.min
+			<< ", \"median\": " << result.median
+			<< ", \"p95\": " << result.p95
+			<< ", \"mean\": " << result.mean
+			<< ", \"stddev\": " << result.stddev;
+		if (!result.counters.empty()) {
+			out << ", \"per_element\": {";
+			for (size_t c = 0; c < result.counters.size(); ++c) {
+				out << (c == 0 ? "\"" : ", \"") << json_escape(result.counters[c].name) << "\": "
+					<< result.counters[c].per_element;
+			}
+			out << "}";
+		}
+		out << "}";
+	}
+	out << "\n  ]\n}\n";
+	out.precision(precision);
+}
@@ -1,97 +1,275 @@
-#include <chrono>
-#include <iostream>
-#include <vector>
-
-#include <algorithm> // std::shuffle
-#include <random>	 // std::default_random_engine
-
-void fill_vector(std::vector<int> &values, size_t count) {
-	values.resize(count);
-	for (size_t i = 0; i < count; ++i) {
-		values[i] = static_cast<int>(i);
-	}
-}
-
-template <typename T>
-void make_random_shuffle(std::vector<T> &values) {
-	// 1. Take current time (count of seconds since `epoch begining`) as a seed
-	auto seconds_count = std::chrono::system_clock::now().time_since_epoch().count();
-	unsigned int seed = static_cast<unsigned int>(seconds_count);
-	// 2. Initialize random engine
-	std::default_random_engine engine{seed};
-	// 3. Shuffle values
-	std::shuffle(values.begin(), values.end(), engine);
-}
-
-void run_test_suite(size_t iteration_count) {
-	const size_t elements_count = 100000;
-	std::vector<int> values;
-	// fill values with elements_count elements
-	fill_vector(values, elements_count);
-	// random shuffle values
-	make_random_shuffle(values);
-
-
-	std::cout << "iteration_count = " << iteration_count << std::endl;
-	// std::sort algorithm measuring
-	{
-		// Take a start time
-		auto start_time = std::chrono::system_clock::now();
-		// Make a several iterations
-		for (size_t i = 0; i < iteration_count; ++i) {
-			std::vector<int> test_data = values;
-			std::sort(test_data.begin(), test_data.end());
-		}
-		// Take an end time
-		auto end_time = std::chrono::system_clock::now();
-		// Calculate a duration
-		auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(
-			end_time - start_time);
-		std::cout << "std::sort duration = " << milliseconds.count() << "ms" << std::endl;
-		std::cout << "std::sort avg = " << milliseconds.count() / iteration_count << "ms" << std::endl;
-	}
-
-	// C-style quick-sort algorithm measuring
-	{
-		// Take a start time
-		auto start_time = std::chrono::system_clock::now();
-		// Make a several iterations
-		for (size_t i = 0; i < iteration_count; ++i) {
-			std::vector<int> test_data = values;
-			std::qsort(
-				test_data.data(),
-				test_data.size(),
-				sizeof(int),
-				[](const void *x, const void *y) {
-					const int arg1 = *static_cast<const int *>(x);
-					const int arg2 = *static_cast<const int *>(y);
-					if (arg1 < arg2)
-						return -1;
-					if (arg1 > arg2)
-						return 1;
-					return 0;
-				});
-		}
-		// Take an end time
-		auto end_time = std::chrono::system_clock::now();
-		// Calculate a duration
-		auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(
-			end_time - start_time);
-		std::cout << "qsort duration = " << milliseconds.count() << "ms" << std::endl;
-		std::cout << "qsort avg = " << milliseconds.count() / iteration_count << "ms" << std::endl;
-	}
-}
-
-int main() {
-
-	run_test_suite(1);
-	std::cout << std::endl;
-
-	run_test_suite(10);
-	std::cout << std::endl;
-
-	run_test_suite(100);
-	std::cout << std::endl;
-
-	return 0;
-}
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <algorithm> // std::sort, std::stable_sort
+
+#if defined(HAVE_PARALLEL_STL)
+#include <execution>
+#endif
+
+#include "benchmark.h"
+#include "shuffle.h"
+#include "sort.h"
+
+// Input orders the sorts are measured on
+enum class Distribution {
+	Random,       // uniformly distributed keys
+	Sorted,       // already in order
+	Reversed,     // in descending order
+	NearlySorted, // sorted with 1% of the elements swapped at random
+	FewUnique     // random among 16 distinct keys
+};
+
+const char* distribution_name(Distribution distribution) {
+	switch (distribution) {
+	case Distribution::Random: return "random";
+	case Distribution::Sorted: return "sorted";
+	case Distribution::Reversed: return "reversed";
+	case Distribution::NearlySorted: return "nearly_sorted";
+	case Distribution::FewUnique: return "few_unique";
+	}
+	return "";
+}
+
+const Distribution all_distributions[] = {Distribution::Random, Distribution::Sorted,
+	Distribution::Reversed, Distribution::NearlySorted, Distribution::FewUnique};
+
+// Key of type T for `value`, preserving the order of the values
+template <typename T>
+T make_key(uint64_t value);
+
+template <>
+int make_key<int>(uint64_t value) {
+	return static_cast<int>(value >> 33) - (1 << 30);
+}
+
+template <>
+int64_t make_key<int64_t>(uint64_t value) {
+	return static_cast<int64_t>(value >> 1) - (int64_t{1} << 61);
+}
+
+template <>
+double make_key<double>(uint64_t value) {
+	return static_cast<double>(value >> 11) * 0x1p-53 * 2e6 - 1e6;
+}
+
+// The high 40 bits, zero-padded to their 13 digits: the order of the strings
+// is the order of the values, and the keys stay short enough for the small
+// string buffer
+template <>
+std::string make_key<std::string>(uint64_t value) {
+	std::string key = std::to_string(value >> 24);
+	return std::string(13 - key.size(), '0') + key;
+}
+
+template <typename T>
+std::vector<T> make_input(size_t size, Distribution distribution, Xoshiro256& engine) {
+	std::vector<T> values;
+	values.reserve(size);
+	for (size_t i = 0; i < size; ++i) {
+		uint64_t value = engine();
+		if (distribution == Distribution::FewUnique) {
+			value = (value % 16) << 40;
+		} else if (distribution != Distribution::Random) {
+			value = (i + 1) * (~uint64_t{0} / (size + 1)); // ascending, spread over the key range
+		}
+		values.push_back(make_key<T>(value));
+	}
+	if (distribution == Distribution::Reversed) {
+		std::reverse(values.begin(), values.end());
+	} else if (distribution == Distribution::NearlySorted) {
+		for (size_t i = 0; i < size / 100; ++i) {
+			std::swap(values[bounded_random(engine, size)], values[bounded_random(engine, size)]);
+		}
+	}
+	return values;
+}
+
+template <typename T>
+int compare_keys(const void *x, const void *y) {
+	const T& arg1 = *static_cast<const T *>(x);
+	const T& arg2 = *static_cast<const T *>(y);
+	if (arg1 < arg2)
+		return -1;
+	if (arg1 > arg2)
+		return 1;
+	return 0;
+}
+
+// Fewer runs for large inputs, so the whole matrix finishes in reasonable time
+BenchmarkOptions scale_options(const BenchmarkOptions& options, size_t size) {
+	BenchmarkOptions scaled = options;
+	while (scaled.iterations > 3 && scaled.iterations * size > (size_t{1} << 24)) {
+		scaled.iterations /= 2;
+	}
+	if (size >= (size_t{1} << 20)) {
+		scaled.warmup = std::min<size_t>(scaled.warmup, 1);
+	}
+	return scaled;
+}
+
+// Times every sort on one input. Every run sorts a fresh copy, made by the
+// (untimed) setup step.
+template <typename T>
+void run_sort_suite(const char* type_name, size_t size, Distribution distribution, uint64_t seed,
+		const BenchmarkOptions& options, std::vector<BenchmarkResult>& results) {
+	// The same input for every key type and run of the program
+	Xoshiro256 engine{seed ^ (size * 31 + static_cast<size_t>(distribution))};
+	const std::vector<T> values = make_input<T>(size, distribution, engine);
+	const BenchmarkOptions scaled = scale_options(options, size);
+	const std::string suffix = std::string{"<"} + type_name + ">/" + distribution_name(distribution);
+
+	std::vector<T> test_data;
+	auto copy_input = [&] { test_data = values; };
+	auto add = [&](const char* sort, auto&& body) {
+		results.push_back(run_benchmark(sort + suffix, size, scaled, copy_input, [&] {
+			body();
+			do_not_optimize(test_data);
+		}));
+	};
+
+	add("std::sort", [&] { std::sort(test_data.begin(), test_data.end()); });
+	add("std::stable_sort", [&] { std::stable_sort(test_data.begin(), test_data.end()); });
+#if defined(HAVE_PARALLEL_STL)
+	add("std::sort(par_unseq)", [&] { std::sort(std::execution::par_unseq, test_data.begin(), test_data.end()); });
+#endif
+	add("pdq_sort", [&] { pdq_sort(test_data.begin(), test_data.end()); });
+	add("parallel_sample_sort", [&] { parallel_sample_sort(test_data.data(), test_data.size()); });
+	if constexpr (std::is_trivially_copyable<T>::value) {
+		add("qsort", [&] { std::qsort(test_data.data(), test_data.size(), sizeof(T), compare_keys<T>); });
+	}
+	if constexpr (std::is_arithmetic<T>::value) {
+		add("lsd_radix_sort", [&] { lsd_radix_sort(test_data.data(), test_data.size()); });
+		add("msd_radix_sort", [&] { msd_radix_sort(test_data.data(), test_data.size()); });
+	}
+}
+
+bool parse_list(const char* text, std::vector<std::string>& items) {
+	items.clear();
+	std::string list{text};
+	for (size_t begin = 0; begin <= list.size();) {
+		size_t end = std::min(list.find(',', begin), list.size());
+		items.push_back(list.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return !items.empty();
+}
+
+bool contains(const std::vector<std::string>& items, const std::string& item) {
+	return std::find(items.begin(), items.end(), item) != items.end();
+}
+
+// Usage: chrono_example [--iterations N] [--warmup N] [--counters] [--seed N] [--json FILE]
+//                       [--sizes N,...] [--types int,int64,double,string]
+//                       [--distributions random,sorted,reversed,nearly_sorted,few_unique]
+// Sorts every combination of size, key type and input distribution with
+// std::sort, std::stable_sort, parallel std::sort (when built with TBB),
+// qsort and the sorts of sort.h: pdqsort, a parallel sample sort on a thread
+// per core, and LSD and MSD radix sorts for the numeric keys. Prints
+// min/median/p95/stddev of each.
+// The inputs are generated from --seed (default 0), so every run of the
+// program sorts the same data. The default sizes go from L1-resident (1K
+// elements) to 4M elements; large inputs get fewer runs. `--counters` adds
+// cycles, instructions, branch and cache misses and LLC loads per element,
+// counted with perf_event_open around the sort alone. `--json` also writes
+// the results as JSON to FILE ("-": stdout instead of the text report).
+int main(int argc, char* argv[]) {
+	BenchmarkOptions options;
+	const char* json_path = nullptr;
+	uint64_t seed = 0;
+	std::vector<size_t> sizes{size_t{1} << 10, size_t{1} << 13, size_t{1} << 16, size_t{1} << 19, size_t{1} << 22};
+	std::vector<std::string> types{"int", "int64", "double", "string"};
+	std::vector<std::string> distributions;
+	for (Distribution distribution : all_distributions) {
+		distributions.push_back(distribution_name(distribution));
+	}
+
+	for (int i = 1; i < argc; ++i) {
+		bool has_value = i + 1 < argc;
+		std::vector<std::string> items;
+		if (std::strcmp(argv[i], "--iterations") == 0 && has_value) {
+			options.iterations = std::strtoul(argv[++i], nullptr, 10);
+		} else if (std::strcmp(argv[i], "--warmup") == 0 && has_value) {
+			options.warmup = std::strtoul(argv[++i], nullptr, 10);
+		} else if (std::strcmp(argv[i], "--counters") == 0) {
+			options.counters = true;
+		} else if (std::strcmp(argv[i], "--seed") == 0 && has_value) {
+			seed = std::strtoull(argv[++i], nullptr, 0);
+		} else if (std::strcmp(argv[i], "--json") == 0 && has_value) {
+			json_path = argv[++i];
+		} else if (std::strcmp(argv[i], "--sizes") == 0 && has_value) {
+			parse_list(argv[++i], items);
+			sizes.clear();
+			for (const std::string& item : items) {
+				sizes.push_back(std::strtoull(item.c_str(), nullptr, 10));
+				if (sizes.back() == 0) {
+					std::cerr << "Invalid size: " << item << "\n";
+					return 1;
+				}
+			}
+		} else if (std::strcmp(argv[i], "--types") == 0 && has_value) {
+			parse_list(argv[++i], types);
+		} else if (std::strcmp(argv[i], "--distributions") == 0 && has_value) {
+			parse_list(argv[++i], distributions);
+		} else {
+			std::cerr << "Unknown option: " << argv[i] << "\n";
+			return 1;
+		}
+	}
+	if (options.iterations == 0) {
+		std::cerr << "--iterations must be at least 1\n";
+		return 1;
+	}
+	if (options.counters && !PerfCounters{}.available()) {
+		std::cerr << "Hardware counters are not available (see perf_event_paranoid), timing only\n";
+		options.counters = false;
+	}
+
+	ThreadPool::shared(); // start the sample sort's threads outside the timings
+
+	bool json_to_stdout = json_path != nullptr && std::strcmp(json_path, "-") == 0;
+	std::vector<BenchmarkResult> results;
+	for (size_t size : sizes) {
+		for (Distribution distribution : all_distributions) {
+			if (!contains(distributions, distribution_name(distribution))) {
+				continue;
+			}
+			size_t first = results.size();
+			if (contains(types, "int")) {
+				run_sort_suite<int>("int", size, distribution, seed, options, results);
+			}
+			if (contains(types, "int64")) {
+				run_sort_suite<int64_t>("int64", size, distribution, seed, options, results);
+			}
+			if (contains(types, "double")) {
+				run_sort_suite<double>("double", size, distribution, seed, options, results);
+			}
+			if (contains(types, "string")) {
+				run_sort_suite<std::string>("string", size, distribution, seed, options, results);
+			}
+			// Report as we go, a full sweep takes a while
+			for (size_t r = first; r < results.size() && !json_to_stdout; ++r) {
+				print_result(std::cout, results[r]);
+			}
+		}
+	}
+
+	if (json_to_stdout) {
+		write_json(std::cout, results);
+	} else if (json_path != nullptr) {
+		std::ofstream out{json_path};
+		write_json(out, results);
+		if (!out) {
+			std::cerr << "Failed to write " << json_path << "\n";
+			return 1;
+		}
+	}
+
+	return 0;
+}
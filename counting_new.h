@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global operator new and delete with ones that count every
+// allocation of the process, for the allocation figures of
+// statistics_benchmark and `statistics --profile`. The replacements are
+// definitions, not inline functions: include this header from exactly one
+// translation unit of a program.
+
+inline std::atomic<uint64_t> allocation_count{0};
+inline std::atomic<uint64_t> allocated_bytes{0};
+
+// Every operator delete ends here. Kept out of line so the compiler doesn't
+// pair an inlined free() with the operator new that returned the pointer and
+// report them as mismatched (-Wmismatched-new-delete).
+[[gnu::noinline]] inline void counting_release(void* pointer) noexcept {
+	std::free(pointer);
+}
+
+inline void* counting_allocate(size_t size, size_t alignment) {
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+	void* pointer = alignment <= alignof(std::max_align_t)
+		? std::malloc(size ? size : 1)
+		: std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+	if (pointer == nullptr) {
+		throw std::bad_alloc{};
+	}
+	return pointer;
+}
+
+void* operator new(size_t size) {
+	return counting_allocate(size, 0);
+}
+
+void* operator new[](size_t size) {
+	return counting_allocate(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+	return counting_allocate(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+	return counting_allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* pointer) noexcept {
+	counting_release(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+	counting_release(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+	counting_release(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+	counting_release(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept {
+	counting_release(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t) noexcept {
+	counting_release(pointer);
+}
+
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept {
+	counting_release(pointer);
+}
+
+void operator delete[](void* pointer, size_t, std::align_val_t) noexcept {
+	counting_release(pointer);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "shuffle.h"
+
+// Distribution of the generated samples. Sampling is written out here
+// rather than taken from <random>, whose distributions differ between
+// standard libraries, so a seed gives the same corpus everywhere.
+struct SampleDistribution {
+	enum class Kind {
+		Uniform,   // a, b: uniform in [a, b)
+		Normal,    // a, b: mean, standard deviation
+		LogNormal, // a, b: mean and standard deviation of the logarithm
+		Pareto     // a, b: scale (minimum), shape
+	};
+
+	Kind kind{Kind::Uniform};
+	double a{0};
+	double b{1};
+
+	// "name[:a,b]", e.g. "normal:100,15"
+	static bool parse(const char* text, SampleDistribution& distribution) {
+		const char* colon = std::strchr(text, ':');
+		std::string name = colon ? std::string(text, colon) : std::string(text);
+		if (name == "uniform") {
+			distribution = {Kind::Uniform, 0, 1};
+		} else if (name == "normal") {
+			distribution = {Kind::Normal, 0, 1};
+		} else if (name == "lognormal") {
+			distribution = {Kind::LogNormal, 0, 1};
+		} else if (name == "pareto") {
+			distribution = {Kind::Pareto, 1, 2};
+		} else {
+			return false;
+		}
+		if (colon != nullptr) {
+			char* end = nullptr;
+			distribution.a = std::strtod(colon + 1, &end);
+			if (*end != ',') {
+				return false;
+			}
+			distribution.b = std::strtod(end + 1, &end);
+			if (*end != '\0') {
+				return false;
+			}
+		}
+		switch (distribution.kind) {
+		case Kind::Uniform: return distribution.a < distribution.b;
+		case Kind::Normal:
+		case Kind::LogNormal: return distribution.b >= 0;
+		case Kind::Pareto: return distribution.a > 0 && distribution.b > 0;
+		}
+		return false;
+	}
+};
+
+// Uniform double in [0, 1) from the top 53 bits
+inline double uniform01(Xoshiro256& engine) {
+	return static_cast<double>(engine() >> 11) * 0x1p-53;
+}
+
+// Fills values[0, count), count even, with samples of `distribution`.
+// Normal samples come in pairs from the Box-Muller transform.
+inline void generate_samples(const SampleDistribution& distribution, Xoshiro256& engine, double* values, size_t count) {
+	const double a = distribution.a;
+	const double b = distribution.b;
+	switch (distribution.kind) {
+	case SampleDistribution::Kind::Uniform:
+		for (size_t i = 0; i < count; ++i) {
+			values[i] = a + (b - a) * uniform01(engine);
+		}
+		break;
+	case SampleDistribution::Kind::Normal:
+	case SampleDistribution::Kind::LogNormal:
+		for (size_t i = 0; i < count; i += 2) {
+			double radius = std::sqrt(-2 * std::log(1 - uniform01(engine))); // 1 - u is in (0, 1]
+			double angle = 2 * M_PI * uniform01(engine);
+			values[i] = a + b * radius * std::cos(angle);
+			values[i + 1] = a + b * radius * std::sin(angle);
+		}
+		if (distribution.kind == SampleDistribution::Kind::LogNormal) {
+			for (size_t i = 0; i < count; ++i) {
+				values[i] = std::exp(values[i]);
+			}
+		}
+		break;
+	case SampleDistribution::Kind::Pareto:
+		for (size_t i = 0; i < count; ++i) {
+			values[i] = a / std::pow(1 - uniform01(engine), 1 / b);
+		}
+		break;
+	}
+}
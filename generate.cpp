@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h> // STDOUT_FILENO
+
+#include "distributions.h"
+#include "sample_input.h"
+#include "sample_output.h"
+#include "shuffle.h"
+
+struct Options {
+	uint64_t count{1000000};
+	uint64_t seed{0};
+	bool has_seed{false};
+	size_t threads{1};
+	SampleDistribution distribution;
+	InputFormat format{InputFormat::Text};
+};
+
+// Samples are generated in blocks of `block_size`; block i is drawn from the
+// seed's engine jumped i times, whatever thread generates it, so the output
+// only depends on the seed and the options, not on the number of threads.
+constexpr size_t block_size = size_t{1} << 16;
+
+// Generates options.count samples on options.threads threads. Each thread
+// encodes its blocks itself; the blocks are written in order, one thread at
+// a time.
+bool run(const Options& options, std::string& error) {
+	const uint64_t blocks = (options.count + block_size - 1) / block_size;
+	const size_t threads = static_cast<size_t>(std::max<uint64_t>(1, std::min<uint64_t>(options.threads, blocks)));
+	std::mutex mutex;
+	std::condition_variable turn_changed;
+	uint64_t turn = 0; // next block to write
+	bool failed = false;
+
+	auto work = [&](size_t thread) {
+		Xoshiro256 engine{options.seed};
+		for (size_t i = 0; i < thread; ++i) {
+			engine.jump();
+		}
+		std::vector<double> values(block_size);
+		std::vector<char> encoded;
+		for (uint64_t block = thread; block < blocks; block += threads) {
+			Xoshiro256 block_engine = engine;
+			generate_samples(options.distribution, block_engine, values.data(), block_size);
+			size_t count = static_cast<size_t>(std::min<uint64_t>(block_size, options.count - block * block_size));
+			encoded.clear();
+			encode_samples(values.data(), count, options.format, encoded);
+
+			std::unique_lock<std::mutex> lock{mutex};
+			turn_changed.wait(lock, [&] { return turn == block || failed; });
+			if (failed) {
+				return;
+			}
+			if (!write_all(STDOUT_FILENO, encoded.data(), encoded.size(), error)) {
+				failed = true;
+			}
+			++turn;
+			lock.unlock();
+			turn_changed.notify_all();
+			for (size_t i = 0; i < threads; ++i) {
+				engine.jump();
+			}
+		}
+	};
+	std::vector<std::thread> workers;
+	for (size_t t = 1; t < threads; ++t) {
+		workers.emplace_back(work, t);
+	}
+	work(0);
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	return !failed;
+}
+
+bool parse_options(int argc, char* argv[], Options& options) {
+	for (int i = 1; i < argc; ++i) {
+		bool has_value = i + 1 < argc;
+		if (std::strcmp(argv[i], "--count") == 0 && has_value) {
+			options.count = std::strtoull(argv[++i], nullptr, 10);
+		} else if (std::strcmp(argv[i], "--seed") == 0 && has_value) {
+			options.seed = std::strtoull(argv[++i], nullptr, 0);
+			options.has_seed = true;
+		} else if (std::strcmp(argv[i], "--threads") == 0 && has_value) {
+			options.threads = std::strtoul(argv[++i], nullptr, 10);
+			if (options.threads == 0) {
+				options.threads = std::max(1u, std::thread::hardware_concurrency());
+			}
+		} else if (std::strcmp(argv[i], "--distribution") == 0 && has_value) {
+			if (!SampleDistribution::parse(argv[++i], options.distribution)) {
+				std::cerr << "Invalid distribution: " << argv[i] << "\n";
+				return false;
+			}
+		} else if (std::strcmp(argv[i], "--format") == 0 && has_value) {
+			if (!parse_input_format(argv[++i], options.format)) {
+				std::cerr << "Unknown output format: " << argv[i] << "\n";
+				return false;
+			}
+		} else {
+			std::cerr << "Unknown option: " << argv[i] << "\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Usage: generate [--count N] [--distribution NAME[:A,B]] [--format text|f64|f32]
+//                 [--seed N] [--threads N]
+// Writes N (default 1M) samples to stdout as input for `statistics`: one
+// number per line, or raw little-endian doubles/floats for
+// `statistics --format f64|f32`. Distributions:
+//   uniform:A,B    uniform in [A, B)              (default 0,1)
+//   normal:A,B     mean A, standard deviation B   (default 0,1)
+//   lognormal:A,B  exp of normal(A, B)            (default 0,1)
+//   pareto:A,B     scale A, shape B               (default 1,2)
+// --threads N generates on N threads (0: all cores) with independent
+// xoshiro256** streams, jumped ahead from the seed; a seed gives the same
+// samples on any number of threads. Without --seed a random one is chosen
+// and printed to stderr.
+int main(int argc, char* argv[]) {
+	Options options;
+	if (!parse_options(argc, argv, options)) {
+		return 1;
+	}
+	if (!options.has_seed) {
+		options.seed = random_seed();
+		std::cerr << "seed: " << options.seed << "\n";
+	}
+	std::string error;
+	if (!run(options, error)) {
+		std::cerr << error << "\n";
+		return 1;
+	}
+	return 0;
+}
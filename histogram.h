@@ -0,0 +1,228 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include "serialize.h"
+
+// HDR-style histogram with logarithmic buckets and fixed memory. A bucket is
+// addressed directly by the bits of a double: its binary exponent selects the
+// power-of-two range and the top `precision` mantissa bits the sub-bucket
+// within it, so the relative error of a reported value is below 2^-precision
+// and an update is a few integer operations. Magnitudes below 2^min_exponent
+// fall into the zero bucket, magnitudes above 2^(max_exponent + 1) (and
+// infinities) into an overflow bucket at either end.
+class LogHistogram {
+public:
+	static constexpr unsigned default_precision = 7;
+	static constexpr int default_min_exponent = -64;
+	static constexpr int default_max_exponent = 63;
+
+	explicit LogHistogram(unsigned precision = default_precision,
+			int min_exponent = default_min_exponent, int max_exponent = default_max_exponent)
+		: m_precision{std::min(precision, 20u)},
+		  m_min_exponent{std::max(min_exponent, -1022)},
+		  m_max_exponent{std::min(max_exponent, 1023)} {
+		if (m_max_exponent < m_min_exponent) {
+			m_max_exponent = m_min_exponent;
+		}
+		m_buckets = static_cast<size_t>(m_max_exponent - m_min_exponent + 1) << m_precision;
+		m_counts.assign(2 * m_buckets + 3, 0);
+	}
+
+	void add(double value) {
+		if (std::isnan(value)) {
+			return;
+		}
+		++m_counts[position(value)];
+		++m_count;
+		m_min = std::min(m_min, value);
+		m_max = std::max(m_max, value);
+	}
+
+	void add(const double* data, size_t count) {
+		double min = m_min, max = m_max;
+		for (size_t i = 0; i < count; ++i) {
+			double value = data[i];
+			if (std::isnan(value)) {
+				continue;
+			}
+			++m_counts[position(value)];
+			++m_count;
+			min = value < min ? value : min;
+			max = value > max ? value : max;
+		}
+		m_min = min;
+		m_max = max;
+	}
+
+	// Throws std::invalid_argument if the bucket layouts differ
+	void merge(const LogHistogram& other) {
+		if (!same_layout(other)) {
+			throw std::invalid_argument("histograms with different bucket layouts can't be merged");
+		}
+		for (size_t i = 0; i < m_counts.size(); ++i) {
+			m_counts[i] += other.m_counts[i];
+		}
+		m_count += other.m_count;
+		m_min = std::min(m_min, other.m_min);
+		m_max = std::max(m_max, other.m_max);
+	}
+
+	uint64_t count() const {
+		return m_count;
+	}
+
+	// Value at rank floor(count * percent / 100), like the exact percentile:
+	// the middle of the bucket holding that rank, clamped to the seen range
+	double quantile(double percent) const {
+		if (m_count == 0) {
+			return NAN;
+		}
+		uint64_t rank = static_cast<uint64_t>(std::floor(m_count * percent / 100.0));
+		if (rank >= m_count) {
+			rank = m_count - 1;
+		}
+		uint64_t cumulative = 0;
+		for (size_t pos = 0; pos < m_counts.size(); ++pos) {
+			cumulative += m_counts[pos];
+			if (cumulative > rank) {
+				return std::min(m_max, std::max(m_min, representative(pos)));
+			}
+		}
+		return m_max;
+	}
+
+	bool same_layout(const LogHistogram& other) const {
+		return m_precision == other.m_precision && m_min_exponent == other.m_min_exponent &&
+			m_max_exponent == other.m_max_exponent;
+	}
+
+	// Snapshot with only the non-empty buckets, as (position delta, count) runs
+	void save(std::ostream& out) const {
+		write_tag(out, "HDRH");
+		write_value<uint32_t>(out, 1); // format version
+		write_value<uint32_t>(out, m_precision);
+		write_value<int32_t>(out, m_min_exponent);
+		write_value<int32_t>(out, m_max_exponent);
+		write_value<uint64_t>(out, m_count);
+		write_value<double>(out, m_min);
+		write_value<double>(out, m_max);
+		uint64_t used = std::count_if(m_counts.begin(), m_counts.end(), [](uint64_t c) { return c != 0; });
+		write_value<uint64_t>(out, used);
+		size_t previous = 0;
+		for (size_t pos = 0; pos < m_counts.size(); ++pos) {
+			if (m_counts[pos] != 0) {
+				write_value<uint32_t>(out, static_cast<uint32_t>(pos - previous));
+				write_value<uint64_t>(out, m_counts[pos]);
+				previous = pos;
+			}
+		}
+	}
+
+	// Replaces this histogram with a snapshot written by save(). Returns false
+	// (and leaves the stream failed) on malformed input.
+	bool load(std::istream& in) {
+		if (!expect_tag(in, "HDRH") || read_value<uint32_t>(in) != 1) {
+			in.setstate(std::ios::failbit);
+			return false;
+		}
+		unsigned precision = read_value<uint32_t>(in);
+		int min_exponent = read_value<int32_t>(in);
+		int max_exponent = read_value<int32_t>(in);
+		if (!in || precision > 20 || min_exponent < -1022 || max_exponent > 1023 || max_exponent < min_exponent) {
+			in.setstate(std::ios::failbit);
+			return false;
+		}
+		LogHistogram loaded{precision, min_exponent, max_exponent};
+		loaded.m_count = read_value<uint64_t>(in);
+		loaded.m_min = read_value<double>(in);
+		loaded.m_max = read_value<double>(in);
+		uint64_t used = read_value<uint64_t>(in);
+		size_t pos = 0;
+		for (uint64_t i = 0; in && i < used; ++i) {
+			pos += read_value<uint32_t>(in);
+			uint64_t count = read_value<uint64_t>(in);
+			if (pos >= loaded.m_counts.size()) {
+				in.setstate(std::ios::failbit);
+				break;
+			}
+			loaded.m_counts[pos] = count;
+		}
+		if (!in) {
+			return false;
+		}
+		*this = std::move(loaded);
+		return true;
+	}
+
+private:
+	static uint64_t to_bits(double value) {
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	static double from_bits(uint64_t bits) {
+		double value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	// Layout of m_counts, in ascending value order:
+	// [negative overflow][negative buckets, largest magnitude first][zero]
+	// [positive buckets][positive overflow]
+	size_t position(double value) const {
+		uint64_t bits = to_bits(value);
+		bool negative = bits >> 63;
+		bits &= ~(uint64_t{1} << 63);
+		int exponent = static_cast<int>(bits >> 52) - 1023;
+		if (exponent < m_min_exponent) {
+			return m_buckets + 1;
+		}
+		if (exponent > m_max_exponent) {
+			return negative ? 0 : 2 * m_buckets + 2;
+		}
+		size_t sub_bucket = (bits >> (52 - m_precision)) & ((size_t{1} << m_precision) - 1);
+		size_t bucket = (static_cast<size_t>(exponent - m_min_exponent) << m_precision) | sub_bucket;
+		return negative ? m_buckets - bucket : m_buckets + 2 + bucket;
+	}
+
+	// Middle of the value range a position covers
+	double representative(size_t pos) const {
+		if (pos == 0) {
+			return m_min;
+		}
+		if (pos == 2 * m_buckets + 2) {
+			return m_max;
+		}
+		if (pos == m_buckets + 1) {
+			return 0;
+		}
+		bool negative = pos <= m_buckets;
+		size_t bucket = negative ? m_buckets - pos : pos - m_buckets - 2;
+		uint64_t exponent = static_cast<uint64_t>(static_cast<int>(bucket >> m_precision) + m_min_exponent + 1023);
+		uint64_t sub_bucket = bucket & ((size_t{1} << m_precision) - 1);
+		uint64_t low_bits = (exponent << 52) | (sub_bucket << (52 - m_precision));
+		double low = from_bits(low_bits);
+		double high = from_bits(low_bits + (uint64_t{1} << (52 - m_precision)));
+		double middle = low + (high - low) / 2;
+		return negative ? -middle : middle;
+	}
+
+	unsigned m_precision;
+	int m_min_exponent;
+	int m_max_exponent;
+	size_t m_buckets;
+	std::vector<uint64_t> m_counts;
+	uint64_t m_count{0};
+	double m_min{std::numeric_limits<double>::max()};
+	double m_max{std::numeric_limits<double>::lowest()};
+};
@@ -0,0 +1,417 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#include "sample_type.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STATISTICS_KERNELS_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define STATISTICS_KERNELS_NEON 1
+#endif
+
+// Everything Min/Max/Mean/Std need from a block, gathered in one memory sweep.
+// `shifted_sum` and `shifted_sumsq` are taken around `shift` (the first sample
+// of the block), which keeps the block variance free of cancellation. The sum
+// is kept in the widened sum type of the samples, the rest as double.
+template <typename T>
+struct BasicBlockSummary {
+	size_t count{0};
+	T min{std::numeric_limits<T>::max()};
+	T max{std::numeric_limits<T>::lowest()};
+	typename SampleTraits<T>::sum_type sum{0};
+	double shift{0};
+	double shifted_sum{0};
+	double shifted_sumsq{0};
+};
+
+using BlockSummary = BasicBlockSummary<double>;
+
+using SummaryKernel = BlockSummary (*)(const double* data, size_t count);
+
+// Min/max use `x < acc ? x : acc`, which (like the SIMD min/max instructions
+// with the accumulator as second operand) skips NaN samples.
+inline void summarize_tail(const double* data, size_t count, BlockSummary& summary) {
+	for (size_t i = 0; i < count; ++i) {
+		double x = data[i];
+		double d = x - summary.shift;
+		summary.min = x < summary.min ? x : summary.min;
+		summary.max = x > summary.max ? x : summary.max;
+		summary.sum += x;
+		summary.shifted_sum += d;
+		summary.shifted_sumsq += d * d;
+	}
+}
+
+inline BlockSummary summarize_scalar(const double* data, size_t count) {
+	BlockSummary summary;
+	summary.count = count;
+	if (count != 0) {
+		summary.shift = data[0];
+	}
+	summarize_tail(data, count, summary);
+	return summary;
+}
+
+#if defined(STATISTICS_KERNELS_X86)
+
+__attribute__((target("avx2,fma")))
+inline BlockSummary summarize_avx2(const double* data, size_t count) {
+	BlockSummary summary;
+	summary.count = count;
+	if (count == 0) {
+		return summary;
+	}
+	summary.shift = data[0];
+
+	// Two independent accumulator sets hide the add latency
+	const __m256d shift = _mm256_set1_pd(summary.shift);
+	__m256d min0 = _mm256_set1_pd(summary.min), min1 = min0;
+	__m256d max0 = _mm256_set1_pd(summary.max), max1 = max0;
+	__m256d sum0 = _mm256_setzero_pd(), sum1 = sum0;
+	__m256d ssum0 = _mm256_setzero_pd(), ssum1 = ssum0;
+	__m256d ssq0 = _mm256_setzero_pd(), ssq1 = ssq0;
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256d x0 = _mm256_loadu_pd(data + i);
+		__m256d x1 = _mm256_loadu_pd(data + i + 4);
+		min0 = _mm256_min_pd(x0, min0);
+		min1 = _mm256_min_pd(x1, min1);
+		max0 = _mm256_max_pd(x0, max0);
+		max1 = _mm256_max_pd(x1, max1);
+		sum0 = _mm256_add_pd(sum0, x0);
+		sum1 = _mm256_add_pd(sum1, x1);
+		__m256d d0 = _mm256_sub_pd(x0, shift);
+		__m256d d1 = _mm256_sub_pd(x1, shift);
+		ssum0 = _mm256_add_pd(ssum0, d0);
+		ssum1 = _mm256_add_pd(ssum1, d1);
+		ssq0 = _mm256_fmadd_pd(d0, d0, ssq0);
+		ssq1 = _mm256_fmadd_pd(d1, d1, ssq1);
+	}
+
+	alignas(32) double lanes[4];
+	_mm256_store_pd(lanes, _mm256_min_pd(min0, min1));
+	for (double lane : lanes) {
+		summary.min = lane < summary.min ? lane : summary.min;
+	}
+	_mm256_store_pd(lanes, _mm256_max_pd(max0, max1));
+	for (double lane : lanes) {
+		summary.max = lane > summary.max ? lane : summary.max;
+	}
+	_mm256_store_pd(lanes, _mm256_add_pd(sum0, sum1));
+	summary.sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm256_store_pd(lanes, _mm256_add_pd(ssum0, ssum1));
+	summary.shifted_sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm256_store_pd(lanes, _mm256_add_pd(ssq0, ssq1));
+	summary.shifted_sumsq = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	summarize_tail(data + i, count - i, summary);
+	return summary;
+}
+
+// GCC 12's _mm512_min_pd/_mm512_max_pd pass an undefined vector as the merge
+// source of their masked builtins, which -Wmaybe-uninitialized reports here
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+inline BlockSummary summarize_avx512(const double* data, size_t count) {
+	BlockSummary summary;
+	summary.count = count;
+	if (count == 0) {
+		return summary;
+	}
+	summary.shift = data[0];
+
+	const __m512d shift = _mm512_set1_pd(summary.shift);
+	__m512d min0 = _mm512_set1_pd(summary.min), min1 = min0;
+	__m512d max0 = _mm512_set1_pd(summary.max), max1 = max0;
+	__m512d sum0 = _mm512_setzero_pd(), sum1 = sum0;
+	__m512d ssum0 = _mm512_setzero_pd(), ssum1 = ssum0;
+	__m512d ssq0 = _mm512_setzero_pd(), ssq1 = ssq0;
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m512d x0 = _mm512_loadu_pd(data + i);
+		__m512d x1 = _mm512_loadu_pd(data + i + 8);
+		min0 = _mm512_min_pd(x0, min0);
+		min1 = _mm512_min_pd(x1, min1);
+		max0 = _mm512_max_pd(x0, max0);
+		max1 = _mm512_max_pd(x1, max1);
+		sum0 = _mm512_add_pd(sum0, x0);
+		sum1 = _mm512_add_pd(sum1, x1);
+		__m512d d0 = _mm512_sub_pd(x0, shift);
+		__m512d d1 = _mm512_sub_pd(x1, shift);
+		ssum0 = _mm512_add_pd(ssum0, d0);
+		ssum1 = _mm512_add_pd(ssum1, d1);
+		ssq0 = _mm512_fmadd_pd(d0, d0, ssq0);
+		ssq1 = _mm512_fmadd_pd(d1, d1, ssq1);
+	}
+
+	alignas(64) double lanes[8];
+	_mm512_store_pd(lanes, _mm512_min_pd(min0, min1));
+	for (double lane : lanes) {
+		summary.min = lane < summary.min ? lane : summary.min;
+	}
+	_mm512_store_pd(lanes, _mm512_max_pd(max0, max1));
+	for (double lane : lanes) {
+		summary.max = lane > summary.max ? lane : summary.max;
+	}
+	summary.sum = _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+	summary.shifted_sum = _mm512_reduce_add_pd(_mm512_add_pd(ssum0, ssum1));
+	summary.shifted_sumsq = _mm512_reduce_add_pd(_mm512_add_pd(ssq0, ssq1));
+
+	summarize_tail(data + i, count - i, summary);
+	return summary;
+}
+#pragma GCC diagnostic pop
+
+#elif defined(STATISTICS_KERNELS_NEON)
+
+inline BlockSummary summarize_neon(const double* data, size_t count) {
+	BlockSummary summary;
+	summary.count = count;
+	if (count == 0) {
+		return summary;
+	}
+	summary.shift = data[0];
+
+	const float64x2_t shift = vdupq_n_f64(summary.shift);
+	float64x2_t min0 = vdupq_n_f64(summary.min), min1 = min0;
+	float64x2_t max0 = vdupq_n_f64(summary.max), max1 = max0;
+	float64x2_t sum0 = vdupq_n_f64(0), sum1 = sum0;
+	float64x2_t ssum0 = vdupq_n_f64(0), ssum1 = ssum0;
+	float64x2_t ssq0 = vdupq_n_f64(0), ssq1 = ssq0;
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		float64x2_t x0 = vld1q_f64(data + i);
+		float64x2_t x1 = vld1q_f64(data + i + 2);
+		// vminnm/vmaxnm return the number when one operand is NaN
+		min0 = vminnmq_f64(x0, min0);
+		min1 = vminnmq_f64(x1, min1);
+		max0 = vmaxnmq_f64(x0, max0);
+		max1 = vmaxnmq_f64(x1, max1);
+		sum0 = vaddq_f64(sum0, x0);
+		sum1 = vaddq_f64(sum1, x1);
+		float64x2_t d0 = vsubq_f64(x0, shift);
+		float64x2_t d1 = vsubq_f64(x1, shift);
+		ssum0 = vaddq_f64(ssum0, d0);
+		ssum1 = vaddq_f64(ssum1, d1);
+		ssq0 = vfmaq_f64(ssq0, d0, d0);
+		ssq1 = vfmaq_f64(ssq1, d1, d1);
+	}
+	summary.min = vminnmvq_f64(vminnmq_f64(min0, min1));
+	summary.max = vmaxnmvq_f64(vmaxnmq_f64(max0, max1));
+	summary.sum = vaddvq_f64(vaddq_f64(sum0, sum1));
+	summary.shifted_sum = vaddvq_f64(vaddq_f64(ssum0, ssum1));
+	summary.shifted_sumsq = vaddvq_f64(vaddq_f64(ssq0, ssq1));
+
+	summarize_tail(data + i, count - i, summary);
+	return summary;
+}
+
+#endif
+
+// Picks the widest kernel the CPU supports. STATISTICS_KERNEL=scalar|avx2|avx512
+// (or neon on ARM) forces a specific one, falling back to scalar if the CPU
+// doesn't have it; any other value is reported and the automatic choice used.
+inline SummaryKernel select_summary_kernel() {
+	const char* forced = std::getenv("STATISTICS_KERNEL");
+	auto is_forced = [&](const char* name) { return forced != nullptr && std::strcmp(forced, name) == 0; };
+	if (is_forced("scalar")) {
+		return summarize_scalar;
+	}
+#if defined(STATISTICS_KERNELS_X86)
+	__builtin_cpu_init();
+	bool has_avx512 = __builtin_cpu_supports("avx512f");
+	bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	if (is_forced("avx512")) {
+		return has_avx512 ? summarize_avx512 : summarize_scalar;
+	}
+	if (is_forced("avx2")) {
+		return has_avx2 ? summarize_avx2 : summarize_scalar;
+	}
+	if (forced != nullptr && *forced != '\0') {
+		std::fprintf(stderr, "Unknown STATISTICS_KERNEL=%s, expected scalar, avx2 or avx512\n", forced);
+	}
+	if (has_avx512) {
+		return summarize_avx512;
+	}
+	if (has_avx2) {
+		return summarize_avx2;
+	}
+#elif defined(STATISTICS_KERNELS_NEON)
+	if (forced != nullptr && *forced != '\0' && !is_forced("neon")) {
+		std::fprintf(stderr, "Unknown STATISTICS_KERNEL=%s, expected scalar or neon\n", forced);
+	}
+	return summarize_neon;
+#else
+	if (forced != nullptr && *forced != '\0') {
+		std::fprintf(stderr, "Unknown STATISTICS_KERNEL=%s, expected scalar\n", forced);
+	}
+#endif
+	return summarize_scalar;
+}
+
+inline BlockSummary summarize(const double* data, size_t count) {
+	static const SummaryKernel kernel = select_summary_kernel();
+	return kernel(data, count);
+}
+
+// Portable kernel for the other sample types, written so the compiler can
+// vectorize it: min/max in the sample type, sums widened
+template <typename T>
+BasicBlockSummary<T> summarize_generic(const T* data, size_t count) {
+	BasicBlockSummary<T> summary;
+	summary.count = count;
+	if (count == 0) {
+		return summary;
+	}
+	summary.shift = static_cast<double>(data[0]);
+	T min = summary.min, max = summary.max;
+	typename SampleTraits<T>::sum_type sum = 0;
+	double shifted_sum = 0, shifted_sumsq = 0;
+	for (size_t i = 0; i < count; ++i) {
+		T x = data[i];
+		double d = static_cast<double>(x) - summary.shift;
+		min = x < min ? x : min;
+		max = x > max ? x : max;
+		sum += x;
+		shifted_sum += d;
+		shifted_sumsq += d * d;
+	}
+	summary.min = min;
+	summary.max = max;
+	summary.sum = sum;
+	summary.shifted_sum = shifted_sum;
+	summary.shifted_sumsq = shifted_sumsq;
+	return summary;
+}
+
+using FloatSummaryKernel = BasicBlockSummary<float> (*)(const float* data, size_t count);
+
+#if defined(STATISTICS_KERNELS_X86)
+
+// float samples: min/max take 8 lanes per instruction, twice as many as for
+// double; the sums are widened to double, 4 lanes at a time
+__attribute__((target("avx2,fma")))
+inline BasicBlockSummary<float> summarize_f32_avx2(const float* data, size_t count) {
+	BasicBlockSummary<float> summary;
+	summary.count = count;
+	if (count == 0) {
+		return summary;
+	}
+	summary.shift = data[0];
+
+	const __m256d shift = _mm256_set1_pd(summary.shift);
+	__m256 min0 = _mm256_set1_ps(summary.min);
+	__m256 max0 = _mm256_set1_ps(summary.max);
+	__m256d sum0 = _mm256_setzero_pd(), sum1 = sum0;
+	__m256d ssum0 = _mm256_setzero_pd(), ssum1 = ssum0;
+	__m256d ssq0 = _mm256_setzero_pd(), ssq1 = ssq0;
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 x = _mm256_loadu_ps(data + i);
+		min0 = _mm256_min_ps(x, min0);
+		max0 = _mm256_max_ps(x, max0);
+		__m256d x0 = _mm256_cvtps_pd(_mm256_castps256_ps128(x));
+		__m256d x1 = _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1));
+		sum0 = _mm256_add_pd(sum0, x0);
+		sum1 = _mm256_add_pd(sum1, x1);
+		__m256d d0 = _mm256_sub_pd(x0, shift);
+		__m256d d1 = _mm256_sub_pd(x1, shift);
+		ssum0 = _mm256_add_pd(ssum0, d0);
+		ssum1 = _mm256_add_pd(ssum1, d1);
+		ssq0 = _mm256_fmadd_pd(d0, d0, ssq0);
+		ssq1 = _mm256_fmadd_pd(d1, d1, ssq1);
+	}
+
+	alignas(32) float lanes[8];
+	_mm256_store_ps(lanes, min0);
+	for (float lane : lanes) {
+		summary.min = lane < summary.min ? lane : summary.min;
+	}
+	_mm256_store_ps(lanes, max0);
+	for (float lane : lanes) {
+		summary.max = lane > summary.max ? lane : summary.max;
+	}
+	alignas(32) double sums[4];
+	_mm256_store_pd(sums, _mm256_add_pd(sum0, sum1));
+	summary.sum = sums[0] + sums[1] + sums[2] + sums[3];
+	_mm256_store_pd(sums, _mm256_add_pd(ssum0, ssum1));
+	summary.shifted_sum = sums[0] + sums[1] + sums[2] + sums[3];
+	_mm256_store_pd(sums, _mm256_add_pd(ssq0, ssq1));
+	summary.shifted_sumsq = sums[0] + sums[1] + sums[2] + sums[3];
+
+	for (; i < count; ++i) {
+		float x = data[i];
+		double d = x - summary.shift;
+		summary.min = x < summary.min ? x : summary.min;
+		summary.max = x > summary.max ? x : summary.max;
+		summary.sum += x;
+		summary.shifted_sum += d;
+		summary.shifted_sumsq += d * d;
+	}
+	return summary;
+}
+
+#endif
+
+inline FloatSummaryKernel select_float_summary_kernel() {
+#if defined(STATISTICS_KERNELS_X86)
+	const char* forced = std::getenv("STATISTICS_KERNEL");
+	__builtin_cpu_init();
+	if ((forced == nullptr || std::strcmp(forced, "scalar") != 0) &&
+			__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		return summarize_f32_avx2;
+	}
+#endif
+	return summarize_generic<float>;
+}
+
+inline BasicBlockSummary<float> summarize(const float* data, size_t count) {
+	static const FloatSummaryKernel kernel = select_float_summary_kernel();
+	return kernel(data, count);
+}
+
+template <typename T>
+BasicBlockSummary<T> summarize(const T* data, size_t count) {
+	return summarize_generic(data, count);
+}
+
+// A block of samples handed to every statistic. The summary is computed on
+// first request and then shared, so Min/Max/Mean/Std cost one sweep together.
+template <typename T>
+class BasicSampleBlock {
+public:
+	BasicSampleBlock(const T* data, size_t count) : m_data{data}, m_count{count} {
+	}
+
+	const T* data() const {
+		return m_data;
+	}
+
+	size_t size() const {
+		return m_count;
+	}
+
+	const BasicBlockSummary<T>& summary() const {
+		if (!m_has_summary) {
+			m_summary = summarize(m_data, m_count);
+			m_has_summary = true;
+		}
+		return m_summary;
+	}
+
+private:
+	const T* m_data;
+	size_t m_count;
+	mutable BasicBlockSummary<T> m_summary;
+	mutable bool m_has_summary{false};
+};
+
+using SampleBlock = BasicSampleBlock<double>;
@@ -0,0 +1,644 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "profile.h"
+#include "sample_input.h"
+#include "sort.h" // pdq_sort
+#include "statistics.h"
+
+// Statistics per key (--keyed): input lines are "key value", and every
+// distinct key gets its own set of statistics.
+
+// 64-bit hash of a key, 8 bytes at a time with the wyhash multiply-fold
+inline uint64_t hash_key(std::string_view key) {
+	auto fold = [](uint64_t x, uint64_t y) {
+		unsigned __int128 product = static_cast<unsigned __int128>(x) * y;
+		return static_cast<uint64_t>(product >> 64) ^ static_cast<uint64_t>(product);
+	};
+	uint64_t hash = 0x9e3779b97f4a7c15ull ^ key.size();
+	size_t i = 0;
+	for (; i + 8 <= key.size(); i += 8) {
+		uint64_t word;
+		std::memcpy(&word, key.data() + i, 8);
+		hash = fold(hash ^ word, 0xa0761d6478bd642full);
+	}
+	uint64_t tail = 0;
+	std::memcpy(&tail, key.data() + i, key.size() - i);
+	return fold(hash ^ tail, 0xe7037ed1a0b428dbull);
+}
+
+// Maps keys to dense ids 0, 1, 2, ... in order of first appearance. Open
+// addressing with linear probing: a slot is the id and 32 more hash bits, so
+// a probe rarely has to look at the key itself, and the keys are packed one
+// after another in a single buffer.
+class KeyIndex {
+public:
+	KeyIndex() : m_slots(16) {
+	}
+
+	size_t size() const {
+		return m_hashes.size();
+	}
+
+	std::string_view key(uint32_t id) const {
+		return std::string_view{m_keys.data() + m_key_offsets[id], m_key_offsets[id + 1] - m_key_offsets[id]};
+	}
+
+	// Id of `key`, which becomes the next id if the key is new (`added`)
+	uint32_t insert(std::string_view key, bool& added) {
+		const uint64_t hash = hash_key(key);
+		const uint32_t tag = static_cast<uint32_t>(hash >> 32);
+		const size_t mask = m_slots.size() - 1;
+		for (size_t i = hash & mask;; i = (i + 1) & mask) {
+			Slot& slot = m_slots[i];
+			if (slot.id == empty) {
+				added = true;
+				slot = {static_cast<uint32_t>(size()), tag};
+				m_hashes.push_back(hash);
+				m_keys.append(key);
+				m_key_offsets.push_back(m_keys.size());
+				if (size() * 2 > m_slots.size()) {
+					grow();
+				}
+				return static_cast<uint32_t>(size() - 1);
+			}
+			if (slot.tag == tag && this->key(slot.id) == key) {
+				added = false;
+				return slot.id;
+			}
+		}
+	}
+
+private:
+	static constexpr uint32_t empty = ~uint32_t{0};
+
+	struct Slot {
+		uint32_t id{empty};
+		uint32_t tag{0};
+	};
+
+	// Doubles the table, at most half full, re-placing the ids by their hashes
+	void grow() {
+		std::vector<Slot> slots(m_slots.size() * 2);
+		const size_t mask = slots.size() - 1;
+		for (uint32_t id = 0; id < size(); ++id) {
+			size_t i = m_hashes[id] & mask;
+			while (slots[i].id != empty) {
+				i = (i + 1) & mask;
+			}
+			slots[i] = {id, static_cast<uint32_t>(m_hashes[id] >> 32)};
+		}
+		m_slots = std::move(slots);
+	}
+
+	std::vector<Slot> m_slots;              // power of two
+	std::vector<uint64_t> m_hashes;         // per id
+	std::vector<size_t> m_key_offsets{0};   // key of id i is [offsets[i], offsets[i + 1]) of m_keys
+	std::string m_keys;
+};
+
+// What KeyedStatistics computes per key: the statistics of a prototype set,
+// in its order, and the columns of per-key state they need
+template <typename T>
+struct KeyedLayout {
+	enum class Kind { Min, Max, Mean, Std, Var, Skew, Kurt, Pct };
+
+	struct Statistic {
+		Kind kind;
+		std::string name;
+		float percent; // for Pct
+	};
+
+	std::vector<Statistic> statistics;
+	bool min{false};
+	bool max{false};
+	bool sum{false};
+	unsigned order{0}; // highest central moment needed, 0 if none
+	bool percentiles{false};
+	PctMode pct_mode{PctMode::Sketch};
+	// Samples a key keeps as a plain vector before it gets a real quantile
+	// store: about the store's own size, so small keys don't pay for one
+	size_t promote_limit{0};
+
+	// Layout of the statistics of `prototype`; throws std::logic_error for
+	// one that has no per-key form (windowed statistics)
+	template <typename Set>
+	static KeyedLayout of(const Set& prototype) {
+		KeyedLayout layout;
+		prototype.for_each([&](const BasicStatistics<T>& statistic) {
+			layout.add(statistic);
+		});
+		return layout;
+	}
+
+private:
+	template <typename Store>
+	static bool is_store(const BasicQuantileStore<T>& store) {
+		return dynamic_cast<const Store*>(&store) != nullptr;
+	}
+
+	template <typename Type>
+	static bool is(const BasicStatistics<T>& statistic) {
+		return dynamic_cast<const Type*>(&statistic) != nullptr;
+	}
+
+	void add(const BasicStatistics<T>& statistic) {
+		Statistic entry{Kind::Min, statistic.name(), 0};
+		if (is<BasicMin<T>>(statistic)) {
+			min = true;
+		} else if (is<BasicMax<T>>(statistic)) {
+			entry.kind = Kind::Max;
+			max = true;
+		} else if (is<BasicMean<T>>(statistic)) {
+			entry.kind = Kind::Mean;
+			sum = true;
+		} else if (is<BasicStd<T>>(statistic) || is<BasicVar<T>>(statistic)) {
+			entry.kind = is<BasicStd<T>>(statistic) ? Kind::Std : Kind::Var;
+			order = std::max(order, 2u);
+		} else if (is<BasicSkew<T>>(statistic)) {
+			entry.kind = Kind::Skew;
+			order = std::max(order, 3u);
+		} else if (is<BasicKurt<T>>(statistic)) {
+			entry.kind = Kind::Kurt;
+			order = 4;
+		} else if (auto pct = dynamic_cast<const BasicPct<T>*>(&statistic)) {
+			entry.kind = Kind::Pct;
+			entry.percent = pct->percent();
+			percentiles = true;
+			if (is_store<BasicExactStore<T>>(pct->store())) {
+				pct_mode = PctMode::Exact;
+				promote_limit = ~size_t{0}; // a vector is the most compact exact store
+			} else if (is_store<BasicHistogramStore<T>>(pct->store())) {
+				pct_mode = PctMode::Histogram;
+				promote_limit = (size_t{256} << 10) / sizeof(T); // about its bucket counts
+			} else {
+				pct_mode = PctMode::Sketch;
+				promote_limit = static_cast<size_t>(TDigest::default_compression * 5); // its buffer
+			}
+		} else {
+			throw std::logic_error(std::string{statistic.name()} + " can't be computed per key");
+		}
+		statistics.push_back(std::move(entry));
+	}
+};
+
+// The statistics of a layout for every key, held in structure-of-arrays
+// columns: one array each of counts, minima, maxima, sums and central
+// moments, with only the columns the reported statistics need, so a key
+// costs a few dozen bytes plus its percentile samples. Samples are staged
+// per key, batch_size values per key in one flat array plus an array of
+// fill counts, and a full batch is folded into the key's columns at once.
+// Percentile samples are kept in a plain vector until promote_limit, and
+// only then moved into a quantile store of the layout's mode.
+//
+// Samples arrive as double and are converted to T; those that don't fit
+// are counted (rejected()) and skipped, as ConvertingSet does.
+template <typename T>
+class KeyedStatistics {
+public:
+	using sum_type = typename SampleTraits<T>::sum_type;
+
+	static constexpr size_t batch_size = 32;
+
+	explicit KeyedStatistics(KeyedLayout<T> layout) : m_layout{std::move(layout)} {
+	}
+
+	void update(std::string_view key, double value) {
+		if (!is_representable<T>(value)) {
+			if (m_rejected++ == 0) {
+				m_first_rejected = value;
+			}
+			return;
+		}
+		const uint32_t group = find_or_add(key);
+		T* pending = &m_pending[group * batch_size];
+		uint32_t& count = m_pending_counts[group];
+		pending[count] = static_cast<T>(value);
+		++m_samples;
+		if (++count == batch_size) {
+			add(group, pending, batch_size);
+			count = 0;
+		}
+	}
+
+	// Folds the staged samples into the columns; call before reading them
+	void flush() {
+		for (uint32_t group = 0; group < size(); ++group) {
+			if (m_pending_counts[group] != 0) {
+				add(group, &m_pending[group * batch_size], m_pending_counts[group]);
+				m_pending_counts[group] = 0;
+			}
+		}
+	}
+
+	// Adds the results of `other` (same layout) key by key
+	void merge(const KeyedStatistics& other) {
+		for (uint32_t other_group = 0; other_group < other.size(); ++other_group) {
+			const uint32_t group = find_or_add(other.m_index.key(other_group));
+			merge_group(group, other, other_group);
+			if (other.m_pending_counts[other_group] != 0) {
+				add(group, &other.m_pending[other_group * batch_size], other.m_pending_counts[other_group]);
+			}
+		}
+		m_samples += other.m_samples;
+		if (m_rejected == 0) {
+			m_first_rejected = other.m_first_rejected;
+		}
+		m_rejected += other.m_rejected;
+	}
+
+	// Forgets every key, keeping the layout
+	void clear() {
+		*this = KeyedStatistics{std::move(m_layout)};
+	}
+
+	size_t size() const {
+		return m_index.size();
+	}
+
+	// Samples accepted since construction or clear()
+	size_t samples() const {
+		return m_samples;
+	}
+
+	size_t rejected() const {
+		return m_rejected;
+	}
+
+	double first_rejected() const {
+		return m_first_rejected;
+	}
+
+	// Calls f(key, name, value) for every statistic of every key, in byte
+	// order of the keys and layout order of the statistics
+	template <typename F>
+	void for_each_result(F&& f) const {
+		std::vector<uint32_t> order(size());
+		std::iota(order.begin(), order.end(), 0);
+		pdq_sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+			return m_index.key(x) < m_index.key(y);
+		});
+		for (uint32_t group : order) {
+			std::shared_ptr<BasicQuantileStore<T>> store;
+			for (const auto& statistic : m_layout.statistics) {
+				if (statistic.kind == Kind::Pct && !store) {
+					store = percentile_store(group);
+				}
+				f(m_index.key(group), statistic.name.c_str(), eval(group, statistic, store.get()));
+			}
+		}
+	}
+
+private:
+	using Kind = typename KeyedLayout<T>::Kind;
+
+	struct Percentiles {
+		std::vector<T> samples; // until promote_limit, then in `store`
+		std::shared_ptr<BasicQuantileStore<T>> store;
+	};
+
+	uint32_t find_or_add(std::string_view key) {
+		bool added;
+		uint32_t group = m_index.insert(key, added);
+		if (added) {
+			m_pending.resize(size() * batch_size);
+			m_pending_counts.push_back(0);
+			m_counts.push_back(0);
+			if (m_layout.min) {
+				m_min.push_back(std::numeric_limits<T>::max());
+			}
+			if (m_layout.max) {
+				m_max.push_back(std::numeric_limits<T>::lowest());
+			}
+			if (m_layout.sum) {
+				m_sums.push_back(0);
+			}
+			if (m_layout.order >= 2) {
+				m_means.push_back(0);
+				m_m2.push_back(0);
+			}
+			if (m_layout.order >= 3) {
+				m_m3.push_back(0);
+			}
+			if (m_layout.order >= 4) {
+				m_m4.push_back(0);
+			}
+			if (m_layout.percentiles) {
+				m_percentiles.emplace_back();
+			}
+		}
+		return group;
+	}
+
+	Moments<4> moments(uint32_t group) const {
+		return Moments<4>{m_counts[group], m_means[group], m_m2[group],
+			m_layout.order >= 3 ? m_m3[group] : 0, m_layout.order >= 4 ? m_m4[group] : 0};
+	}
+
+	void set_moments(uint32_t group, const Moments<4>& moments) {
+		m_means[group] = moments.mean();
+		m_m2[group] = moments.m2();
+		if (m_layout.order >= 3) {
+			m_m3[group] = moments.m3();
+		}
+		if (m_layout.order >= 4) {
+			m_m4[group] = moments.m4();
+		}
+	}
+
+	// Folds `count` samples into the columns of `group`. Moments before counts,
+	// which they are rebuilt from.
+	void add(uint32_t group, const T* data, size_t count) {
+		if (m_layout.min) {
+			T min = m_min[group];
+			for (size_t i = 0; i < count; ++i) {
+				min = data[i] < min ? data[i] : min;
+			}
+			m_min[group] = min;
+		}
+		if (m_layout.max) {
+			T max = m_max[group];
+			for (size_t i = 0; i < count; ++i) {
+				max = data[i] > max ? data[i] : max;
+			}
+			m_max[group] = max;
+		}
+		if (m_layout.sum) {
+			sum_type sum = m_sums[group];
+			for (size_t i = 0; i < count; ++i) {
+				sum += data[i];
+			}
+			m_sums[group] = sum;
+		}
+		if (m_layout.order >= 2) {
+			Moments<4> block;
+			block.add(data, count);
+			Moments<4> current = moments(group);
+			current.merge(block);
+			set_moments(group, current);
+		}
+		m_counts[group] += count;
+		if (m_layout.percentiles) {
+			add_percentile_samples(m_percentiles[group], data, count);
+		}
+	}
+
+	void add_percentile_samples(Percentiles& percentiles, const T* data, size_t count) {
+		if (percentiles.store) {
+			percentiles.store->add(data, count);
+			return;
+		}
+		percentiles.samples.insert(percentiles.samples.end(), data, data + count);
+		if (percentiles.samples.size() > m_layout.promote_limit) {
+			promote(percentiles);
+		}
+	}
+
+	std::shared_ptr<BasicQuantileStore<T>> make_store() const {
+		std::shared_ptr<BasicQuantileStore<T>> store = BasicPct<T>::make_store(m_layout.pct_mode);
+		for (const auto& statistic : m_layout.statistics) {
+			if (statistic.kind == Kind::Pct) {
+				store->expect(statistic.percent);
+			}
+		}
+		return store;
+	}
+
+	void promote(Percentiles& percentiles) {
+		percentiles.store = make_store();
+		percentiles.store->add(percentiles.samples.data(), percentiles.samples.size());
+		std::vector<T>{}.swap(percentiles.samples);
+	}
+
+	// The store of `group`, or a temporary one for a key not promoted yet
+	std::shared_ptr<BasicQuantileStore<T>> percentile_store(uint32_t group) const {
+		const Percentiles& percentiles = m_percentiles[group];
+		if (percentiles.store) {
+			return percentiles.store;
+		}
+		std::shared_ptr<BasicQuantileStore<T>> store = make_store();
+		store->add(percentiles.samples.data(), percentiles.samples.size());
+		return store;
+	}
+
+	void merge_group(uint32_t group, const KeyedStatistics& other, uint32_t other_group) {
+		if (m_layout.min) {
+			T min = other.m_min[other_group];
+			m_min[group] = min < m_min[group] ? min : m_min[group];
+		}
+		if (m_layout.max) {
+			T max = other.m_max[other_group];
+			m_max[group] = max > m_max[group] ? max : m_max[group];
+		}
+		if (m_layout.sum) {
+			m_sums[group] += other.m_sums[other_group];
+		}
+		if (m_layout.order >= 2) {
+			Moments<4> current = moments(group);
+			current.merge(other.moments(other_group));
+			set_moments(group, current);
+		}
+		m_counts[group] += other.m_counts[other_group];
+		if (m_layout.percentiles) {
+			Percentiles& percentiles = m_percentiles[group];
+			const Percentiles& from = other.m_percentiles[other_group];
+			if (from.store) {
+				if (!percentiles.store) {
+					promote(percentiles);
+				}
+				percentiles.store->merge(*from.store);
+			} else {
+				add_percentile_samples(percentiles, from.samples.data(), from.samples.size());
+			}
+		}
+	}
+
+	// As the statistic of the same kind would report it
+	double eval(uint32_t group, const typename KeyedLayout<T>::Statistic& statistic,
+			const BasicQuantileStore<T>* store) const {
+		const size_t count = m_counts[group];
+		switch (statistic.kind) {
+		case Kind::Min:
+			return m_min[group];
+		case Kind::Max:
+			return m_max[group];
+		case Kind::Mean:
+			return count == 0 ? NAN : static_cast<double>(m_sums[group]) / count;
+		case Kind::Std:
+			return std::sqrt(moments(group).variance());
+		case Kind::Var:
+			return moments(group).variance();
+		case Kind::Skew:
+			return moments(group).skewness();
+		case Kind::Kurt:
+			return moments(group).kurtosis();
+		case Kind::Pct:
+			return store->quantile(statistic.percent);
+		}
+		return NAN;
+	}
+
+	KeyedLayout<T> m_layout;
+	KeyIndex m_index;
+	std::vector<T> m_pending;               // batch_size staged samples per key
+	std::vector<uint32_t> m_pending_counts; // staged samples per key
+	// Columns, one element per key; empty unless the layout needs them
+	std::vector<size_t> m_counts;
+	std::vector<T> m_min;
+	std::vector<T> m_max;
+	std::vector<sum_type> m_sums;
+	std::vector<double> m_means;
+	std::vector<double> m_m2;
+	std::vector<double> m_m3;
+	std::vector<double> m_m4;
+	std::vector<Percentiles> m_percentiles;
+	size_t m_samples{0};
+	size_t m_rejected{0};
+	double m_first_rejected{0};
+};
+
+// Parser for "key value" lines: the key is the first whitespace-separated
+// token, the value the second, a decimal number as for TextParser, and
+// nothing may follow. Blank lines are skipped. Same interface as TextParser,
+// with `sink(std::string_view key, double value)` called per line.
+class KeyedTextParser {
+public:
+	explicit KeyedTextParser(size_t offset = 0, size_t line = 1) : m_offset{offset}, m_line{line} {
+	}
+
+	// Parses the complete lines of [begin, end), and the final unterminated
+	// one if `last` is set. Returns where to resume, nullptr on error.
+	template <typename Sink>
+	const char* parse(const char* begin, const char* end, bool last, Sink&& sink) {
+		const char* pos = begin;
+		while (pos != end) {
+			auto newline = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+			if (newline == nullptr && !last) {
+				break;
+			}
+			const char* line_end = newline ? newline : end;
+			if (!parse_line(pos, line_end, sink)) {
+				m_error.line = m_line;
+				m_error.offset = m_offset + (pos - begin);
+				m_error.token.assign(pos, std::min<size_t>(line_end - pos, 32));
+				return nullptr;
+			}
+			pos = newline ? newline + 1 : end;
+			m_line += newline != nullptr;
+		}
+		m_offset += pos - begin;
+		return pos;
+	}
+
+	template <typename Sink>
+	void flush(Sink&&) {
+	}
+
+	void fail(std::string reason) {
+		m_error.reason = std::move(reason);
+	}
+
+	const InputError& error() const {
+		return m_error;
+	}
+
+private:
+	template <typename Sink>
+	static bool parse_line(const char* pos, const char* end, Sink& sink) {
+		auto skip_space = [&] {
+			while (pos != end && is_space(*pos)) {
+				++pos;
+			}
+		};
+		auto token = [&] {
+			const char* first = pos;
+			while (pos != end && !is_space(*pos)) {
+				++pos;
+			}
+			return first;
+		};
+		skip_space();
+		if (pos == end) {
+			return true;
+		}
+		const char* key = token();
+		std::string_view key_text{key, static_cast<size_t>(pos - key)};
+		skip_space();
+		const char* number = token();
+		double value;
+		if (number == pos || !parse_number(number, pos, value)) {
+			return false;
+		}
+		skip_space();
+		if (pos != end) {
+			return false;
+		}
+		sink(key_text, value);
+		return true;
+	}
+
+	size_t m_offset;
+	size_t m_line;
+	InputError m_error;
+};
+
+// Splits a mapped input into up to `parts` chunks of whole lines
+inline std::vector<InputChunk> split_lines(const MappedFile& file, size_t parts) {
+	std::vector<InputChunk> chunks;
+	const size_t size = file.size();
+	size_t begin = 0;
+	for (size_t i = 1; i <= parts && begin < size; ++i) {
+		size_t end = i == parts ? size : std::max(begin, size / parts * i);
+		auto newline = static_cast<const char*>(std::memchr(file.data() + end, '\n', size - end));
+		end = newline ? newline - file.data() + 1 : size;
+		chunks.push_back({begin, end});
+		begin = end;
+	}
+	return chunks;
+}
+
+// Parses the "key value" lines of one chunk of a mapped file. `error.line`
+// is counted from the chunk start; see resolve_error_line().
+template <typename Sink>
+bool read_keyed_chunk(const MappedFile& file, const InputChunk& chunk, Sink&& sink, InputError& error) {
+	ProfileScope scope{ProfileStage::Parse};
+	KeyedTextParser parser{chunk.begin};
+	if (parser.parse(file.data() + chunk.begin, file.data() + chunk.end, true, sink) == nullptr) {
+		std::string source = std::move(error.source);
+		error = parser.error();
+		error.source = std::move(source);
+		return false;
+	}
+	return true;
+}
+
+// Reads the "key value" lines of `path` (stdin when it is "-")
+template <typename Sink>
+bool read_keyed_samples(const char* path, Sink&& sink, InputError& error) {
+	if (std::strcmp(path, "-") == 0) {
+		KeyedTextParser parser;
+		bool ok = read_text_samples(STDIN_FILENO, parser, sink);
+		if (!ok) {
+			error = parser.error();
+		}
+		return ok;
+	}
+	error.source = path;
+	MappedFile file;
+	if (!file.open(path, error.reason)) {
+		return false;
+	}
+	return file.size() == 0 || read_keyed_chunk(file, InputChunk{0, file.size()}, sink, error);
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware events counted around a benchmark body
+struct PerfEvent {
+	const char* name;
+	uint32_t type;
+	uint64_t config;
+};
+
+// Hardware counters of the calling thread, user space only, read through
+// perf_event_open(2) as one group so all events cover the same instructions.
+// Events the CPU or kernel (perf_event_paranoid, virtual machines) doesn't
+// provide are left out; available() is false if none could be opened, and
+// the counters then do nothing. Linux only, elsewhere never available.
+class PerfCounters {
+public:
+	PerfCounters() {
+#if defined(__linux__)
+		const PerfEvent events[] = {
+			{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+			{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+			{"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+			{"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+			{"llc-loads", PERF_TYPE_HW_CACHE,
+				PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				(PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16)},
+		};
+		for (const PerfEvent& event : events) {
+			perf_event_attr attr{};
+			attr.size = sizeof(attr);
+			attr.type = event.type;
+			attr.config = event.config;
+			attr.disabled = m_leader < 0 ? 1 : 0; // the group runs when the leader does
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+				PERF_FORMAT_TOTAL_TIME_RUNNING;
+			int fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, m_leader, 0));
+			if (fd < 0) {
+				continue;
+			}
+			if (m_leader < 0) {
+				m_leader = fd;
+			}
+			m_fds.push_back(fd);
+			m_names.push_back(event.name);
+		}
+#endif
+	}
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	~PerfCounters() {
+#if defined(__linux__)
+		for (int fd : m_fds) {
+			::close(fd);
+		}
+#endif
+	}
+
+	bool available() const {
+		return m_leader >= 0;
+	}
+
+	// Names of the counted events, in the order of the totals stop() adds to
+	const std::vector<std::string>& names() const {
+		return m_names;
+	}
+
+	void start() {
+#if defined(__linux__)
+		if (available()) {
+			::ioctl(m_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			::ioctl(m_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+#endif
+	}
+
+	// Adds the counts since start() to `totals`, scaled up if the kernel had
+	// to multiplex the group with other users of the PMU
+	void stop(std::vector<double>& totals) {
+#if defined(__linux__)
+		if (!available()) {
+			return;
+		}
+		::ioctl(m_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		// nr, time_enabled, time_running, then one value per event
+		std::vector<uint64_t> data(3 + m_fds.size());
+		ssize_t bytes = ::read(m_leader, data.data(), data.size() * sizeof(uint64_t));
+		totals.resize(m_fds.size(), 0);
+		if (bytes != static_cast<ssize_t>(data.size() * sizeof(uint64_t)) || data[2] == 0) {
+			return;
+		}
+		double scale = static_cast<double>(data[1]) / static_cast<double>(data[2]);
+		for (size_t i = 0; i < m_fds.size(); ++i) {
+			totals[i] += static_cast<double>(data[3 + i]) * scale;
+		}
+#else
+		(void)totals;
+#endif
+	}
+
+private:
+	int m_leader{-1};
+	std::vector<int> m_fds;
+	std::vector<std::string> m_names;
+};
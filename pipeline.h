@@ -0,0 +1,333 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <unistd.h> // read
+
+#include "sample_input.h"
+
+// Bounded lock-free multi-producer/multi-consumer ring (D. Vyukov's design).
+// Every slot carries a sequence number telling whether it is ready to be
+// written or read, so producers and consumers only contend on their own index.
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) {
+		size_t size = 2;
+		while (size < capacity) {
+			size *= 2;
+		}
+		m_mask = size - 1;
+		m_slots = std::make_unique<Slot[]>(size);
+		for (size_t i = 0; i < size; ++i) {
+			m_slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	bool try_push(T value) {
+		size_t pos = m_tail.load(std::memory_order_relaxed);
+		while (true) {
+			Slot& slot = m_slots[pos & m_mask];
+			size_t sequence = slot.sequence.load(std::memory_order_acquire);
+			if (sequence == pos) {
+				if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					slot.value = std::move(value);
+					slot.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (sequence < pos) {
+				return false; // full
+			} else {
+				pos = m_tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(T& value) {
+		size_t pos = m_head.load(std::memory_order_relaxed);
+		while (true) {
+			Slot& slot = m_slots[pos & m_mask];
+			size_t sequence = slot.sequence.load(std::memory_order_acquire);
+			if (sequence == pos + 1) {
+				if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					value = std::move(slot.value);
+					slot.sequence.store(pos + m_mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (sequence < pos + 1) {
+				return false; // empty
+			} else {
+				pos = m_head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Blocking variants: spin briefly, yield for a while, then sleep until
+	// the other side makes progress, so a stage waiting on a slow pipe or a
+	// stalled producer doesn't burn its core
+	void push(T value) {
+		for (unsigned spins = 0; !try_push(value); ++spins) {
+			if (spins == spin_limit) {
+				park([&] { return try_push(value); });
+				break;
+			}
+			backoff(spins);
+		}
+		wake();
+	}
+
+	T pop() {
+		T value;
+		for (unsigned spins = 0; !try_pop(value); ++spins) {
+			if (spins == spin_limit) {
+				park([&] { return try_pop(value); });
+				break;
+			}
+			backoff(spins);
+		}
+		wake();
+		return value;
+	}
+
+private:
+	struct Slot {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	static constexpr unsigned spin_limit = 256;
+
+	static void backoff(unsigned spins) {
+		if (spins > 64) {
+			std::this_thread::yield();
+		}
+	}
+
+	// Sleeps until `retry()` succeeds. Registering in m_parked before the
+	// retry, and wake() checking it after its own push or pop, with a full
+	// fence on both sides, means one of them always sees the other: either
+	// the retry finds the slot, or wake() finds the sleeper.
+	template <typename Retry>
+	void park(Retry&& retry) {
+		std::unique_lock<std::mutex> lock{m_park_mutex};
+		m_parked.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		m_unparked.wait(lock, retry);
+		m_parked.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// Wakes the threads parked on this queue after a push or pop
+	void wake() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_parked.load(std::memory_order_relaxed) != 0) {
+			{
+				std::lock_guard<std::mutex> lock{m_park_mutex}; // a sleeper is between retry and wait, or waiting
+			}
+			m_unparked.notify_all();
+		}
+	}
+
+	static constexpr size_t cache_line = 64;
+
+	std::unique_ptr<Slot[]> m_slots;
+	size_t m_mask;
+	alignas(cache_line) std::atomic<size_t> m_head{0};
+	alignas(cache_line) std::atomic<size_t> m_tail{0};
+	alignas(cache_line) std::atomic<unsigned> m_parked{0};
+	std::mutex m_park_mutex;
+	std::condition_variable m_unparked;
+};
+
+struct PipelineConfig {
+	size_t parsers{1};
+	size_t aggregators{1};
+	size_t raw_block_size{1 << 20};    // bytes handed from the reader to a parser
+	size_t sample_block_size{1 << 16}; // samples handed from a parser to an aggregator
+};
+
+// Splits `threads` between parsing and aggregation. Parsing text is by far the
+// most expensive stage, so it gets most of the cores; one core is left to the reader.
+inline PipelineConfig make_pipeline_config(size_t threads) {
+	PipelineConfig config;
+	config.aggregators = std::max<size_t>(1, threads / 4);
+	config.parsers = threads > config.aggregators + 1 ? threads - config.aggregators - 1 : 1;
+	return config;
+}
+
+// Reads text samples from a stream (e.g. a pipe) in three overlapping stages:
+// one thread reads raw blocks cut at token boundaries, `config.parsers` threads
+// parse them into sample buffers and one thread per element of `aggregators`
+// feeds those buffers through `update(aggregator, data, count)`. Raw blocks and
+// sample buffers are recycled through free lists, so the steady state doesn't
+// allocate. Samples reach the aggregators in no particular order.
+template <typename Aggregator, typename Update>
+bool read_pipelined(int fd, const PipelineConfig& config, std::vector<Aggregator>& aggregators,
+		Update&& update, InputError& error) {
+	struct RawBlock {
+		std::vector<char> data;
+		size_t size;
+		size_t offset; // of data[0] in the stream
+		size_t line;   // line number at data[0]
+	};
+	struct SampleBuffer {
+		std::vector<double> values;
+		size_t count;
+	};
+
+	const size_t parsers = std::max<size_t>(1, config.parsers);
+	const size_t raw_blocks = parsers * 2 + 2;
+	const size_t sample_buffers = aggregators.size() * 4 + parsers * 2;
+	std::vector<RawBlock> raw_storage(raw_blocks);
+	std::vector<SampleBuffer> sample_storage(sample_buffers);
+	// Queues are as large as the pools, so a push never has to wait
+	BoundedQueue<RawBlock*> free_raw{raw_blocks}, filled_raw{raw_blocks + parsers};
+	BoundedQueue<SampleBuffer*> free_samples{sample_buffers},
+		filled_samples{sample_buffers + aggregators.size()};
+	for (RawBlock& block : raw_storage) {
+		block.data.resize(config.raw_block_size);
+		free_raw.push(&block);
+	}
+	for (SampleBuffer& buffer : sample_storage) {
+		buffer.values.resize(config.sample_block_size);
+		free_samples.push(&buffer);
+	}
+
+	std::atomic<bool> failed{false};
+	std::mutex error_mutex;
+	bool has_error = false;
+	auto report = [&](const InputError& found) {
+		std::lock_guard<std::mutex> lock{error_mutex};
+		// Keep the error that comes first in the input
+		if (!has_error || found.offset < error.offset) {
+			error = found;
+			has_error = true;
+		}
+		failed.store(true, std::memory_order_relaxed);
+	};
+
+	std::thread reader{[&] {
+		std::vector<char> tail;
+		size_t offset = 0, line = 1;
+		bool at_eof = false;
+		while (!at_eof && !failed.load(std::memory_order_relaxed)) {
+			RawBlock* block = free_raw.pop();
+			if (block->data.size() < tail.size() * 2) {
+				block->data.resize(tail.size() * 2); // a token longer than a block
+			}
+			std::memcpy(block->data.data(), tail.data(), tail.size());
+			size_t filled = tail.size();
+			while (filled < block->data.size()) {
+				ssize_t got;
+				{
+					ProfileScope scope{ProfileStage::Read};
+					got = ::read(fd, block->data.data() + filled, block->data.size() - filled);
+				}
+				if (got < 0 && errno == EINTR) {
+					continue;
+				}
+				if (got < 0) {
+					InputError read_error;
+					read_error.reason = std::string{"read failed: "} + std::strerror(errno);
+					report(read_error);
+				}
+				if (got <= 0) {
+					at_eof = true;
+					break;
+				}
+				filled += static_cast<size_t>(got);
+			}
+			// Cut behind the last whitespace, the partial token goes to the next block
+			size_t cut = filled;
+			if (!at_eof) {
+				while (cut > 0 && !is_space(block->data[cut - 1])) {
+					--cut;
+				}
+			}
+			tail.assign(block->data.begin() + cut, block->data.begin() + filled);
+			block->size = cut;
+			block->offset = offset;
+			block->line = line;
+			offset += cut;
+			line += std::count(block->data.begin(), block->data.begin() + cut, '\n');
+			filled_raw.push(block);
+		}
+		for (size_t i = 0; i < parsers; ++i) {
+			filled_raw.push(nullptr);
+		}
+	}};
+
+	std::atomic<size_t> active_parsers{parsers};
+	std::vector<std::thread> parser_threads;
+	for (size_t p = 0; p < parsers; ++p) {
+		parser_threads.emplace_back([&] {
+			SampleBuffer* buffer = free_samples.pop();
+			buffer->count = 0;
+			auto sink = [&](const double* data, size_t count) {
+				while (count != 0) {
+					size_t n = std::min(count, buffer->values.size() - buffer->count);
+					std::memcpy(buffer->values.data() + buffer->count, data, n * sizeof(double));
+					buffer->count += n;
+					data += n;
+					count -= n;
+					if (buffer->count == buffer->values.size()) {
+						filled_samples.push(buffer);
+						buffer = free_samples.pop();
+						buffer->count = 0;
+					}
+				}
+			};
+			while (RawBlock* block = filled_raw.pop()) {
+				if (!failed.load(std::memory_order_relaxed)) {
+					ProfileScope scope{ProfileStage::Parse};
+					TextParser parser{block->offset, block->line};
+					const char* begin = block->data.data();
+					if (parser.parse(begin, begin + block->size, true, sink) == nullptr) {
+						report(parser.error());
+					}
+					parser.flush(sink);
+				}
+				free_raw.push(block);
+			}
+			filled_samples.push(buffer);
+			// The last parser to finish tells the aggregators to stop
+			if (active_parsers.fetch_sub(1) == 1) {
+				for (size_t i = 0; i < aggregators.size(); ++i) {
+					filled_samples.push(nullptr);
+				}
+			}
+		});
+	}
+
+	std::vector<std::thread> aggregator_threads;
+	for (Aggregator& aggregator : aggregators) {
+		aggregator_threads.emplace_back([&] {
+			const size_t block_size = TextParser::block_size;
+			while (SampleBuffer* buffer = filled_samples.pop()) {
+				// Feed in cache-sized blocks, like the sequential path does
+				for (size_t done = 0; done < buffer->count; done += block_size) {
+					update(aggregator, buffer->values.data() + done, std::min(block_size, buffer->count - done));
+				}
+				free_samples.push(buffer);
+			}
+		});
+	}
+
+	reader.join();
+	for (auto& thread : parser_threads) {
+		thread.join();
+	}
+	for (auto& thread : aggregator_threads) {
+		thread.join();
+	}
+	return !has_error;
+}
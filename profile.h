@@ -0,0 +1,265 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+// Self-profiling of the statistics tool (--profile). It is only compiled in
+// when STATISTICS_PROFILE is defined (cmake -DSTATISTICS_PROFILE=ON); without
+// it ProfileScope is an empty object and profile_statistic() a plain call,
+// so the hot paths are exactly what they are without profiling.
+//
+// Time is taken with steady_clock once per block, not per sample. Scopes
+// nest: a stage's time excludes the stages started inside it, so the time
+// of parsing a buffer doesn't include aggregating the samples parsed from it.
+// Per-statistic times are part of the aggregate stage; the min/max/sum
+// summary of a block is shared, and counts for the first statistic asking.
+
+enum class ProfileStage {
+	Read,      // read() from stdin, opening and mapping files
+	Parse,     // text parsing, binary sample decoding
+	Convert,   // conversion to the --type sample type
+	Aggregate, // statistics updates
+	Merge,     // merging partial results of threads and states
+	Report     // evaluating and printing the results
+};
+
+#if defined(STATISTICS_PROFILE)
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+#include <sys/resource.h> // getrusage
+
+class Profiler {
+public:
+	static constexpr size_t stage_count = 6;
+	static constexpr size_t max_statistics = 32; // per-statistic counters kept for the first ones
+
+	struct Counter {
+		std::atomic<uint64_t> calls{0};
+		std::atomic<uint64_t> samples{0};
+		std::atomic<uint64_t> nanoseconds{0};
+
+		void add(uint64_t count, uint64_t ns) {
+			calls.fetch_add(1, std::memory_order_relaxed);
+			samples.fetch_add(count, std::memory_order_relaxed);
+			nanoseconds.fetch_add(ns, std::memory_order_relaxed);
+		}
+	};
+
+	static Profiler& instance() {
+		static Profiler profiler;
+		return profiler;
+	}
+
+	static bool enabled() {
+		return instance().m_enabled.load(std::memory_order_relaxed);
+	}
+
+	void enable() {
+		m_start = std::chrono::steady_clock::now();
+		m_enabled = true;
+	}
+
+	Counter& stage(ProfileStage stage) {
+		return m_stages[static_cast<size_t>(stage)];
+	}
+
+	// Counter of the index-th statistic of a set, named after the first one
+	// reported there; nullptr past max_statistics
+	template <typename Statistic>
+	Counter* statistic(size_t index, const Statistic& statistic) {
+		if (index >= max_statistics) {
+			return nullptr;
+		}
+		if (!m_named[index].load(std::memory_order_acquire)) {
+			std::lock_guard<std::mutex> lock{m_mutex};
+			if (!m_named[index].load(std::memory_order_relaxed)) {
+				m_names[index] = statistic.name();
+				m_named[index].store(true, std::memory_order_release);
+			}
+		}
+		return &m_statistics[index];
+	}
+
+	// Allocations of the process (see counting_new.h), for the report
+	void set_allocations(uint64_t count, uint64_t bytes) {
+		m_allocations = count;
+		m_allocated_bytes = bytes;
+	}
+
+	void report(std::ostream& out) const {
+		double wall = elapsed_seconds();
+		char line[160];
+		std::snprintf(line, sizeof(line), "profile: %.6f s wall, peak RSS %.1f MiB, %llu allocations (%.1f MiB)\n",
+			wall, peak_rss() / 1048576.0, static_cast<unsigned long long>(count(m_allocations)),
+			count(m_allocated_bytes) / 1048576.0);
+		out << line;
+		std::snprintf(line, sizeof(line), "  %-24s %12s %7s %10s %12s %9s\n",
+			"stage", "seconds", "share", "calls", "samples", "ns/sample");
+		out << line;
+		for (size_t i = 0; i < stage_count; ++i) {
+			print_counter(out, stage_names[i], m_stages[i], wall);
+		}
+		for (size_t i = 0; i < max_statistics; ++i) {
+			if (m_named[i]) {
+				print_counter(out, ("  " + m_names[i]).c_str(), m_statistics[i], wall);
+			}
+		}
+	}
+
+	void report_json(std::ostream& out) const {
+		std::streamsize precision = out.precision(10);
+		out << "{\"wall_seconds\": " << elapsed_seconds() << ", \"peak_rss_bytes\": " << peak_rss()
+			<< ", \"allocations\": " << count(m_allocations)
+			<< ", \"allocated_bytes\": " << count(m_allocated_bytes) << ",\n \"stages\": {";
+		for (size_t i = 0; i < stage_count; ++i) {
+			out << (i == 0 ? "\n  " : ",\n  ") << "\"" << stage_names[i] << "\": ";
+			write_counter(out, m_stages[i]);
+		}
+		out << "},\n \"statistics\": [";
+		bool first = true;
+		for (size_t i = 0; i < max_statistics; ++i) {
+			if (m_named[i]) {
+				out << (first ? "\n  " : ",\n  ") << "{\"name\": \"" << m_names[i] << "\", \"counters\": ";
+				write_counter(out, m_statistics[i]);
+				out << "}";
+				first = false;
+			}
+		}
+		out << "]}\n";
+		out.precision(precision);
+	}
+
+private:
+	static constexpr const char* stage_names[stage_count] = {
+		"read", "parse", "convert", "aggregate", "merge", "report"};
+
+	static uint64_t count(const std::atomic<uint64_t>& value) {
+		return value.load(std::memory_order_relaxed);
+	}
+
+	double elapsed_seconds() const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+	}
+
+	static size_t peak_rss() {
+		rusage usage{};
+		::getrusage(RUSAGE_SELF, &usage);
+		return static_cast<size_t>(usage.ru_maxrss) * 1024;
+	}
+
+	static void print_counter(std::ostream& out, const char* name, const Counter& counter, double wall) {
+		double seconds = count(counter.nanoseconds) * 1e-9;
+		uint64_t samples = count(counter.samples);
+		char line[160];
+		std::snprintf(line, sizeof(line), "  %-24s %12.6f %6.1f%% %10llu %12llu %9.3g\n", name, seconds,
+			wall > 0 ? 100 * seconds / wall : 0.0, static_cast<unsigned long long>(count(counter.calls)),
+			static_cast<unsigned long long>(samples), samples ? seconds * 1e9 / samples : 0.0);
+		out << line;
+	}
+
+	static void write_counter(std::ostream& out, const Counter& counter) {
+		out << "{\"seconds\": " << count(counter.nanoseconds) * 1e-9 << ", \"calls\": " << count(counter.calls)
+			<< ", \"samples\": " << count(counter.samples) << "}";
+	}
+
+	std::atomic<bool> m_enabled{false};
+	std::chrono::steady_clock::time_point m_start;
+	Counter m_stages[stage_count];
+	Counter m_statistics[max_statistics];
+	std::atomic<bool> m_named[max_statistics] = {};
+	std::string m_names[max_statistics];
+	std::mutex m_mutex;
+	std::atomic<uint64_t> m_allocations{0};
+	std::atomic<uint64_t> m_allocated_bytes{0};
+};
+
+// Times its lifetime into a counter, minus the scopes opened inside it on the
+// same thread. A detached scope (per-statistic times) is neither subtracted
+// from the enclosing scope nor a parent of scopes opened inside it.
+class ProfileScope {
+public:
+	explicit ProfileScope(ProfileStage stage, size_t samples = 0)
+		: ProfileScope(Profiler::enabled() ? &Profiler::instance().stage(stage) : nullptr, samples, true) {
+	}
+
+	ProfileScope(Profiler::Counter* counter, size_t samples, bool attached)
+		: m_counter{counter}, m_samples{samples}, m_attached{attached} {
+		if (m_counter && m_attached) {
+			m_parent = current();
+			current() = this;
+		}
+		if (m_counter) {
+			m_start = std::chrono::steady_clock::now();
+		}
+	}
+
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+
+	~ProfileScope() {
+		if (m_counter) {
+			auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - m_start).count();
+			uint64_t total = static_cast<uint64_t>(elapsed);
+			m_counter->add(m_samples, total > m_children ? total - m_children : 0);
+			if (m_attached) {
+				current() = m_parent;
+				if (m_parent) {
+					m_parent->m_children += total;
+				}
+			}
+		}
+	}
+
+	// Samples handled in the scope, if only known at its end
+	void set_samples(size_t samples) {
+		m_samples = samples;
+	}
+
+private:
+	static ProfileScope*& current() {
+		static thread_local ProfileScope* scope = nullptr;
+		return scope;
+	}
+
+	Profiler::Counter* m_counter;
+	size_t m_samples;
+	bool m_attached;
+	ProfileScope* m_parent{nullptr};
+	uint64_t m_children{0};
+	std::chrono::steady_clock::time_point m_start;
+};
+
+// Calls f(), the update of the index-th statistic of a set, timed per
+// statistic; the time still counts for the enclosing (aggregate) stage
+template <typename Statistic, typename F>
+inline void profile_statistic(size_t index, const Statistic& statistic, size_t samples, F&& f) {
+	Profiler::Counter* counter = Profiler::enabled() ? Profiler::instance().statistic(index, statistic) : nullptr;
+	ProfileScope scope{counter, samples, false};
+	f();
+}
+
+#else
+
+class ProfileScope {
+public:
+	explicit ProfileScope(ProfileStage, size_t = 0) {
+	}
+
+	void set_samples(size_t) {
+	}
+};
+
+template <typename Statistic, typename F>
+inline void profile_statistic(size_t, const Statistic&, size_t, F&& f) {
+	f();
+}
+
+#endif
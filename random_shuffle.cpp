@@ -1,46 +1,148 @@
-#include <iostream>
-
-#include <algorithm> // std::shuffle
-#include <chrono> 	 // std::chrono::system_clock
-#include <random>	 // std::default_random_engine
-
-#include <vector>
-
-// Implement operator<< for the vector-class to print all elements
-template<typename T>
-std::ostream& operator<<(std::ostream& os, const std::vector<T>& values) {
-	for (auto iter = values.cbegin(); iter != values.cend(); ++iter) {
-		if (iter != values.cbegin())
-			os << ' ';
-		os << *iter;
-	}
-	return os;
-}
-
-template<typename T>
-void make_random_shuffle(std::vector<T>& values) {
-	// 1. Take current time (count of seconds since `epoch begining`) as a seed
-	auto seconds_count = std::chrono::system_clock::now().time_since_epoch().count();
-	unsigned int seed = static_cast<unsigned int>(seconds_count);
-	// 2. Initialize random engine
-	std::default_random_engine engine{seed};
-	// 3. Shuffle values
-	std::shuffle(values.begin(), values.end(), engine);
-}
-
-int main() {
-
-	std::vector<int> values{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
-	std::cout << "values before random shuffle:" << std::endl;
-	std::cout << values << std::endl;
-
-	make_random_shuffle(values);
-	std::cout << "values after random shuffle:" << std::endl;
-	std::cout << values << std::endl;
-
-	make_random_shuffle(values);
-	std::cout << "values after one more random shuffle:" << std::endl;
-	std::cout << values << std::endl;
-
-	return 0;
-}
\ No newline at end of file
+#include <iostream>
+
+#include <algorithm> // std::max
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>   // std::iota
+#include <string>
+#include <thread>    // std::thread::hardware_concurrency
+#include <type_traits>
+#include <unistd.h>  // STDOUT_FILENO
+
+#include <vector>
+
+#include "sample_output.h"
+#include "shuffle.h"
+
+// Implement operator<< for the vector-class to print all elements. Numbers
+// are formatted in blocks with std::to_chars and written per block.
+template<typename T>
+std::ostream& operator<<(std::ostream& os, const std::vector<T>& values) {
+	if constexpr (std::is_arithmetic<T>::value) {
+		std::vector<char> block;
+		format_samples(values.data(), values.size(), ' ', block, [&](const char* data, size_t size) {
+			os.write(data, static_cast<std::streamsize>(size));
+		});
+	} else {
+		for (auto iter = values.cbegin(); iter != values.cend(); ++iter) {
+			if (iter != values.cbegin())
+				os << ' ';
+			os << *iter;
+		}
+	}
+	return os;
+}
+
+// Random engines to shuffle with, see shuffle.h
+enum class EngineKind {
+	Xoshiro256,
+	Pcg32,
+	Wyrand
+};
+
+bool parse_engine(const char* text, EngineKind& kind) {
+	if (std::strcmp(text, "xoshiro256") == 0) {
+		kind = EngineKind::Xoshiro256;
+	} else if (std::strcmp(text, "pcg32") == 0) {
+		kind = EngineKind::Pcg32;
+	} else if (std::strcmp(text, "wyrand") == 0) {
+		kind = EngineKind::Wyrand;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+template<typename Engine, typename T>
+void make_random_shuffle(std::vector<T>& values, uint64_t seed, size_t threads) {
+	if (threads == 0) {
+		make_random_shuffle<Engine>(values, seed);
+	} else {
+		parallel_shuffle<typename std::vector<T>::iterator, Engine>(values.begin(), values.end(), seed, threads);
+	}
+}
+
+// Serial Fisher-Yates unless `threads` is set; the parallel shuffle gives
+// another (but equally reproducible) permutation for the same seed
+template<typename T>
+void make_random_shuffle(std::vector<T>& values, EngineKind kind, uint64_t seed, size_t threads) {
+	switch (kind) {
+	case EngineKind::Xoshiro256: make_random_shuffle<Xoshiro256>(values, seed, threads); break;
+	case EngineKind::Pcg32: make_random_shuffle<Pcg32>(values, seed, threads); break;
+	case EngineKind::Wyrand: make_random_shuffle<Wyrand>(values, seed, threads); break;
+	}
+}
+
+// Usage: random_shuffle [--seed N] [--engine xoshiro256|pcg32|wyrand] [--count N]
+//                       [--threads N] [--output text|f64|f32]
+// Shuffles 0..N-1 (default 0..10) twice. --threads switches to the parallel
+// scatter shuffle on N threads (0: all cores), whose result for a seed
+// doesn't depend on N. Every shuffle uses its own seed derived from --seed,
+// so the same --seed and --engine always print the same permutations;
+// without --seed a random one is chosen and printed.
+// --output shuffles once and writes just the values to stdout, one number
+// per line or as raw little-endian doubles/floats, as input for
+// `statistics [--format f64|f32]`; the seed then goes to stderr.
+int main(int argc, char* argv[]) {
+	uint64_t seed = 0;
+	bool has_seed = false;
+	EngineKind kind = EngineKind::Xoshiro256;
+	size_t count = 11;
+	size_t threads = 0;
+	bool has_output = false;
+	InputFormat output = InputFormat::Text;
+	for (int i = 1; i < argc; ++i) {
+		bool has_value = i + 1 < argc;
+		if (std::strcmp(argv[i], "--seed") == 0 && has_value) {
+			seed = std::strtoull(argv[++i], nullptr, 0);
+			has_seed = true;
+		} else if (std::strcmp(argv[i], "--engine") == 0 && has_value && parse_engine(argv[i + 1], kind)) {
+			++i;
+		} else if (std::strcmp(argv[i], "--threads") == 0 && has_value) {
+			threads = std::strtoul(argv[++i], nullptr, 10);
+			if (threads == 0) {
+				threads = std::max(1u, std::thread::hardware_concurrency());
+			}
+		} else if (std::strcmp(argv[i], "--output") == 0 && has_value && parse_input_format(argv[i + 1], output)) {
+			has_output = true;
+			++i;
+		} else if (std::strcmp(argv[i], "--count") == 0 && has_value) {
+			count = std::strtoull(argv[++i], nullptr, 10);
+		} else {
+			std::cerr << "Unknown option: " << argv[i] << "\n";
+			return 1;
+		}
+	}
+	if (!has_seed) {
+		seed = random_seed();
+	}
+	SplitMix64 seeds{seed};
+
+	std::vector<int> values(count);
+	std::iota(values.begin(), values.end(), 0);
+	if (has_output) {
+		std::cerr << "seed: " << seed << std::endl;
+		make_random_shuffle(values, kind, seeds(), threads);
+		SampleWriter writer{STDOUT_FILENO, output};
+		writer.write(values.data(), values.size());
+		if (!writer.flush()) {
+			std::cerr << writer.error() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+	std::cout << "seed: " << seed << std::endl;
+	std::cout << "values before random shuffle:" << std::endl;
+	std::cout << values << std::endl;
+
+	make_random_shuffle(values, kind, seeds(), threads);
+	std::cout << "values after random shuffle:" << std::endl;
+	std::cout << values << std::endl;
+
+	make_random_shuffle(values, kind, seeds(), threads);
+	std::cout << "values after one more random shuffle:" << std::endl;
+	std::cout << values << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,369 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h> // mmap, madvise
+
+// Pool of large fixed-size blocks for sample storage. Blocks are mapped
+// straight from the kernel, so untouched pages cost nothing, and released
+// blocks are kept for reuse instead of being unmapped. With huge pages the
+// blocks are aligned to (and as large as) a 2 MiB huge page and marked
+// MADV_HUGEPAGE, which saves TLB misses when selecting over 100M samples.
+class BlockPool {
+public:
+	static constexpr size_t block_bytes = size_t{2} << 20;
+
+	explicit BlockPool(bool huge_pages = false, size_t max_free = 64)
+		: m_huge_pages{huge_pages}, m_max_free{max_free} {
+	}
+
+	BlockPool(const BlockPool&) = delete;
+	BlockPool& operator=(const BlockPool&) = delete;
+
+	~BlockPool() {
+		for (void* block : m_free) {
+			::munmap(block, block_bytes);
+		}
+	}
+
+	// Process-wide pool. STATISTICS_HUGE_PAGES=1 asks for huge-page backing.
+	static BlockPool& shared() {
+		static BlockPool pool{huge_pages_requested()};
+		return pool;
+	}
+
+	// Throws std::bad_alloc if no memory can be mapped
+	void* acquire() {
+		m_acquired_bytes += block_bytes;
+		{
+			std::lock_guard<std::mutex> lock{m_mutex};
+			if (!m_free.empty()) {
+				void* block = m_free.back();
+				m_free.pop_back();
+				return block;
+			}
+		}
+		return m_huge_pages ? map_huge_block() : map_block(block_bytes);
+	}
+
+	void release(void* block) {
+		{
+			std::lock_guard<std::mutex> lock{m_mutex};
+			if (m_free.size() < m_max_free) {
+				m_free.push_back(block);
+				return;
+			}
+		}
+		::munmap(block, block_bytes);
+	}
+
+	// Bytes handed out by acquire() so far, reused blocks included, for
+	// allocation statistics next to those of operator new
+	size_t acquired_bytes() const {
+		return m_acquired_bytes;
+	}
+
+private:
+	static bool huge_pages_requested() {
+		const char* value = std::getenv("STATISTICS_HUGE_PAGES");
+		return value != nullptr && std::strcmp(value, "0") != 0 && *value != '\0';
+	}
+
+	static void* map_block(size_t bytes) {
+		void* block = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (block == MAP_FAILED) {
+			throw std::bad_alloc{};
+		}
+		return block;
+	}
+
+	// Maps twice the block size and trims it to a block-aligned block
+	static void* map_huge_block() {
+		char* area = static_cast<char*>(map_block(2 * block_bytes));
+		uintptr_t address = reinterpret_cast<uintptr_t>(area);
+		char* block = area + ((block_bytes - address % block_bytes) % block_bytes);
+		if (block != area) {
+			::munmap(area, block - area);
+		}
+		if (block + block_bytes != area + 2 * block_bytes) {
+			::munmap(block + block_bytes, area + 2 * block_bytes - (block + block_bytes));
+		}
+#ifdef MADV_HUGEPAGE
+		::madvise(block, block_bytes, MADV_HUGEPAGE);
+#endif
+		return block;
+	}
+
+	bool m_huge_pages;
+	size_t m_max_free;
+	std::mutex m_mutex;
+	std::vector<void*> m_free;
+	std::atomic<size_t> m_acquired_bytes{0};
+};
+
+// log2 of the number of samples of `size` bytes in one BlockPool block
+constexpr size_t block_shift_for(size_t size) {
+	size_t shift = 0;
+	while ((size << (shift + 1)) <= BlockPool::block_bytes) {
+		++shift;
+	}
+	return shift;
+}
+
+// Random-access iterator over the samples of a BasicChunkedSamples
+template <typename Value>
+class ChunkIterator {
+public:
+	using value_type = std::remove_const_t<Value>;
+	static constexpr size_t block_shift = block_shift_for(sizeof(value_type));
+	static constexpr size_t block_mask = (size_t{1} << block_shift) - 1;
+
+	using iterator_category = std::random_access_iterator_tag;
+	using difference_type = std::ptrdiff_t;
+	using pointer = Value*;
+	using reference = Value&;
+
+	ChunkIterator() = default;
+
+	ChunkIterator(value_type* const* blocks, size_t index) : m_blocks{blocks}, m_index{index} {
+	}
+
+	// iterator -> const_iterator
+	operator ChunkIterator<const value_type>() const {
+		return {m_blocks, m_index};
+	}
+
+	reference operator*() const {
+		return m_blocks[m_index >> block_shift][m_index & block_mask];
+	}
+
+	pointer operator->() const {
+		return &**this;
+	}
+
+	reference operator[](difference_type n) const {
+		return *(*this + n);
+	}
+
+	ChunkIterator& operator++() {
+		++m_index;
+		return *this;
+	}
+
+	ChunkIterator operator++(int) {
+		ChunkIterator old = *this;
+		++m_index;
+		return old;
+	}
+
+	ChunkIterator& operator--() {
+		--m_index;
+		return *this;
+	}
+
+	ChunkIterator operator--(int) {
+		ChunkIterator old = *this;
+		--m_index;
+		return old;
+	}
+
+	ChunkIterator& operator+=(difference_type n) {
+		m_index += n;
+		return *this;
+	}
+
+	ChunkIterator& operator-=(difference_type n) {
+		m_index -= n;
+		return *this;
+	}
+
+	friend ChunkIterator operator+(ChunkIterator it, difference_type n) {
+		return it += n;
+	}
+
+	friend ChunkIterator operator+(difference_type n, ChunkIterator it) {
+		return it += n;
+	}
+
+	friend ChunkIterator operator-(ChunkIterator it, difference_type n) {
+		return it -= n;
+	}
+
+	friend difference_type operator-(const ChunkIterator& a, const ChunkIterator& b) {
+		return static_cast<difference_type>(a.m_index) - static_cast<difference_type>(b.m_index);
+	}
+
+	friend bool operator==(const ChunkIterator& a, const ChunkIterator& b) {
+		return a.m_index == b.m_index;
+	}
+
+	friend bool operator!=(const ChunkIterator& a, const ChunkIterator& b) {
+		return a.m_index != b.m_index;
+	}
+
+	friend bool operator<(const ChunkIterator& a, const ChunkIterator& b) {
+		return a.m_index < b.m_index;
+	}
+
+	friend bool operator>(const ChunkIterator& a, const ChunkIterator& b) {
+		return a.m_index > b.m_index;
+	}
+
+	friend bool operator<=(const ChunkIterator& a, const ChunkIterator& b) {
+		return a.m_index <= b.m_index;
+	}
+
+	friend bool operator>=(const ChunkIterator& a, const ChunkIterator& b) {
+		return a.m_index >= b.m_index;
+	}
+
+private:
+	value_type* const* m_blocks{nullptr};
+	size_t m_index{0};
+};
+
+// Growable sample array made of fixed-size blocks from a BlockPool: growing
+// only ever adds a block, so samples are never copied and the peak memory is
+// the data plus at most one partly filled block (a vector briefly needs up to
+// three times the data while it reallocates).
+template <typename T>
+class BasicChunkedSamples {
+public:
+	using iterator = ChunkIterator<T>;
+	using const_iterator = ChunkIterator<const T>;
+
+	static constexpr size_t block_size = size_t{1} << iterator::block_shift;
+	static_assert(block_size * sizeof(T) == BlockPool::block_bytes, "a block is one pool block");
+
+	explicit BasicChunkedSamples(BlockPool& pool = BlockPool::shared()) : m_pool{&pool} {
+	}
+
+	BasicChunkedSamples(const BasicChunkedSamples&) = delete;
+	BasicChunkedSamples& operator=(const BasicChunkedSamples&) = delete;
+
+	BasicChunkedSamples(BasicChunkedSamples&& other) noexcept
+		: m_pool{other.m_pool}, m_blocks{std::move(other.m_blocks)}, m_size{other.m_size} {
+		other.m_blocks.clear();
+		other.m_size = 0;
+	}
+
+	BasicChunkedSamples& operator=(BasicChunkedSamples&& other) noexcept {
+		if (this != &other) {
+			clear();
+			m_pool = other.m_pool;
+			m_blocks = std::move(other.m_blocks);
+			m_size = other.m_size;
+			other.m_blocks.clear();
+			other.m_size = 0;
+		}
+		return *this;
+	}
+
+	~BasicChunkedSamples() {
+		clear();
+	}
+
+	void push_back(T value) {
+		if (m_size == m_blocks.size() * block_size) {
+			add_block();
+		}
+		(*this)[m_size++] = value;
+	}
+
+	void append(const T* data, size_t count) {
+		while (count != 0) {
+			if (m_size == m_blocks.size() * block_size) {
+				add_block();
+			}
+			size_t offset = m_size & iterator::block_mask;
+			size_t n = std::min(count, block_size - offset);
+			std::memcpy(m_blocks.back() + offset, data, n * sizeof(T));
+			m_size += n;
+			data += n;
+			count -= n;
+		}
+	}
+
+	// Calls f(data, count) for each block of consecutive samples, in order
+	template <typename F>
+	void for_each_block(F&& f) const {
+		for (size_t done = 0, i = 0; done < m_size; done += block_size, ++i) {
+			f(static_cast<const T*>(m_blocks[i]), std::min(block_size, m_size - done));
+		}
+	}
+
+	T& operator[](size_t index) {
+		return m_blocks[index >> iterator::block_shift][index & iterator::block_mask];
+	}
+
+	T operator[](size_t index) const {
+		return m_blocks[index >> iterator::block_shift][index & iterator::block_mask];
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+
+	bool empty() const {
+		return m_size == 0;
+	}
+
+	// Drops the samples from `size` on and hands unused blocks back to the pool
+	void truncate(size_t size) {
+		if (size >= m_size) {
+			return;
+		}
+		m_size = size;
+		size_t needed = (size + block_size - 1) / block_size;
+		while (m_blocks.size() > needed) {
+			m_pool->release(m_blocks.back());
+			m_blocks.pop_back();
+		}
+	}
+
+	void clear() {
+		truncate(0);
+	}
+
+	iterator begin() {
+		return {m_blocks.data(), 0};
+	}
+
+	iterator end() {
+		return {m_blocks.data(), m_size};
+	}
+
+	const_iterator begin() const {
+		return {m_blocks.data(), 0};
+	}
+
+	const_iterator end() const {
+		return {m_blocks.data(), m_size};
+	}
+
+private:
+	void add_block() {
+		// Make room first, so a failing push_back can't leak the block
+		if (m_blocks.size() == m_blocks.capacity()) {
+			m_blocks.reserve(std::max<size_t>(8, m_blocks.capacity() * 2));
+		}
+		m_blocks.push_back(static_cast<T*>(m_pool->acquire()));
+	}
+
+	BlockPool* m_pool;
+	std::vector<T*> m_blocks;
+	size_t m_size{0};
+};
+
+using ChunkedSamples = BasicChunkedSamples<double>;
@@ -0,0 +1,438 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // read
+
+#include "profile.h"
+
+// Where and why reading samples stopped
+struct InputError {
+	std::string source; // file name, empty for stdin
+	std::string reason;
+	size_t line{0};   // 1-based
+	size_t offset{0}; // byte offset from the start of the input
+	std::string token;
+
+	std::string describe() const {
+		std::string text = "Invalid input data";
+		if (!source.empty()) {
+			text += " in " + source;
+		}
+		if (!reason.empty()) {
+			text += ": " + reason;
+			return text;
+		}
+		text += " at line " + std::to_string(line) + ", offset " + std::to_string(offset);
+		if (!token.empty()) {
+			text += ": '" + token + "'";
+		}
+		return text;
+	}
+};
+
+inline bool is_space(char c) {
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Parses the decimal number [first, last) the way `std::cin >> double` does.
+// from_chars rejects a leading '+' and accepts inf/nan, iostreams do the
+// opposite: keep the iostream behaviour.
+inline bool parse_number(const char* first, const char* last, double& value) {
+	if (*first == '+') {
+		++first;
+	}
+	const char* digits = first != last && *first == '-' ? first + 1 : first;
+	if (digits == last || !((*digits >= '0' && *digits <= '9') || *digits == '.')) {
+		return false;
+	}
+	auto [ptr, ec] = std::from_chars(first, last, value);
+	return ec == std::errc{} && ptr == last;
+}
+
+// Parser for whitespace-separated decimal numbers (the format `std::cin >> double`
+// accepts). Parsed samples are collected into blocks and handed to
+// `sink(const double* data, size_t count)` one block at a time.
+class TextParser {
+public:
+	static constexpr size_t block_size = 4096;
+
+	// `offset` and `line` locate the first byte that will be passed to parse()
+	explicit TextParser(size_t offset = 0, size_t line = 1)
+		: m_block(block_size), m_offset{offset}, m_line{line} {
+	}
+
+	// Parses the tokens of [begin, end). `begin` must be where the previous
+	// call stopped. A token that touches `end` is only parsed when `last` is
+	// set, otherwise parsing stops in front of it and the returned pointer tells
+	// where to resume once more data is available. Returns nullptr on error.
+	template <typename Sink>
+	const char* parse(const char* begin, const char* end, bool last, Sink&& sink) {
+		const char* pos = begin;
+		while (true) {
+			while (pos != end && is_space(*pos)) {
+				if (*pos == '\n') {
+					++m_line;
+				}
+				++pos;
+			}
+			const char* token = pos;
+			while (pos != end && !is_space(*pos)) {
+				++pos;
+			}
+			if (token == pos || (pos == end && !last)) {
+				m_offset += token - begin;
+				return token;
+			}
+			if (!parse_token(token, pos)) {
+				m_error.line = m_line;
+				m_error.offset = m_offset + (token - begin);
+				m_error.token.assign(token, std::min<size_t>(pos - token, 32));
+				return nullptr;
+			}
+			if (m_filled == block_size) {
+				sink(m_block.data(), m_filled);
+				m_filled = 0;
+			}
+		}
+	}
+
+	// Hands out the last, partially filled block
+	template <typename Sink>
+	void flush(Sink&& sink) {
+		if (m_filled != 0) {
+			sink(m_block.data(), m_filled);
+			m_filled = 0;
+		}
+	}
+
+	void fail(std::string reason) {
+		m_error.reason = std::move(reason);
+	}
+
+	const InputError& error() const {
+		return m_error;
+	}
+
+private:
+	bool parse_token(const char* first, const char* last) {
+		if (!parse_number(first, last, m_block[m_filled])) {
+			return false;
+		}
+		++m_filled;
+		return true;
+	}
+
+	std::vector<double> m_block;
+	size_t m_filled{0};
+	size_t m_offset;
+	size_t m_line;
+	InputError m_error;
+};
+
+// Reads text samples from `fd` with large read() calls, parsing each buffer in
+// place. Returns false on invalid input or a read error (see parser.error()).
+// Works with any parser with TextParser's parse/flush/fail interface.
+template <typename Parser, typename Sink>
+bool read_text_samples(int fd, Parser& parser, Sink&& sink) {
+	std::vector<char> buffer(1 << 20);
+	size_t tail = 0; // unparsed bytes kept at the front of the buffer
+	while (true) {
+		if (tail == buffer.size()) {
+			buffer.resize(buffer.size() * 2); // a single token longer than the buffer
+		}
+		ssize_t got;
+		{
+			ProfileScope scope{ProfileStage::Read};
+			got = ::read(fd, buffer.data() + tail, buffer.size() - tail);
+		}
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			parser.fail(std::string{"read failed: "} + std::strerror(errno));
+			return false;
+		}
+		bool last = got == 0;
+		const char* end = buffer.data() + tail + got;
+		ProfileScope scope{ProfileStage::Parse};
+		const char* stop = parser.parse(buffer.data(), end, last, sink);
+		if (stop == nullptr) {
+			return false;
+		}
+		if (last) {
+			break;
+		}
+		// Don't hold back what has arrived so far (matters for slow live streams)
+		parser.flush(sink);
+		tail = end - stop;
+		std::memmove(buffer.data(), stop, tail);
+	}
+	parser.flush(sink);
+	return true;
+}
+
+enum class InputFormat {
+	Text, // whitespace-separated decimal numbers
+	F64,  // raw little-endian doubles
+	F32   // raw little-endian floats
+};
+
+inline bool parse_input_format(const char* name, InputFormat& format) {
+	if (std::strcmp(name, "text") == 0) {
+		format = InputFormat::Text;
+	} else if (std::strcmp(name, "f64") == 0) {
+		format = InputFormat::F64;
+	} else if (std::strcmp(name, "f32") == 0) {
+		format = InputFormat::F32;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+inline size_t sample_width(InputFormat format) {
+	return format == InputFormat::F32 ? sizeof(float) : format == InputFormat::F64 ? sizeof(double) : 1;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SAMPLE_INPUT_BIG_ENDIAN 1
+#endif
+
+// Hands raw binary samples in [begin, begin + count * width) to `sink` block by
+// block. Native-endian doubles are passed through without copying; floats
+// (and doubles on big-endian hosts) are converted through `scratch`.
+template <typename Sink>
+void feed_binary_samples(const char* begin, size_t count, InputFormat format,
+		std::vector<double>& scratch, Sink&& sink) {
+	const size_t block_size = TextParser::block_size;
+	ProfileScope scope{ProfileStage::Parse, count};
+	scratch.resize(block_size);
+	for (size_t done = 0; done < count; done += block_size) {
+		size_t n = std::min(block_size, count - done);
+		if (format == InputFormat::F64) {
+#if defined(SAMPLE_INPUT_BIG_ENDIAN)
+			for (size_t i = 0; i < n; ++i) {
+				uint64_t bits;
+				std::memcpy(&bits, begin + (done + i) * sizeof(double), sizeof(bits));
+				bits = __builtin_bswap64(bits);
+				std::memcpy(&scratch[i], &bits, sizeof(bits));
+			}
+			sink(scratch.data(), n);
+#else
+			sink(reinterpret_cast<const double*>(begin) + done, n);
+#endif
+		} else {
+			for (size_t i = 0; i < n; ++i) {
+				uint32_t bits;
+				std::memcpy(&bits, begin + (done + i) * sizeof(float), sizeof(bits));
+#if defined(SAMPLE_INPUT_BIG_ENDIAN)
+				bits = __builtin_bswap32(bits);
+#endif
+				float value;
+				std::memcpy(&value, &bits, sizeof(value));
+				scratch[i] = value;
+			}
+			sink(scratch.data(), n);
+		}
+	}
+}
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		if (m_data != nullptr) {
+			::munmap(m_data, m_size);
+		}
+	}
+
+	// Returns false and sets `error` when the file can't be opened or mapped
+	bool open(const char* path, std::string& error) {
+		ProfileScope scope{ProfileStage::Read};
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) {
+			error = std::string{"can't open: "} + std::strerror(errno);
+			return false;
+		}
+		struct stat info;
+		if (::fstat(fd, &info) != 0) {
+			error = std::string{"can't stat: "} + std::strerror(errno);
+			::close(fd);
+			return false;
+		}
+		m_size = static_cast<size_t>(info.st_size);
+		if (m_size != 0) {
+			void* data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) {
+				error = std::string{"can't map: "} + std::strerror(errno);
+				::close(fd);
+				return false;
+			}
+			m_data = data;
+			::madvise(m_data, m_size, MADV_SEQUENTIAL);
+		}
+		::close(fd);
+		return true;
+	}
+
+	const char* data() const {
+		return static_cast<const char*>(m_data);
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+
+private:
+	void* m_data{nullptr};
+	size_t m_size{0};
+};
+
+// Reads raw binary samples from a stream (e.g. a pipe) with large read() calls
+template <typename Sink>
+bool read_binary_samples(int fd, InputFormat format, Sink&& sink, InputError& error) {
+	const size_t width = sample_width(format);
+	std::vector<char> buffer(1 << 20);
+	std::vector<double> scratch;
+	size_t filled = 0;
+	size_t offset = 0;
+	while (true) {
+		ssize_t got;
+		{
+			ProfileScope scope{ProfileStage::Read};
+			got = ::read(fd, buffer.data() + filled, buffer.size() - filled);
+		}
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error.reason = std::string{"read failed: "} + std::strerror(errno);
+			return false;
+		}
+		filled += static_cast<size_t>(got);
+		size_t count = filled / width;
+		if (got == 0 && filled != count * width) {
+			error.reason = "truncated sample at offset " + std::to_string(offset + count * width);
+			return false;
+		}
+		// The buffer comes from operator new, so doubles at its front are aligned
+		feed_binary_samples(buffer.data(), count, format, scratch, sink);
+		if (got == 0) {
+			return true;
+		}
+		offset += count * width;
+		filled -= count * width;
+		std::memmove(buffer.data(), buffer.data() + count * width, filled);
+	}
+}
+
+// A byte range of a mapped input that can be parsed on its own
+struct InputChunk {
+	size_t begin;
+	size_t end;
+};
+
+// Splits a mapped input into up to `parts` chunks of similar size. Text chunks
+// start at whitespace so no token is cut, binary chunks at sample boundaries.
+// The last chunk always ends at the end of the file, so a truncated final
+// sample stays in it for read_chunk() to reject.
+inline std::vector<InputChunk> split_input(const MappedFile& file, InputFormat format, size_t parts) {
+	std::vector<InputChunk> chunks;
+	const size_t width = sample_width(format);
+	const size_t size = file.size();
+	size_t begin = 0;
+	for (size_t i = 1; i <= parts && begin < size; ++i) {
+		size_t end = i == parts ? size : size / parts * i - size / parts * i % width;
+		if (format == InputFormat::Text) {
+			while (end < size && !is_space(file.data()[end])) {
+				++end;
+			}
+		}
+		if (end > begin) {
+			chunks.push_back({begin, end});
+			begin = end;
+		}
+	}
+	return chunks;
+}
+
+// Reads the samples of one chunk of a mapped file. For text, `error.line` is
+// counted from the chunk start; see resolve_error_line().
+template <typename Sink>
+bool read_chunk(const MappedFile& file, const InputChunk& chunk, InputFormat format,
+		Sink&& sink, InputError& error) {
+	if (chunk.begin == chunk.end) {
+		return true; // nothing to parse (and nothing mapped for an empty file)
+	}
+	const char* begin = file.data() + chunk.begin;
+	const char* end = file.data() + chunk.end;
+	if (format == InputFormat::Text) {
+		ProfileScope scope{ProfileStage::Parse};
+		TextParser parser{chunk.begin};
+		if (parser.parse(begin, end, true, sink) == nullptr) {
+			std::string source = std::move(error.source);
+			error = parser.error();
+			error.source = std::move(source);
+			return false;
+		}
+		parser.flush(sink);
+		return true;
+	}
+	const size_t width = sample_width(format);
+	if ((chunk.end - chunk.begin) % width != 0) {
+		error.reason = "file size " + std::to_string(file.size()) + " is not a multiple of " +
+			std::to_string(width) + " bytes";
+		return false;
+	}
+	std::vector<double> scratch;
+	feed_binary_samples(begin, (chunk.end - chunk.begin) / width, format, scratch, sink);
+	return true;
+}
+
+// Turns a chunk-relative line number into a line number of the whole file
+inline void resolve_error_line(const MappedFile& file, const InputChunk& chunk, InputError& error) {
+	if (error.reason.empty()) {
+		error.line += std::count(file.data(), file.data() + chunk.begin, '\n');
+	}
+}
+
+// Reads all samples of `path` (stdin when it is null or "-"). Regular files
+// are memory-mapped: binary samples are consumed zero-copy and text is parsed
+// in place. Returns false and fills `error` on invalid input.
+template <typename Sink>
+bool read_samples(const char* path, InputFormat format, Sink&& sink, InputError& error) {
+	if (path == nullptr || std::strcmp(path, "-") == 0) {
+		if (format != InputFormat::Text) {
+			return read_binary_samples(STDIN_FILENO, format, sink, error);
+		}
+		TextParser parser;
+		bool ok = read_text_samples(STDIN_FILENO, parser, sink);
+		if (!ok) {
+			error = parser.error();
+		}
+		return ok;
+	}
+
+	error.source = path;
+	MappedFile file;
+	if (!file.open(path, error.reason)) {
+		return false;
+	}
+	return read_chunk(file, InputChunk{0, file.size()}, format, sink, error);
+}
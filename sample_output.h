@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <unistd.h> // write
+
+#include "sample_input.h"
+
+// Longest output of std::to_chars for any arithmetic type (shortest
+// round-trip doubles like -2.2250738585072014e-308 take 24 characters)
+constexpr size_t max_sample_chars = 32;
+
+// Writes the shortest decimal form of `value` that reads back exactly
+template <typename T>
+char* format_sample(char* out, T value) {
+	return std::to_chars(out, out + max_sample_chars, value).ptr;
+}
+
+// Formats `values` separated by `separator` into blocks of about `block`
+// characters and hands each block to `sink(const char* data, size_t size)`,
+// so the output is written in a few large writes instead of one ostream
+// insertion per value
+template <typename T, typename Sink>
+void format_samples(const T* values, size_t count, char separator, std::vector<char>& block, Sink&& sink) {
+	if (block.size() < 2 * max_sample_chars) {
+		block.resize(size_t{64} << 10);
+	}
+	char* begin = block.data();
+	char* limit = begin + block.size() - max_sample_chars - 1;
+	char* out = begin;
+	for (size_t i = 0; i < count; ++i) {
+		if (out >= limit) {
+			sink(begin, out - begin);
+			out = begin;
+		}
+		if (i != 0) {
+			*out++ = separator;
+		}
+		out = format_sample(out, values[i]);
+	}
+	if (out != begin) {
+		sink(begin, out - begin);
+	}
+}
+
+// Stores `value` as T's little-endian bytes at `out`
+template <typename Binary, typename Bits, typename T>
+char* encode_binary(char* out, T value) {
+	Binary binary = static_cast<Binary>(value);
+	Bits bits;
+	std::memcpy(&bits, &binary, sizeof(bits));
+#if defined(SAMPLE_INPUT_BIG_ENDIAN)
+	if constexpr (sizeof(Bits) == 8) {
+		bits = __builtin_bswap64(bits);
+	} else {
+		bits = __builtin_bswap32(bits);
+	}
+#endif
+	std::memcpy(out, &bits, sizeof(bits));
+	return out + sizeof(bits);
+}
+
+// Appends `values` to `out` in one of the formats the statistics tool
+// reads: text (one number per line, shortest round-trip form), or raw
+// little-endian doubles or floats
+template <typename T>
+void encode_samples(const T* values, size_t count, InputFormat format, std::vector<char>& out) {
+	static_assert(std::is_arithmetic<T>::value, "samples are numbers");
+	size_t size = out.size();
+	size_t width = format == InputFormat::Text ? max_sample_chars + 1 : sample_width(format);
+	out.resize(size + count * width);
+	char* end = out.data() + size;
+	for (size_t i = 0; i < count; ++i) {
+		if (format == InputFormat::Text) {
+			end = format_sample(end, values[i]);
+			*end++ = '\n';
+		} else if (format == InputFormat::F64) {
+			end = encode_binary<double, uint64_t>(end, values[i]);
+		} else {
+			end = encode_binary<float, uint32_t>(end, values[i]);
+		}
+	}
+	out.resize(end - out.data());
+}
+
+// Writes all of [data, data + size) to `fd`; false with `error` set if a
+// write fails
+inline bool write_all(int fd, const char* data, size_t size, std::string& error) {
+	while (size != 0) {
+		ssize_t written = ::write(fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error = std::string{"write failed: "} + std::strerror(errno);
+			return false;
+		}
+		data += written;
+		size -= static_cast<size_t>(written);
+	}
+	return true;
+}
+
+// Buffered sample output to a file descriptor in the encode_samples
+// formats; `statistics --format f64|f32` maps the binary ones without
+// parsing. The buffer is written once it holds `buffer_size` bytes.
+class SampleWriter {
+public:
+	static constexpr size_t buffer_size = size_t{1} << 20;
+
+	explicit SampleWriter(int fd, InputFormat format = InputFormat::Text) : m_fd{fd}, m_format{format} {
+		m_buffer.reserve(buffer_size + buffer_size / 8);
+	}
+
+	SampleWriter(const SampleWriter&) = delete;
+	SampleWriter& operator=(const SampleWriter&) = delete;
+
+	~SampleWriter() {
+		flush();
+	}
+
+	template <typename T>
+	void write(const T* values, size_t count) {
+		// Slices small enough that the buffer stays near buffer_size
+		constexpr size_t slice = buffer_size / 8 / (max_sample_chars + 1);
+		for (size_t done = 0; done < count; done += slice) {
+			encode_samples(values + done, std::min(slice, count - done), m_format, m_buffer);
+			if (m_buffer.size() >= buffer_size) {
+				flush();
+			}
+		}
+	}
+
+	template <typename T>
+	void write(T value) {
+		write(&value, 1);
+	}
+
+	// Writes out the buffer; false (see error()) once a write failed
+	bool flush() {
+		if (m_error.empty()) {
+			write_all(m_fd, m_buffer.data(), m_buffer.size(), m_error);
+		}
+		m_buffer.clear();
+		return m_error.empty();
+	}
+
+	const std::string& error() const {
+		return m_error;
+	}
+
+private:
+	int m_fd;
+	InputFormat m_format;
+	std::vector<char> m_buffer;
+	std::string m_error;
+};
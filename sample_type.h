@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <type_traits>
+
+#include "serialize.h"
+
+// Sample types the statistics can be instantiated with. `sum_type` is wide
+// enough to sum a long stream of samples: double for floating point (float
+// sums would lose precision after a few million samples), the next wider
+// integer for integers, so integer sums stay exact.
+template <typename T>
+struct SampleTraits;
+
+template <>
+struct SampleTraits<double> {
+	using sum_type = double;
+	static constexpr const char* name = "f64";
+};
+
+template <>
+struct SampleTraits<float> {
+	using sum_type = double;
+	static constexpr const char* name = "f32";
+};
+
+template <>
+struct SampleTraits<uint32_t> {
+	using sum_type = uint64_t;
+	static constexpr const char* name = "u32";
+};
+
+template <>
+struct SampleTraits<int64_t> {
+#ifdef __SIZEOF_INT128__
+	using sum_type = __int128;
+#else
+	using sum_type = long double;
+#endif
+	static constexpr const char* name = "i64";
+};
+
+enum class SampleType {
+	F64,
+	F32,
+	U32,
+	I64
+};
+
+inline bool parse_sample_type(const char* text, SampleType& type) {
+	if (std::strcmp(text, "f64") == 0) {
+		type = SampleType::F64;
+	} else if (std::strcmp(text, "f32") == 0) {
+		type = SampleType::F32;
+	} else if (std::strcmp(text, "u32") == 0) {
+		type = SampleType::U32;
+	} else if (std::strcmp(text, "i64") == 0) {
+		type = SampleType::I64;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// True if `value` (as parsed) converts to T without losing more than the
+// rounding of a floating point type: integers must be whole and in range.
+template <typename T>
+bool is_representable(double value) {
+	if constexpr (std::is_floating_point<T>::value) {
+		return !(std::fabs(value) > std::numeric_limits<T>::max()) || std::isinf(value);
+	} else {
+		// -lowest() is a power of two, and exact as a double unlike max()
+		constexpr double upper = std::is_signed<T>::value
+			? -static_cast<double>(std::numeric_limits<T>::lowest())
+			: static_cast<double>(std::numeric_limits<T>::max()) + 1;
+		return value >= static_cast<double>(std::numeric_limits<T>::lowest()) && value < upper &&
+			std::floor(value) == value;
+	}
+}
+
+// Sums are encoded like other values, 128-bit ones as two 64-bit halves
+template <typename Sum>
+void write_sum(std::ostream& out, Sum sum) {
+	write_value<Sum>(out, sum);
+}
+
+template <typename Sum>
+Sum read_sum(std::istream& in) {
+	return read_value<Sum>(in);
+}
+
+#ifdef __SIZEOF_INT128__
+template <>
+inline void write_sum<__int128>(std::ostream& out, __int128 sum) {
+	write_value<uint64_t>(out, static_cast<uint64_t>(sum));
+	write_value<uint64_t>(out, static_cast<uint64_t>(static_cast<unsigned __int128>(sum) >> 64));
+}
+
+template <>
+inline __int128 read_sum<__int128>(std::istream& in) {
+	uint64_t low = read_value<uint64_t>(in);
+	uint64_t high = read_value<uint64_t>(in);
+	return static_cast<__int128>((static_cast<unsigned __int128>(high) << 64) | low);
+}
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <type_traits>
+
+// Little-endian encoding of plain values for the binary snapshot formats.
+// Readers report failure through the stream state, like operator>> does.
+
+template <typename T>
+void write_value(std::ostream& out, T value) {
+	static_assert(std::is_arithmetic<T>::value, "only arithmetic values are encoded");
+	unsigned char bytes[sizeof(T)];
+	std::memcpy(bytes, &value, sizeof(T));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (size_t i = 0; i < sizeof(T) / 2; ++i) {
+		std::swap(bytes[i], bytes[sizeof(T) - 1 - i]);
+	}
+#endif
+	out.write(reinterpret_cast<const char*>(bytes), sizeof(T));
+}
+
+template <typename T>
+T read_value(std::istream& in) {
+	static_assert(std::is_arithmetic<T>::value, "only arithmetic values are encoded");
+	unsigned char bytes[sizeof(T)] = {};
+	in.read(reinterpret_cast<char*>(bytes), sizeof(T));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (size_t i = 0; i < sizeof(T) / 2; ++i) {
+		std::swap(bytes[i], bytes[sizeof(T) - 1 - i]);
+	}
+#endif
+	T value;
+	std::memcpy(&value, bytes, sizeof(T));
+	return value;
+}
+
+inline void write_string(std::ostream& out, const std::string& text) {
+	write_value<uint32_t>(out, static_cast<uint32_t>(text.size()));
+	out.write(text.data(), static_cast<std::streamsize>(text.size()));
+}
+
+inline std::string read_string(std::istream& in) {
+	uint32_t size = read_value<uint32_t>(in);
+	std::string text;
+	if (in && size <= (1u << 20)) {
+		text.resize(size);
+		in.read(&text[0], size);
+	} else {
+		in.setstate(std::ios::failbit);
+	}
+	return text;
+}
+
+// Writes a 4 byte tag identifying a snapshot section
+inline void write_tag(std::ostream& out, const char (&tag)[5]) {
+	out.write(tag, 4);
+}
+
+// Reads a tag and fails the stream unless it matches
+inline bool expect_tag(std::istream& in, const char (&tag)[5]) {
+	char found[4] = {};
+	in.read(found, 4);
+	if (!in || std::memcmp(found, tag, 4) != 0) {
+		in.setstate(std::ios::failbit);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,411 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <netdb.h>       // getaddrinfo
+#include <poll.h>        // poll
+#include <sys/epoll.h>   // epoll_create1, epoll_ctl, epoll_wait
+#include <sys/eventfd.h> // eventfd
+#include <sys/socket.h>  // socket, bind, recvmmsg
+#include <unistd.h>      // close, read, write
+
+#include "sample_input.h"
+
+// Ingestion server for `statistics --listen`: samples arrive over UDP and TCP
+// in the binary input format (raw little-endian f64 or f32), and the current
+// results can be queried while they do.
+//
+//   UDP  every datagram is a batch of whole samples, received in batches of
+//        datagrams with recvmmsg(). A datagram "query" (or "query\n") is
+//        answered with the report, as text, to its sender.
+//   TCP  every connection is a stream of samples, like a pipe into stdin.
+//
+// There's one reactor thread per shard, each with its own epoll loop, its
+// own UDP and listening TCP socket bound to the same port with SO_REUSEPORT
+// (the kernel spreads datagrams and connections over them), and its own
+// statistics set. Samples are fed to the set straight from the receive
+// buffers, with the batch update(data, count); a query merges the shards.
+
+// Where to listen or what to query: "PORT" or "HOST:PORT" ("[V6]:PORT")
+struct ServerAddress {
+	std::string host; // empty: any address (listen) or localhost (query)
+	std::string port;
+
+	static bool parse(const char* text, ServerAddress& address) {
+		const char* colon = std::strrchr(text, ':');
+		address.host = colon ? std::string(text, colon) : std::string{};
+		address.port = colon ? colon + 1 : text;
+		if (address.host.size() >= 2 && address.host.front() == '[' && address.host.back() == ']') {
+			address.host = address.host.substr(1, address.host.size() - 2);
+		}
+		if (address.port.empty()) {
+			return false;
+		}
+		for (char c : address.port) {
+			if (c < '0' || c > '9') {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::string describe() const {
+		return (host.empty() ? std::string{"*"} : host) + ":" + port;
+	}
+};
+
+// Calls f(addrinfo) for the addresses of `address` until it returns a socket
+template <typename F>
+int for_each_address(const ServerAddress& address, int type, bool passive, F&& f, std::string& error) {
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	addrinfo* found = nullptr;
+	const char* host = address.host.empty() ? nullptr : address.host.c_str();
+	if (int status = ::getaddrinfo(host, address.port.c_str(), &hints, &found); status != 0) {
+		error = address.describe() + ": " + ::gai_strerror(status);
+		return -1;
+	}
+	int fd = -1;
+	for (addrinfo* info = found; info != nullptr && fd < 0; info = info->ai_next) {
+		fd = f(*info);
+	}
+	if (fd < 0) {
+		error = address.describe() + ": " + std::strerror(errno);
+	}
+	::freeaddrinfo(found);
+	return fd;
+}
+
+// Non-blocking socket bound to `address` with SO_REUSEPORT, listening if
+// it's a TCP one. Returns -1 and sets `error` on failure.
+inline int bind_socket(const ServerAddress& address, int type, std::string& error) {
+	return for_each_address(address, type, true, [&](const addrinfo& info) {
+		int fd = ::socket(info.ai_family, info.ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, info.ai_protocol);
+		if (fd < 0) {
+			return -1;
+		}
+		int on = 1;
+		::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+		if (type == SOCK_DGRAM) {
+			int receive_buffer = 8 << 20; // absorbs bursts; capped by net.core.rmem_max
+			::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+		}
+		if (::bind(fd, info.ai_addr, info.ai_addrlen) != 0 || (type == SOCK_STREAM && ::listen(fd, 1024) != 0)) {
+			int saved = errno;
+			::close(fd);
+			errno = saved;
+			return -1;
+		}
+		return fd;
+	}, error);
+}
+
+// Sends a "query" datagram to a server and waits up to `timeout_ms` for the report
+inline bool query_server(const ServerAddress& address, int timeout_ms, std::string& report, std::string& error) {
+	int fd = for_each_address(address, SOCK_DGRAM, false, [](const addrinfo& info) {
+		int fd = ::socket(info.ai_family, info.ai_socktype | SOCK_CLOEXEC, info.ai_protocol);
+		if (fd >= 0 && ::connect(fd, info.ai_addr, info.ai_addrlen) != 0) {
+			::close(fd);
+			fd = -1;
+		}
+		return fd;
+	}, error);
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = false;
+	if (::send(fd, "query", 5, 0) != 5) {
+		error = std::string{"send failed: "} + std::strerror(errno);
+	} else {
+		pollfd ready{fd, POLLIN, 0};
+		std::vector<char> reply(1 << 16);
+		ssize_t got = ::poll(&ready, 1, timeout_ms) == 1 ? ::recv(fd, reply.data(), reply.size(), 0) : -1;
+		if (got < 0) {
+			error = address.describe() + ": no reply";
+		} else {
+			report.assign(reply.data(), static_cast<size_t>(got));
+			ok = true;
+		}
+	}
+	::close(fd);
+	return ok;
+}
+
+template <typename Set>
+class IngestServer {
+public:
+	static constexpr size_t datagram_batch = 32;               // datagrams per recvmmsg()
+	static constexpr size_t datagram_size = size_t{1} << 16;   // more than the largest UDP payload
+	static constexpr size_t stream_buffer_size = size_t{1} << 18;
+
+	IngestServer(InputFormat format, std::function<Set()> make_set)
+		: m_format{format}, m_width{sample_width(format)}, m_make_set{std::move(make_set)} {
+	}
+
+	IngestServer(const IngestServer&) = delete;
+	IngestServer& operator=(const IngestServer&) = delete;
+
+	~IngestServer() {
+		stop();
+		for (auto& reactor : m_reactors) {
+			for (int fd : {reactor->epoll, reactor->udp, reactor->tcp}) {
+				if (fd >= 0) {
+					::close(fd);
+				}
+			}
+			for (auto& connection : reactor->connections) {
+				::close(connection.first);
+			}
+		}
+		if (m_wake >= 0) {
+			::close(m_wake);
+		}
+	}
+
+	// Opens the sockets of `reactors` reactors on `address` and starts their threads
+	bool start(const ServerAddress& address, size_t reactors, std::string& error) {
+		m_wake = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (m_wake < 0) {
+			error = std::string{"eventfd failed: "} + std::strerror(errno);
+			return false;
+		}
+		for (size_t i = 0; i < std::max<size_t>(1, reactors); ++i) {
+			auto reactor = std::make_unique<Reactor>(m_make_set());
+			reactor->udp = bind_socket(address, SOCK_DGRAM, error);
+			reactor->tcp = reactor->udp < 0 ? -1 : bind_socket(address, SOCK_STREAM, error);
+			reactor->epoll = ::epoll_create1(EPOLL_CLOEXEC);
+			m_reactors.push_back(std::move(reactor));
+			Reactor& added = *m_reactors.back();
+			if (added.udp < 0 || added.tcp < 0) {
+				return false;
+			}
+			if (added.epoll < 0 || !watch(added, added.udp) || !watch(added, added.tcp) || !watch(added, m_wake)) {
+				error = std::string{"epoll failed: "} + std::strerror(errno);
+				return false;
+			}
+		}
+		for (auto& reactor : m_reactors) {
+			reactor->thread = std::thread{[this, &reactor = *reactor] { run(reactor); }};
+		}
+		return true;
+	}
+
+	// Stops and joins the reactors; the shards keep their results
+	void stop() {
+		if (m_wake >= 0) {
+			uint64_t one = 1;
+			ssize_t written = ::write(m_wake, &one, sizeof(one));
+			(void)written; // the counter can't overflow from one write
+		}
+		for (auto& reactor : m_reactors) {
+			if (reactor->thread.joinable()) {
+				reactor->thread.join();
+			}
+		}
+	}
+
+	// Results of all shards merged together
+	Set snapshot() const {
+		Set merged = m_make_set();
+		for (const auto& reactor : m_reactors) {
+			std::lock_guard<std::mutex> lock{reactor->mutex};
+			merged.merge(reactor->statistics);
+		}
+		return merged;
+	}
+
+	// The current results as "name = value" lines, like the statistics report
+	std::string report() const {
+		std::ostringstream out;
+		snapshot().for_each([&](const auto& statistic) {
+			out << statistic.name() << " = " << statistic.eval() << "\n";
+		});
+		return out.str();
+	}
+
+	uint64_t samples() const {
+		return m_samples.load(std::memory_order_relaxed);
+	}
+
+	// Datagrams that were neither whole samples nor a query, and bytes of
+	// samples cut off when a TCP connection closed mid-sample
+	uint64_t dropped() const {
+		return m_dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Connection {
+		std::vector<double> storage; // double-typed, so samples at its front are aligned
+		size_t filled{0};
+
+		char* data() {
+			return reinterpret_cast<char*>(storage.data());
+		}
+	};
+
+	struct Reactor {
+		explicit Reactor(Set set) : statistics{std::move(set)} {
+		}
+
+		int epoll{-1};
+		int udp{-1};
+		int tcp{-1};
+		std::thread thread;
+		mutable std::mutex mutex; // guards `statistics` against queries from other reactors
+		Set statistics;
+		std::unordered_map<int, Connection> connections;
+		std::vector<double> datagrams; // datagram_batch receive buffers of datagram_size bytes
+		std::vector<char> scratch_bytes;
+		std::vector<double> scratch; // for feed_binary_samples
+	};
+
+	static bool watch(Reactor& reactor, int fd) {
+		epoll_event event{};
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		return ::epoll_ctl(reactor.epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+	}
+
+	void run(Reactor& reactor) {
+		reactor.datagrams.resize(datagram_batch * datagram_size / sizeof(double));
+		epoll_event events[64];
+		while (true) {
+			int ready = ::epoll_wait(reactor.epoll, events, 64, -1);
+			if (ready < 0 && errno != EINTR) {
+				return;
+			}
+			for (int i = 0; i < ready; ++i) {
+				int fd = events[i].data.fd;
+				if (fd == m_wake) {
+					return;
+				} else if (fd == reactor.udp) {
+					receive_datagrams(reactor);
+				} else if (fd == reactor.tcp) {
+					accept_connections(reactor);
+				} else {
+					read_connection(reactor, fd);
+				}
+			}
+		}
+	}
+
+	// Feeds `count` samples at `data` to the reactor's shard, without copying
+	// them for native-endian f64
+	void feed(Reactor& reactor, const char* data, size_t count) {
+		std::lock_guard<std::mutex> lock{reactor.mutex};
+		feed_binary_samples(data, count, m_format, reactor.scratch, [&](const double* samples, size_t n) {
+			reactor.statistics.update(samples, n);
+		});
+		m_samples.fetch_add(count, std::memory_order_relaxed);
+	}
+
+	static bool is_query(const char* data, size_t size) {
+		return (size == 5 || (size == 6 && data[5] == '\n')) && std::memcmp(data, "query", 5) == 0;
+	}
+
+	// Receives what is waiting, datagram_batch datagrams per system call. A
+	// few batches at most, so one busy socket doesn't starve the others.
+	void receive_datagrams(Reactor& reactor) {
+		char* buffers = reinterpret_cast<char*>(reactor.datagrams.data());
+		mmsghdr messages[datagram_batch];
+		iovec vectors[datagram_batch];
+		sockaddr_storage senders[datagram_batch];
+		for (int round = 0; round < 16; ++round) {
+			for (size_t i = 0; i < datagram_batch; ++i) {
+				vectors[i] = {buffers + i * datagram_size, datagram_size};
+				messages[i] = {};
+				messages[i].msg_hdr.msg_iov = &vectors[i];
+				messages[i].msg_hdr.msg_iovlen = 1;
+				messages[i].msg_hdr.msg_name = &senders[i];
+				messages[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+			}
+			int received = ::recvmmsg(reactor.udp, messages, datagram_batch, MSG_DONTWAIT, nullptr);
+			if (received <= 0) {
+				return;
+			}
+			for (int i = 0; i < received; ++i) {
+				const char* data = buffers + i * datagram_size;
+				size_t size = messages[i].msg_len;
+				if (size != 0 && size % m_width == 0 && !(messages[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+					feed(reactor, data, size / m_width);
+				} else if (is_query(data, size)) {
+					std::string text = report();
+					::sendto(reactor.udp, text.data(), text.size(), MSG_DONTWAIT,
+						static_cast<sockaddr*>(messages[i].msg_hdr.msg_name), messages[i].msg_hdr.msg_namelen);
+				} else {
+					m_dropped.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+			if (static_cast<size_t>(received) < datagram_batch) {
+				return;
+			}
+		}
+	}
+
+	void accept_connections(Reactor& reactor) {
+		while (true) {
+			int fd = ::accept4(reactor.tcp, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0) {
+				return; // EAGAIN, or an error of that one connection
+			}
+			if (!watch(reactor, fd)) {
+				::close(fd);
+				continue;
+			}
+			Connection& connection = reactor.connections[fd];
+			connection.storage.resize(stream_buffer_size / sizeof(double));
+		}
+	}
+
+	// Reads once from a connection and feeds the whole samples received; the
+	// rest of a sample cut by the read waits at the front of the buffer
+	void read_connection(Reactor& reactor, int fd) {
+		auto found = reactor.connections.find(fd);
+		if (found == reactor.connections.end()) {
+			return;
+		}
+		Connection& connection = found->second;
+		ssize_t got = ::read(fd, connection.data() + connection.filled, stream_buffer_size - connection.filled);
+		if (got < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		if (got <= 0) {
+			if (connection.filled != 0) {
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+			}
+			::close(fd); // also removes it from the epoll set
+			reactor.connections.erase(found);
+			return;
+		}
+		connection.filled += static_cast<size_t>(got);
+		size_t count = connection.filled / m_width;
+		if (count != 0) {
+			feed(reactor, connection.data(), count);
+			connection.filled -= count * m_width;
+			std::memmove(connection.data(), connection.data() + count * m_width, connection.filled);
+		}
+	}
+
+	const InputFormat m_format;
+	const size_t m_width;
+	std::function<Set()> m_make_set;
+	std::vector<std::unique_ptr<Reactor>> m_reactors;
+	int m_wake{-1}; // eventfd, readable once stop() was called
+	std::atomic<uint64_t> m_samples{0};
+	std::atomic<uint64_t> m_dropped{0};
+};
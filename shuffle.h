@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "thread_pool.h" // run_tasks
+
+// Small, fast random engines for benchmark inputs. All of them model
+// UniformRandomBitGenerator, so they also work with <random> distributions,
+// and all are seeded from one 64-bit seed: the same seed gives the same
+// stream on every platform, unlike std::default_random_engine.
+
+// SplitMix64, used to expand a seed into the state of the other engines
+class SplitMix64 {
+public:
+	using result_type = uint64_t;
+
+	explicit SplitMix64(uint64_t seed = 0) : m_state{seed} {
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	result_type operator()() {
+		uint64_t z = (m_state += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+private:
+	uint64_t m_state;
+};
+
+// xoshiro256** (Blackman, Vigna): 256 bits of state, period 2^256 - 1
+class Xoshiro256 {
+public:
+	using result_type = uint64_t;
+
+	explicit Xoshiro256(uint64_t seed = 0) {
+		SplitMix64 seeder{seed};
+		for (uint64_t& word : m_state) {
+			word = seeder();
+		}
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	result_type operator()() {
+		uint64_t result = rotl(m_state[1] * 5, 7) * 9;
+		uint64_t t = m_state[1] << 17;
+		m_state[2] ^= m_state[0];
+		m_state[3] ^= m_state[1];
+		m_state[1] ^= m_state[2];
+		m_state[0] ^= m_state[3];
+		m_state[2] ^= t;
+		m_state[3] = rotl(m_state[3], 45);
+		return result;
+	}
+
+	// Advances the engine by 2^128 numbers: engines jumped 0, 1, 2, ... times
+	// from one seed give non-overlapping streams for parallel generators
+	void jump() {
+		constexpr uint64_t polynomial[] = {0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull,
+			0xa9582618e03fc9aaull, 0x39abdc4529b1661cull};
+		uint64_t state[4] = {0, 0, 0, 0};
+		for (uint64_t word : polynomial) {
+			for (int bit = 0; bit < 64; ++bit) {
+				if (word & (uint64_t{1} << bit)) {
+					for (int i = 0; i < 4; ++i) {
+						state[i] ^= m_state[i];
+					}
+				}
+				(*this)();
+			}
+		}
+		for (int i = 0; i < 4; ++i) {
+			m_state[i] = state[i];
+		}
+	}
+
+private:
+	static uint64_t rotl(uint64_t x, int k) {
+		return (x << k) | (x >> (64 - k));
+	}
+
+	uint64_t m_state[4];
+};
+
+// PCG32 (O'Neill), XSH-RR output on a 64-bit LCG
+class Pcg32 {
+public:
+	using result_type = uint32_t;
+
+	explicit Pcg32(uint64_t seed = 0, uint64_t stream = 0) : m_state{0}, m_increment{(stream << 1) | 1} {
+		(*this)();
+		m_state += SplitMix64{seed}();
+		(*this)();
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	result_type operator()() {
+		uint64_t old = m_state;
+		m_state = old * 6364136223846793005ull + m_increment;
+		uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+		uint32_t rotation = static_cast<uint32_t>(old >> 59);
+		return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+	}
+
+private:
+	uint64_t m_state;
+	uint64_t m_increment;
+};
+
+// wyrand (Wang Yi): one 64-bit add and one 128-bit multiply per number
+class Wyrand {
+public:
+	using result_type = uint64_t;
+
+	explicit Wyrand(uint64_t seed = 0) : m_state{seed} {
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	result_type operator()() {
+		m_state += 0xa0761d6478bd642full;
+		unsigned __int128 product = static_cast<unsigned __int128>(m_state) * (m_state ^ 0xe7037ed1a0b428dbull);
+		return static_cast<uint64_t>(product >> 64) ^ static_cast<uint64_t>(product);
+	}
+
+private:
+	uint64_t m_state;
+};
+
+// 64 random bits from any of the engines above
+template <typename Engine>
+uint64_t random_bits64(Engine& engine) {
+	if constexpr (sizeof(typename Engine::result_type) >= 8) {
+		return engine();
+	} else {
+		uint64_t high = engine();
+		return (high << 32) | engine();
+	}
+}
+
+// Uniform integer in [0, range), range > 0, with Lemire's nearly divisionless
+// method: a multiply maps the random bits onto the range, and the modulo
+// that rejects biased results is only computed in the rare case it's needed.
+template <typename Engine>
+uint64_t bounded_random(Engine& engine, uint64_t range) {
+	if constexpr (sizeof(typename Engine::result_type) < 8) {
+		if (range <= std::numeric_limits<uint32_t>::max()) {
+			uint32_t range32 = static_cast<uint32_t>(range);
+			uint64_t product = uint64_t{engine()} * range32;
+			if (static_cast<uint32_t>(product) < range32) {
+				uint32_t threshold = -range32 % range32;
+				while (static_cast<uint32_t>(product) < threshold) {
+					product = uint64_t{engine()} * range32;
+				}
+			}
+			return product >> 32;
+		}
+	}
+	unsigned __int128 product = static_cast<unsigned __int128>(random_bits64(engine)) * range;
+	if (static_cast<uint64_t>(product) < range) {
+		uint64_t threshold = -range % range;
+		while (static_cast<uint64_t>(product) < threshold) {
+			product = static_cast<unsigned __int128>(random_bits64(engine)) * range;
+		}
+	}
+	return static_cast<uint64_t>(product >> 64);
+}
+
+// Fisher-Yates shuffle, drawing the swap positions with bounded_random
+template <typename RandomIt, typename Engine>
+void fast_shuffle(RandomIt first, RandomIt last, Engine& engine) {
+	using std::swap;
+	auto count = static_cast<uint64_t>(std::distance(first, last));
+	for (uint64_t i = count; i > 1; --i) {
+		swap(first[i - 1], first[bounded_random(engine, i)]);
+	}
+}
+
+// Seed for runs that don't ask for a particular one; print it to reproduce
+inline uint64_t random_seed() {
+	std::random_device device;
+	return (uint64_t{device()} << 32) | device();
+}
+
+template <typename Engine = Xoshiro256, typename T>
+void make_random_shuffle(std::vector<T>& values, uint64_t seed) {
+	Engine engine{seed};
+	fast_shuffle(values.begin(), values.end(), engine);
+}
+
+// Number of buckets parallel_shuffle uses for `count` elements of `size`
+// bytes: each bucket about 1 MiB, so its local shuffle stays in cache. Only
+// depends on the input, never on the thread count.
+inline size_t shuffle_buckets(size_t count, size_t size) {
+	constexpr size_t bucket_bytes = size_t{1} << 20;
+	return std::max<size_t>(1, std::min<size_t>(4096, count * size / bucket_bytes));
+}
+
+// Uniform random permutation of [first, last) on several threads (Sanders'
+// scatter shuffle): the input is cut into chunks, which are scattered in
+// parallel into buckets chosen uniformly at random per element, then every
+// bucket is shuffled on its own while it is copied back. Chunks and buckets
+// each get their own engine derived from `seed`, and their number doesn't
+// depend on `threads`, so a seed gives the same permutation on any number of
+// threads. Needs a scratch copy of the input.
+template <typename RandomIt, typename Engine = Xoshiro256>
+void parallel_shuffle(RandomIt first, RandomIt last, uint64_t seed, size_t threads) {
+	using T = typename std::iterator_traits<RandomIt>::value_type;
+	const size_t count = static_cast<size_t>(last - first);
+	const size_t buckets = shuffle_buckets(count, sizeof(T));
+	if (buckets == 1) {
+		Engine engine{SplitMix64{seed}()};
+		fast_shuffle(first, last, engine);
+		return;
+	}
+	const size_t chunks = std::min<size_t>(buckets, 256); // counts has chunks * buckets entries
+	auto chunk_begin = [&](size_t chunk) { return count / chunks * chunk + std::min(chunk, count % chunks); };
+	std::vector<uint64_t> chunk_seeds(chunks), bucket_seeds(buckets);
+	SplitMix64 seeds{seed};
+	for (uint64_t& chunk_seed : chunk_seeds) {
+		chunk_seed = seeds();
+	}
+	for (uint64_t& bucket_seed : bucket_seeds) {
+		bucket_seed = seeds();
+	}
+
+	// counts[chunk * buckets + bucket]: elements of the chunk going to the
+	// bucket. The scatter pass replays the same engine to find them again.
+	std::vector<size_t> counts(chunks * buckets, 0);
+	run_tasks(chunks, threads, [&](size_t chunk) {
+		Engine engine{chunk_seeds[chunk]};
+		size_t* row = &counts[chunk * buckets];
+		for (size_t i = chunk_begin(chunk), end = chunk_begin(chunk + 1); i < end; ++i) {
+			++row[bounded_random(engine, buckets)];
+		}
+	});
+	// Exclusive prefix sums in bucket-major order: bucket by bucket, the
+	// chunks' parts one after another
+	std::vector<size_t> bucket_begin(buckets + 1, 0);
+	size_t offset = 0;
+	for (size_t bucket = 0; bucket < buckets; ++bucket) {
+		bucket_begin[bucket] = offset;
+		for (size_t chunk = 0; chunk < chunks; ++chunk) {
+			size_t n = counts[chunk * buckets + bucket];
+			counts[chunk * buckets + bucket] = offset;
+			offset += n;
+		}
+	}
+	bucket_begin[buckets] = offset;
+
+	std::vector<T> scratch(count);
+	run_tasks(chunks, threads, [&](size_t chunk) {
+		Engine engine{chunk_seeds[chunk]};
+		size_t* row = &counts[chunk * buckets];
+		for (size_t i = chunk_begin(chunk), end = chunk_begin(chunk + 1); i < end; ++i) {
+			scratch[row[bounded_random(engine, buckets)]++] = std::move(first[i]);
+		}
+	});
+	// Inside-out Fisher-Yates: copies the bucket back and shuffles it at once
+	run_tasks(buckets, threads, [&](size_t bucket) {
+		Engine engine{bucket_seeds[bucket]};
+		RandomIt out = first + bucket_begin[bucket];
+		T* in = scratch.data() + bucket_begin[bucket];
+		size_t n = bucket_begin[bucket + 1] - bucket_begin[bucket];
+		for (size_t i = 0; i < n; ++i) {
+			size_t j = bounded_random(engine, i + 1);
+			if (j != i) {
+				out[i] = std::move(out[j]);
+			}
+			out[j] = std::move(in[i]);
+		}
+	});
+}
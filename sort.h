@@ -0,0 +1,600 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "shuffle.h"     // SplitMix64, bounded_random
+#include "thread_pool.h"
+
+// Unsigned key with the same order as the value: signed integers get their
+// sign bit flipped, floating point values all bits of negatives (and the sign
+// bit of positives), so the keys sort like the values do. NaN sorts last.
+template <typename T>
+using radix_key_t = std::conditional_t<sizeof(T) == 8, uint64_t, uint32_t>;
+
+template <typename T>
+radix_key_t<T> radix_key(T value) {
+	static_assert(std::is_arithmetic<T>::value && (sizeof(T) == 4 || sizeof(T) == 8),
+		"radix keys exist for 32 and 64-bit numbers");
+	using Key = radix_key_t<T>;
+	constexpr Key sign = Key{1} << (sizeof(T) * 8 - 1);
+	Key key;
+	std::memcpy(&key, &value, sizeof(T));
+	if constexpr (std::is_floating_point<T>::value) {
+		return (key & sign) ? ~key : key | sign;
+	} else if constexpr (std::is_signed<T>::value) {
+		return key ^ sign;
+	} else {
+		return key;
+	}
+}
+
+// Least-significant-digit radix sort on 8-bit digits: one counting pass over
+// the input for all digits, then one scatter pass per digit between `data`
+// and a scratch buffer. Digits that are the same for every element (e.g. the
+// high bytes of small integers) are skipped. O(n) and stable, but needs n
+// extra elements of memory.
+template <typename T>
+void lsd_radix_sort(T* data, size_t count) {
+	constexpr size_t digits = sizeof(T);
+	if (count < 2) {
+		return;
+	}
+	std::vector<size_t> counts(digits * 256, 0);
+	for (size_t i = 0; i < count; ++i) {
+		auto key = radix_key(data[i]);
+		for (size_t d = 0; d < digits; ++d) {
+			++counts[d * 256 + ((key >> (d * 8)) & 0xff)];
+		}
+	}
+
+	std::vector<T> scratch(count);
+	T* from = data;
+	T* to = scratch.data();
+	for (size_t d = 0; d < digits; ++d) {
+		size_t* histogram = &counts[d * 256];
+		if (histogram[(radix_key(data[0]) >> (d * 8)) & 0xff] == count) {
+			continue; // every element has the same digit here
+		}
+		size_t offset = 0;
+		for (size_t b = 0; b < 256; ++b) {
+			size_t n = histogram[b];
+			histogram[b] = offset;
+			offset += n;
+		}
+		for (size_t i = 0; i < count; ++i) {
+			T value = from[i];
+			to[histogram[(radix_key(value) >> (d * 8)) & 0xff]++] = value;
+		}
+		std::swap(from, to);
+	}
+	if (from != data) {
+		std::memcpy(data, from, count * sizeof(T));
+	}
+}
+
+// Insertion sort of [first, last). Unguarded: *(first - 1) is known to be no
+// greater than any element of the range, so the inner loop needs no bound.
+template <typename RandomIt, typename Compare, bool Guarded = true>
+void insertion_sort(RandomIt first, RandomIt last, Compare comp) {
+	using T = typename std::iterator_traits<RandomIt>::value_type;
+	if (first == last) {
+		return;
+	}
+	for (RandomIt current = first + 1; current != last; ++current) {
+		RandomIt sift = current;
+		RandomIt previous = current - 1;
+		if (comp(*sift, *previous)) {
+			T value = std::move(*sift);
+			do {
+				*sift-- = std::move(*previous);
+			} while ((!Guarded || sift != first) && comp(value, *--previous));
+			*sift = std::move(value);
+		}
+	}
+}
+
+// Most-significant-digit radix sort in place (American flag sort): every
+// pass counts the elements per 8-bit digit, then permutes them into their
+// buckets by following swap cycles, and recurses into each bucket on the
+// next digit. No extra memory beyond the recursion (at most sizeof(T) deep);
+// small buckets are finished by insertion sort. Not stable.
+template <typename T>
+void msd_radix_sort(T* data, size_t count, size_t digit = sizeof(T) - 1) {
+	constexpr size_t small_bucket = 64;
+	if (count <= small_bucket) {
+		insertion_sort(data, data + count, [](T x, T y) { return radix_key(x) < radix_key(y); });
+		return;
+	}
+	size_t shift = digit * 8;
+	auto digit_of = [&shift](T value) { return static_cast<size_t>((radix_key(value) >> shift) & 0xff); };
+	size_t counts[256];
+	while (true) {
+		std::fill(counts, counts + 256, 0);
+		for (size_t i = 0; i < count; ++i) {
+			++counts[digit_of(data[i])];
+		}
+		if (counts[digit_of(data[0])] != count) {
+			break;
+		}
+		if (digit == 0) {
+			return; // all equal
+		}
+		shift = --digit * 8; // every element has the same digit here
+	}
+
+	size_t heads[256];
+	size_t ends[256];
+	size_t offset = 0;
+	for (size_t b = 0; b < 256; ++b) {
+		heads[b] = offset;
+		offset += counts[b];
+		ends[b] = offset;
+	}
+	for (size_t b = 0; b < 256; ++b) {
+		while (heads[b] < ends[b]) {
+			T value = data[heads[b]];
+			size_t d = digit_of(value);
+			while (d != b) {
+				std::swap(value, data[heads[d]++]);
+				d = digit_of(value);
+			}
+			data[heads[b]++] = value;
+		}
+	}
+	if (digit > 0) {
+		for (size_t b = 0, begin = 0; b < 256; begin = ends[b++]) {
+			if (ends[b] - begin > 1) {
+				msd_radix_sort(data + begin, ends[b] - begin, digit - 1);
+			}
+		}
+	}
+}
+
+// Pattern-defeating quicksort (Orson Peters' pdqsort): introsort with
+// median-of-3 or ninther pivots, insertion sort for small ranges, a heapsort
+// fallback after too many unbalanced partitions, shuffling around the pivot
+// to break adversarial patterns, and detecting ranges that are already
+// sorted and runs of elements equal to the pivot, so sorted, reversed and
+// few-unique inputs take linear time. Arithmetic keys with the default
+// comparison are partitioned branchlessly, BlockQuicksort-style (Edelkamp,
+// Weiß): positions of misplaced elements are collected in small offset
+// buffers with no data-dependent branch, then swapped in bulk.
+constexpr ptrdiff_t pdq_insertion_sort_threshold = 24;
+constexpr ptrdiff_t pdq_ninther_threshold = 128;
+constexpr size_t pdq_partial_insertion_sort_limit = 8; // element moves
+constexpr size_t pdq_block_size = 64;                  // offsets fit an unsigned char
+
+template <typename RandomIt, typename Compare>
+void pdq_sort2(RandomIt a, RandomIt b, Compare comp) {
+	if (comp(*b, *a)) {
+		std::iter_swap(a, b);
+	}
+}
+
+template <typename RandomIt, typename Compare>
+void pdq_sort3(RandomIt a, RandomIt b, RandomIt c, Compare comp) {
+	pdq_sort2(a, b, comp);
+	pdq_sort2(b, c, comp);
+	pdq_sort2(a, b, comp);
+}
+
+// Insertion sort that gives up (false) after pdq_partial_insertion_sort_limit
+// moves, for ranges that are probably but not surely sorted
+template <typename RandomIt, typename Compare>
+bool pdq_partial_insertion_sort(RandomIt first, RandomIt last, Compare comp) {
+	using T = typename std::iterator_traits<RandomIt>::value_type;
+	if (first == last) {
+		return true;
+	}
+	size_t moves = 0;
+	for (RandomIt current = first + 1; current != last; ++current) {
+		RandomIt sift = current;
+		RandomIt previous = current - 1;
+		if (comp(*sift, *previous)) {
+			T value = std::move(*sift);
+			do {
+				*sift-- = std::move(*previous);
+			} while (sift != first && comp(value, *--previous));
+			*sift = std::move(value);
+			moves += static_cast<size_t>(current - sift);
+			if (moves > pdq_partial_insertion_sort_limit) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Partitions [first, last) around the pivot *first: smaller elements left,
+// the rest right. Returns the pivot's final position, and whether the range
+// was already partitioned. A median-of-3 pivot guarantees an element not
+// less than the pivot to the right, so the first scan needs no bound.
+template <typename RandomIt, typename Compare>
+std::pair<RandomIt, bool> pdq_partition_right(RandomIt begin, RandomIt end, Compare comp) {
+	using T = typename std::iterator_traits<RandomIt>::value_type;
+	T pivot = std::move(*begin);
+	RandomIt first = begin;
+	RandomIt last = end;
+	while (comp(*++first, pivot)) {
+	}
+	if (first - 1 == begin) {
+		while (first < last && !comp(*--last, pivot)) {
+		}
+	} else {
+		while (!comp(*--last, pivot)) {
+		}
+	}
+	bool already_partitioned = first >= last;
+	while (first < last) {
+		std::iter_swap(first, last);
+		while (comp(*++first, pivot)) {
+		}
+		while (!comp(*--last, pivot)) {
+		}
+	}
+	RandomIt pivot_position = first - 1;
+	*begin = std::move(*pivot_position);
+	*pivot_position = std::move(pivot);
+	return {pivot_position, already_partitioned};
+}
+
+// Swaps first + offsets_l[i] with last - offsets_r[i] for i < count; with
+// unequal counts left to do, as one cycle of moves instead of swaps
+template <typename RandomIt>
+void pdq_swap_offsets(RandomIt first, RandomIt last, const unsigned char* offsets_l,
+		const unsigned char* offsets_r, size_t count, bool use_swaps) {
+	using T = typename std::iterator_traits<RandomIt>::value_type;
+	if (use_swaps) {
+		for (size_t i = 0; i < count; ++i) {
+			std::iter_swap(first + offsets_l[i], last - offsets_r[i]);
+		}
+	} else if (count > 0) {
+		RandomIt l = first + offsets_l[0];
+		RandomIt r = last - offsets_r[0];
+		T value = std::move(*l);
+		*l = std::move(*r);
+		for (size_t i = 1; i < count; ++i) {
+			l = first + offsets_l[i];
+			*r = std::move(*l);
+			r = last - offsets_r[i];
+			*l = std::move(*r);
+		}
+		*r = std::move(value);
+	}
+}
+
+// pdq_partition_right with block partitioning: the comparisons only feed
+// the offset counters, never a branch
+template <typename RandomIt, typename Compare>
+std::pair<RandomIt, bool> pdq_partition_right_branchless(RandomIt begin, RandomIt end, Compare comp) {
+	using T = typename std::iterator_traits<RandomIt>::value_type;
+	T pivot = std::move(*begin);
+	RandomIt first = begin;
+	RandomIt last = end;
+	while (comp(*++first, pivot)) {
+	}
+	if (first - 1 == begin) {
+		while (first < last && !comp(*--last, pivot)) {
+		}
+	} else {
+		while (!comp(*--last, pivot)) {
+		}
+	}
+	bool already_partitioned = first >= last;
+	if (!already_partitioned) {
+		std::iter_swap(first, last);
+		++first;
+
+		unsigned char offsets_l[pdq_block_size];
+		unsigned char offsets_r[pdq_block_size];
+		RandomIt offsets_l_base = first;
+		RandomIt offsets_r_base = last;
+		size_t num_l = 0, num_r = 0, start_l = 0, start_r = 0;
+		while (first < last) {
+			// Fill the emptied offset buffers from the unknown middle
+			size_t unknown = static_cast<size_t>(last - first);
+			size_t left_split = num_l == 0 ? (num_r == 0 ? unknown / 2 : unknown) : 0;
+			size_t right_split = num_r == 0 ? unknown - left_split : 0;
+			left_split = std::min(left_split, pdq_block_size);
+			right_split = std::min(right_split, pdq_block_size);
+			for (size_t i = 0; i < left_split; ++i) {
+				offsets_l[num_l] = static_cast<unsigned char>(i);
+				num_l += !comp(*first, pivot);
+				++first;
+			}
+			for (size_t i = 0; i < right_split;) {
+				offsets_r[num_r] = static_cast<unsigned char>(++i);
+				num_r += comp(*--last, pivot);
+			}
+
+			size_t count = std::min(num_l, num_r);
+			pdq_swap_offsets(offsets_l_base, offsets_r_base, offsets_l + start_l, offsets_r + start_r,
+				count, num_l == num_r);
+			num_l -= count;
+			num_r -= count;
+			start_l += count;
+			start_r += count;
+			if (num_l == 0) {
+				start_l = 0;
+				offsets_l_base = first;
+			}
+			if (num_r == 0) {
+				start_r = 0;
+				offsets_r_base = last;
+			}
+		}
+		// One buffer may still hold misplaced elements: move them to the boundary
+		if (num_l != 0) {
+			while (num_l--) {
+				std::iter_swap(offsets_l_base + offsets_l[start_l + num_l], --last);
+			}
+			first = last;
+		}
+		if (num_r != 0) {
+			while (num_r--) {
+				std::iter_swap(offsets_r_base - offsets_r[start_r + num_r], first);
+				++first;
+			}
+			last = first;
+		}
+	}
+	RandomIt pivot_position = first - 1;
+	*begin = std::move(*pivot_position);
+	*pivot_position = std::move(pivot);
+	return {pivot_position, already_partitioned};
+}
+
+// Partitions around the pivot *first with elements equal to it going left.
+// Used when the pivot equals the element before the range, which is no
+// greater than any in it: the left part is then all equal and done.
+template <typename RandomIt, typename Compare>
+RandomIt pdq_partition_left(RandomIt begin, RandomIt end, Compare comp) {
+	using T = typename std::iterator_traits<RandomIt>::value_type;
+	T pivot = std::move(*begin);
+	RandomIt first = begin;
+	RandomIt last = end;
+	while (comp(pivot, *--last)) {
+	}
+	if (last + 1 == end) {
+		while (first < last && !comp(pivot, *++first)) {
+		}
+	} else {
+		while (!comp(pivot, *++first)) {
+		}
+	}
+	while (first < last) {
+		std::iter_swap(first, last);
+		while (comp(pivot, *--last)) {
+		}
+		while (!comp(pivot, *++first)) {
+		}
+	}
+	*begin = std::move(*last);
+	*last = std::move(pivot);
+	return last;
+}
+
+template <bool Branchless, typename RandomIt, typename Compare>
+void pdq_sort_loop(RandomIt begin, RandomIt end, Compare comp, int bad_allowed, bool leftmost) {
+	while (true) {
+		const ptrdiff_t size = end - begin;
+		if (size < pdq_insertion_sort_threshold) {
+			if (leftmost) {
+				insertion_sort(begin, end, comp);
+			} else {
+				insertion_sort<RandomIt, Compare, false>(begin, end, comp);
+			}
+			return;
+		}
+
+		// Pivot to *begin: median of 3, or for large ranges of 3 medians of 3
+		const ptrdiff_t half = size / 2;
+		if (size > pdq_ninther_threshold) {
+			pdq_sort3(begin, begin + half, end - 1, comp);
+			pdq_sort3(begin + 1, begin + (half - 1), end - 2, comp);
+			pdq_sort3(begin + 2, begin + (half + 1), end - 3, comp);
+			pdq_sort3(begin + (half - 1), begin + half, begin + (half + 1), comp);
+			std::iter_swap(begin, begin + half);
+		} else {
+			pdq_sort3(begin + half, begin, end - 1, comp);
+		}
+
+		// *(begin - 1) is no greater than anything here; a pivot equal to it
+		// starts a run of equal elements, which is already in place
+		if (!leftmost && !comp(*(begin - 1), *begin)) {
+			begin = pdq_partition_left(begin, end, comp) + 1;
+			continue;
+		}
+
+		auto [pivot, already_partitioned] = Branchless ?
+			pdq_partition_right_branchless(begin, end, comp) : pdq_partition_right(begin, end, comp);
+		const ptrdiff_t left_size = pivot - begin;
+		const ptrdiff_t right_size = end - (pivot + 1);
+		if (left_size < size / 8 || right_size < size / 8) {
+			if (--bad_allowed == 0) {
+				std::make_heap(begin, end, comp);
+				std::sort_heap(begin, end, comp);
+				return;
+			}
+			// Break the pattern that made the partition unbalanced
+			if (left_size >= pdq_insertion_sort_threshold) {
+				std::iter_swap(begin, begin + left_size / 4);
+				std::iter_swap(pivot - 1, pivot - left_size / 4);
+				if (left_size > pdq_ninther_threshold) {
+					std::iter_swap(begin + 1, begin + (left_size / 4 + 1));
+					std::iter_swap(begin + 2, begin + (left_size / 4 + 2));
+					std::iter_swap(pivot - 2, pivot - (left_size / 4 + 1));
+					std::iter_swap(pivot - 3, pivot - (left_size / 4 + 2));
+				}
+			}
+			if (right_size >= pdq_insertion_sort_threshold) {
+				std::iter_swap(pivot + 1, pivot + (1 + right_size / 4));
+				std::iter_swap(end - 1, end - right_size / 4);
+				if (right_size > pdq_ninther_threshold) {
+					std::iter_swap(pivot + 2, pivot + (2 + right_size / 4));
+					std::iter_swap(pivot + 3, pivot + (3 + right_size / 4));
+					std::iter_swap(end - 2, end - (1 + right_size / 4));
+					std::iter_swap(end - 3, end - (2 + right_size / 4));
+				}
+			}
+		} else if (already_partitioned && pdq_partial_insertion_sort(begin, pivot, comp)
+				&& pdq_partial_insertion_sort(pivot + 1, end, comp)) {
+			return; // was (nearly) sorted
+		}
+
+		pdq_sort_loop<Branchless>(begin, pivot, comp, bad_allowed, leftmost);
+		begin = pivot + 1;
+		leftmost = false;
+	}
+}
+
+template <typename RandomIt, typename Compare>
+void pdq_sort(RandomIt first, RandomIt last, Compare comp) {
+	using T = typename std::iterator_traits<RandomIt>::value_type;
+	constexpr bool branchless = std::is_arithmetic<T>::value
+		&& (std::is_same<Compare, std::less<T>>::value || std::is_same<Compare, std::less<>>::value);
+	if (last - first < 2) {
+		return;
+	}
+	int log2 = 0;
+	for (auto size = last - first; size > 1; size >>= 1) {
+		++log2;
+	}
+	pdq_sort_loop<branchless>(first, last, comp, log2, true);
+}
+
+template <typename RandomIt>
+void pdq_sort(RandomIt first, RandomIt last) {
+	pdq_sort(first, last, std::less<typename std::iterator_traits<RandomIt>::value_type>{});
+}
+
+// Merges the sorted runs [first, middle) and [middle, last) in place with a
+// scratch buffer of `buffer_size` elements only, unlike std::inplace_merge,
+// which allocates one as large as the runs. A run that fits the buffer is
+// moved there and merged back directly; otherwise the longer run is split in
+// half, the matching split of the other one found by binary search, the
+// middle parts swapped with a rotation, and both halves merged recursively.
+template <typename RandomIt, typename T>
+void buffered_inplace_merge(RandomIt first, RandomIt middle, RandomIt last, T* buffer, size_t buffer_size) {
+	const size_t left = middle - first;
+	const size_t right = last - middle;
+	if (left == 0 || right == 0 || !(*middle < *(middle - 1))) {
+		return; // already in order
+	}
+	if (left + right == 2) {
+		std::iter_swap(first, middle);
+		return;
+	}
+	if (left <= right && left <= buffer_size) {
+		T* end = std::move(first, middle, buffer);
+		std::merge(std::make_move_iterator(buffer), std::make_move_iterator(end),
+			std::make_move_iterator(middle), std::make_move_iterator(last), first);
+		return;
+	}
+	if (right <= buffer_size) {
+		T* end = std::move(middle, last, buffer);
+		// Backwards, from the largest element, into the space the right run left
+		RandomIt out = last, a = middle;
+		T* b = end;
+		while (b != buffer) {
+			if (a != first && *(b - 1) < *(a - 1)) {
+				*--out = std::move(*--a);
+			} else {
+				*--out = std::move(*--b);
+			}
+		}
+		return;
+	}
+	RandomIt left_cut, right_cut;
+	if (left > right) {
+		left_cut = first + left / 2;
+		right_cut = std::lower_bound(middle, last, *left_cut);
+	} else {
+		right_cut = middle + right / 2;
+		left_cut = std::upper_bound(first, middle, *right_cut);
+	}
+	RandomIt new_middle = std::rotate(left_cut, middle, right_cut);
+	buffered_inplace_merge(first, left_cut, new_middle, buffer, buffer_size);
+	buffered_inplace_merge(new_middle, right_cut, last, buffer, buffer_size);
+}
+
+// Parallel sample sort: splitters picked from a sorted random sample cut the
+// input into about 4 buckets per thread; the elements are classified and
+// moved into their buckets chunk by chunk in parallel (the same counting and
+// scatter scheme as parallel_shuffle), and every bucket is then finished by
+// pdq_sort and moved back. Needs a scratch copy of the input; small inputs,
+// or a pool of one thread, are sorted by pdq_sort directly.
+template <typename T, typename Compare = std::less<T>>
+void parallel_sample_sort(T* data, size_t count, ThreadPool& pool = ThreadPool::shared(), Compare comp = {}) {
+	constexpr size_t min_parallel = size_t{1} << 16;
+	constexpr size_t oversampling = 32;
+	const size_t threads = pool.size();
+	if (count < min_parallel || threads == 1) {
+		pdq_sort(data, data + count, comp);
+		return;
+	}
+	const size_t buckets = std::min<size_t>(threads * 4, 1024);
+	const size_t chunks = threads * 4;
+	auto chunk_begin = [&](size_t chunk) { return count / chunks * chunk + std::min(chunk, count % chunks); };
+
+	// Sample positions only need to be spread out, not unpredictable
+	SplitMix64 engine{count};
+	std::vector<T> sample(buckets * oversampling);
+	for (T& value : sample) {
+		value = data[bounded_random(engine, count)];
+	}
+	pdq_sort(sample.begin(), sample.end(), comp);
+	std::vector<T> splitters;
+	for (size_t b = 1; b < buckets; ++b) {
+		splitters.push_back(sample[b * oversampling]);
+	}
+	auto bucket_of = [&](const T& value) {
+		return static_cast<size_t>(std::upper_bound(splitters.begin(), splitters.end(), value, comp)
+			- splitters.begin());
+	};
+
+	// Bucket of every element is kept from the counting pass for the scatter
+	std::vector<uint16_t> element_buckets(count);
+	std::vector<size_t> counts(chunks * buckets, 0);
+	pool.parallel_for(chunks, [&](size_t chunk) {
+		size_t* row = &counts[chunk * buckets];
+		for (size_t i = chunk_begin(chunk), end = chunk_begin(chunk + 1); i < end; ++i) {
+			size_t bucket = bucket_of(data[i]);
+			element_buckets[i] = static_cast<uint16_t>(bucket);
+			++row[bucket];
+		}
+	});
+	std::vector<size_t> bucket_begin(buckets + 1, 0);
+	size_t offset = 0;
+	for (size_t bucket = 0; bucket < buckets; ++bucket) {
+		bucket_begin[bucket] = offset;
+		for (size_t chunk = 0; chunk < chunks; ++chunk) {
+			size_t n = counts[chunk * buckets + bucket];
+			counts[chunk * buckets + bucket] = offset;
+			offset += n;
+		}
+	}
+	bucket_begin[buckets] = offset;
+
+	std::vector<T> scratch(count);
+	pool.parallel_for(chunks, [&](size_t chunk) {
+		size_t* row = &counts[chunk * buckets];
+		for (size_t i = chunk_begin(chunk), end = chunk_begin(chunk + 1); i < end; ++i) {
+			scratch[row[element_buckets[i]]++] = std::move(data[i]);
+		}
+	});
+	pool.parallel_for(buckets, [&](size_t bucket) {
+		T* first = scratch.data() + bucket_begin[bucket];
+		T* last = scratch.data() + bucket_begin[bucket + 1];
+		pdq_sort(first, last, comp);
+		std::move(first, last, data + bucket_begin[bucket]);
+	});
+}
@@ -1,217 +1,890 @@
-#include <iostream>
-#include <limits>
-#include <vector>
-#include <cmath>
-
-class IStatistics {
-public:
-	virtual ~IStatistics() {}
-
-	virtual void update(double next) = 0;
-	virtual double eval() const = 0;
-	virtual const char * name() const = 0;
-};
-
-class Min : public IStatistics {
-public:
-	Min() : m_min{std::numeric_limits<double>::max()} {
-	}
-
-	void update(double next) override {
-		if (next < m_min) {
-			m_min = next;
-		}
-	}
-
-	double eval() const override {
-		return m_min;
-	}
-
-	const char * name() const override {
-		return "min";
-	}
-
-private:
-	double m_min;
-};
-
-class Max : public IStatistics {
-public:
-	Max() : m_max{std::numeric_limits<double>::lowest()} {
-	}
-
-	void update(double next) override {
-		if (next > m_max) {
-			m_max = next;
-		}
-	}
-
-	double eval() const override {
-		return m_max;
-	}
-
-	const char * name() const override {
-		return "max";
-	}
-
-private:
-	double m_max;
-};
-
-class Mean : public IStatistics {
-public:
-	Mean() : m_count{0}, m_sum{0} {
-	}
-
-    void update(double next) override {
-		m_sum += next;
-		++m_count;
-	}
-
-    double eval() const override {
-		if (m_count == 0) {
-			return NAN;
-		}
-		return {m_sum/m_count};
-	}
-
-    const char* name() const override {
-		return "mean";
-	};
-
-private:
-    int m_count{0};
-    double m_sum{0};
-};
-
-class Std : public IStatistics {
-public:
-	Std() = default;
-
-    void update(double next) override {
-		values.push_back(next);
-	}
-
-    double eval() const override {
-		if (values.empty()) {
-			return NAN;
-		}
-		Mean mean_;
-		for (const double& val : values) {
-			mean_.update(val);
-		}
-		double mean = mean_.eval();
-		Mean disp;
-		for (const double& val : values) {
-			disp.update(std::pow(val - mean , 2));
-		}
-		return {std::sqrt(disp.eval())};
-	}
-
-    const char* name() const override {
-		return "std";
-	};
-
-private:
-	std::vector<double> values;
-};
-
-class Pct : public IStatistics {
-public:
-	Pct() = delete;
-	Pct(float percent) {
-		if (percent < 0) {
-			percent_ = 0;
-		} else if ( percent > 100 ) {
-			percent_ = 100;
-		} else percent_ = percent;
-		name_ = "pct(" + std::to_string(percent_) + ")";
-	};
-
-    void update(double next) override {
-		values.insert(std::lower_bound(values.begin(), values.end(), next), next);
-	}
-
-    double eval() const override {
-		if (values.empty()) {
-			return NAN;
-		}
-		int size = values.size();
-		int pos = floor(size * percent_ / 100.0);
-		if (pos == size) {
-			pos = size - 1;
-		}
-		return values[pos];
-	}
-
-    const char* name() const override {
-
-		return name_.c_str();
-	};
-
-private:
-	std::vector<double> values;
-	float percent_;
-	std::string name_;
-};
-
-class Pct90 : public Pct {
-public:
-	Pct90() : Pct(90) {
-	};
-
-    const char* name() const override {
-		return "pct90";
-	};
-};
-
-class Pct95 : public Pct {
-public:
-	Pct95() : Pct(95) {
-	};
-
-    const char* name() const override {
-		return "pct95";
-	};
-};
-
-int main() {
-
-	const size_t statistics_count = 7;
-	IStatistics *statistics[statistics_count];
-
-	statistics[0] = new Min{};
-	statistics[1] = new Max{};
-	statistics[2] = new Mean{};
-	statistics[3] = new Std{};
-	statistics[4] = new Pct90;
-	statistics[5] = new Pct95;
-	statistics[6] = new Pct(50);
-
-
-	double val = 0;
-	while (std::cin >> val) {
-		for (size_t i = 0; i < statistics_count; ++i) {
-			statistics[i]->update(val);
-		}
-	}
-
-	// Handle invalid input data
-	if (!std::cin.eof() && !std::cin.good()) {
-		std::cerr << "Invalid input data\n";
-		return 1;
-	}
-
-
-	// Print results if any
-	for (size_t i = 0; i < statistics_count; ++i) {
-		std::cout << statistics[i]->name() << " = " << statistics[i]->eval() << std::endl;
-	}
-
-	// Clear memory - delete all objects created by new
-	for (size_t i = 0; i < statistics_count; ++i) {
-		delete statistics[i];
-	}
-
-	return 0;
-}
\ No newline at end of file
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include "keyed.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "sample_input.h"
+#include "server.h"
+#include "statistics.h"
+#include "statistics_set.h"
+#include "windowed.h"
+
+#if defined(STATISTICS_PROFILE)
+#include "counting_new.h" // allocations for the --profile report
+#endif
+
+// One requested statistic: "min", "max", "mean", "std", "var", "skew", "kurt"
+// or a percentile ("pct", with `percent` set)
+struct StatisticSpec {
+	std::string kind;
+	float percent{0};
+	std::string name{}; // report name, empty for the statistic's own
+};
+
+// Parses a --stats list such as "min,max,p99.9". Percentiles are written as
+// pN or pctN and reported under the name they were requested with.
+bool parse_statistics_list(const char* text, std::vector<StatisticSpec>& specs) {
+	std::string list{text};
+	size_t begin = 0;
+	while (begin <= list.size()) {
+		size_t end = std::min(list.find(',', begin), list.size());
+		std::string token = list.substr(begin, end - begin);
+		begin = end + 1;
+		StatisticSpec spec;
+		size_t digits = token.rfind("pct", 0) == 0 ? 3 : token.rfind('p', 0) == 0 ? 1 : 0;
+		if (digits != 0) {
+			char* stop = nullptr;
+			const char* number = token.c_str() + digits;
+			spec.percent = std::strtof(number, &stop);
+			if (stop == number || *stop != '\0' || !(spec.percent >= 0 && spec.percent <= 100)) {
+				std::cerr << "Invalid percentile: " << token << "\n";
+				return false;
+			}
+			spec.kind = "pct";
+			spec.name = token;
+		} else if (token == "min" || token == "max" || token == "mean" || token == "std" ||
+				token == "var" || token == "skew" || token == "kurt") {
+			spec.kind = token;
+		} else {
+			std::cerr << "Unknown statistic: " << token << "\n";
+			return false;
+		}
+		specs.push_back(spec);
+	}
+	return true;
+}
+
+// What the tool reports when --stats isn't given
+std::vector<StatisticSpec> default_statistics_list() {
+	return {{"min"}, {"max"}, {"mean"}, {"std"}, {"pct", 90, "pct90"}, {"pct", 95, "pct95"}, {"pct", 50}};
+}
+
+struct Options {
+	Pct::Mode pct_mode{Pct::Mode::Sketch};
+	InputFormat format{InputFormat::Text};
+	SampleType type{SampleType::F64}; // what the statistics compute on
+	size_t threads{1};
+	std::vector<StatisticSpec> statistics; // empty: default_statistics_list()
+	WindowSpec window;  // sliding window, if set
+	WindowSpec decay;   // exponential decay half-life, if set
+	double emit_every{0}; // seconds between periodic reports, 0: only at exit
+	const char* save_histogram{nullptr}; // file to write the percentile histogram to
+	bool merge_histograms{false}; // inputs are saved histograms, not samples
+	const char* emit_state{nullptr}; // file ("-": stdout) to write the final state to
+	bool merge_state{false}; // inputs are states written by --emit-state
+	bool keyed{false}; // inputs are "key value" lines, statistics per key
+	const char* listen{nullptr}; // [HOST:]PORT to receive samples on instead of reading inputs
+	const char* query{nullptr}; // [HOST:]PORT of a --listen server to print the results of
+	bool profile{false}; // print a per-stage profile to stderr at exit
+	const char* profile_json{nullptr}; // file ("-": stderr) for the profile as JSON instead
+	std::vector<const char*> inputs;
+};
+
+// The default report, fixed at build time: runs without any vtable dispatch,
+// and its percentiles share one t-digest
+using DefaultStatistics = StatisticsSet<Min, Max, Mean, Std, SharedPct<Pct90, Pct95, StaticPct<50>>>;
+
+// True when the default report is all that's needed, so main() can use
+// DefaultStatistics instead of the runtime-configured set
+bool uses_default_statistics(const Options& options) {
+	return options.statistics.empty() && !options.window && !options.decay &&
+		options.pct_mode == Pct::Mode::Sketch && options.type == SampleType::F64;
+}
+
+// Windowed and decayed statistics only exist for double samples
+template <typename T>
+std::unique_ptr<BasicStatistics<T>> make_statistic(const std::string& kind, const Options& options) {
+	if constexpr (std::is_same<T, double>::value) {
+		if (options.window) {
+			if (kind == "min") return std::make_unique<WindowedMin>(options.window);
+			if (kind == "max") return std::make_unique<WindowedMax>(options.window);
+			if (kind == "mean") return std::make_unique<WindowedMean>(options.window);
+			if (kind == "std") return std::make_unique<WindowedStd>(options.window);
+			return nullptr;
+		}
+		if (options.decay) {
+			if (kind == "mean") return std::make_unique<DecayedMean>(options.decay);
+			if (kind == "std") return std::make_unique<DecayedStd>(options.decay);
+			if (kind != "min" && kind != "max") {
+				return nullptr;
+			}
+			// Min and max have no decayed form, they cover the whole stream
+		}
+	}
+	if (kind == "min") return std::make_unique<BasicMin<T>>();
+	if (kind == "max") return std::make_unique<BasicMax<T>>();
+	if (kind == "mean") return std::make_unique<BasicMean<T>>();
+	if (kind == "std") return std::make_unique<BasicStd<T>>();
+	if (kind == "var") return std::make_unique<BasicVar<T>>();
+	if (kind == "skew") return std::make_unique<BasicSkew<T>>();
+	if (kind == "kurt") return std::make_unique<BasicKurt<T>>();
+	return nullptr;
+}
+
+// Builds only the requested statistics, in the requested order. Percentiles
+// share one store, which is only created if a percentile is requested at all:
+// without percentiles (or with sketches) nothing keeps samples and memory
+// stays flat regardless of the input size.
+template <typename T>
+bool make_statistics(const Options& options, BasicDynamicStatisticsSet<T>& set) {
+	const std::vector<StatisticSpec> specs =
+		options.statistics.empty() ? default_statistics_list() : options.statistics;
+	std::unique_ptr<BasicPctGroup<T>> percentiles;
+	for (const StatisticSpec& spec : specs) {
+		if (spec.kind != "pct") {
+			std::unique_ptr<BasicStatistics<T>> statistic = make_statistic<T>(spec.kind, options);
+			if (!statistic) {
+				std::cerr << spec.kind << " is not available with --window/--decay\n";
+				return false;
+			}
+			set.add(std::move(statistic));
+			continue;
+		}
+		if (!percentiles) {
+			std::shared_ptr<BasicQuantileStore<T>> store = BasicPct<T>::make_store(options.pct_mode);
+			if constexpr (std::is_same<T, double>::value) {
+				if (options.window) {
+					store = std::make_shared<WindowedSketchStore>(options.window);
+				} else if (options.decay) {
+					store = std::make_shared<DecayedSketchStore>(options.decay);
+				}
+			}
+			percentiles = std::make_unique<BasicPctGroup<T>>(store);
+		}
+		set.add(percentiles->add(spec.percent, spec.name));
+	}
+	return true;
+}
+
+template <typename T = double>
+BasicDynamicStatisticsSet<T> make_statistics(const Options& options) {
+	BasicDynamicStatisticsSet<T> set;
+	make_statistics(options, set);
+	return set;
+}
+
+template <typename Set>
+void print_all(const Set& statistics) {
+	ProfileScope scope{ProfileStage::Report};
+	statistics.for_each([](const auto& statistic) {
+		std::cout << statistic.name() << " = " << statistic.eval() << std::endl;
+	});
+}
+
+// The histogram behind the percentiles of `statistics`, if they use one
+template <typename Set>
+const LogHistogram* find_histogram(const Set& statistics) {
+	using T = typename Set::sample_type;
+	const LogHistogram* histogram = nullptr;
+	statistics.for_each([&](const BasicStatistics<T>& statistic) {
+		auto pct = dynamic_cast<const BasicPct<T>*>(&statistic);
+		auto store = pct ? dynamic_cast<const BasicHistogramStore<T>*>(&pct->store()) : nullptr;
+		if (store && !histogram) {
+			histogram = &store->histogram();
+		}
+	});
+	return histogram;
+}
+
+bool save_histogram(const LogHistogram& histogram, const char* path) {
+	std::ofstream out{path, std::ios::binary};
+	histogram.save(out);
+	out.flush();
+	if (!out) {
+		std::cerr << "Failed to write histogram to " << path << "\n";
+		return false;
+	}
+	return true;
+}
+
+// --merge-histograms: merges the histograms saved by earlier runs and reports
+// the requested percentiles of the combined input
+int merge_histograms(const Options& options) {
+	LogHistogram merged;
+	for (size_t i = 0; i < options.inputs.size(); ++i) {
+		const char* input = options.inputs[i];
+		std::ifstream file;
+		bool is_stdin = std::strcmp(input, "-") == 0;
+		if (!is_stdin) {
+			file.open(input, std::ios::binary);
+		}
+		LogHistogram histogram;
+		if (!histogram.load(is_stdin ? std::cin : file)) {
+			std::cerr << "Invalid histogram in " << (is_stdin ? "stdin" : input) << "\n";
+			return 1;
+		}
+		if (i == 0) {
+			merged = std::move(histogram);
+		} else if (merged.same_layout(histogram)) {
+			merged.merge(histogram);
+		} else {
+			std::cerr << "Histogram in " << input << " has a different bucket layout\n";
+			return 1;
+		}
+	}
+
+	PctGroup percentiles{std::make_shared<HistogramStore>(merged)};
+	DynamicStatisticsSet statistics;
+	for (const StatisticSpec& spec : options.statistics.empty() ? default_statistics_list() : options.statistics) {
+		if (spec.kind == "pct") {
+			statistics.add(percentiles.add(spec.percent, spec.name));
+		}
+	}
+	print_all(statistics);
+	if (options.save_histogram && !save_histogram(merged, options.save_histogram)) {
+		return 1;
+	}
+	return 0;
+}
+
+// Prints the current results every `period` seconds from a background thread
+// while the input is still being read. Updates and reports are serialized by
+// lock(); the lock is only taken when periodic reports are enabled.
+template <typename Set>
+class Reporter {
+public:
+	Reporter(const Set& statistics, double period) : m_statistics{statistics} {
+		if (period > 0) {
+			m_thread = std::thread{[this, period] { run(period); }};
+		}
+	}
+
+	~Reporter() {
+		{
+			std::lock_guard<std::mutex> lock{m_mutex};
+			m_stop = true;
+		}
+		m_wakeup.notify_one();
+		if (m_thread.joinable()) {
+			m_thread.join();
+		}
+	}
+
+	bool enabled() const {
+		return m_thread.joinable();
+	}
+
+	std::unique_lock<std::mutex> lock() {
+		return std::unique_lock<std::mutex>{m_mutex};
+	}
+
+private:
+	void run(double period) {
+		auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(period));
+		auto next = std::chrono::steady_clock::now() + interval;
+		std::unique_lock<std::mutex> lock{m_mutex};
+		while (!m_wakeup.wait_until(lock, next, [this] { return m_stop; })) {
+			print_all(m_statistics);
+			std::cout << std::endl;
+			next += interval;
+		}
+	}
+
+	const Set& m_statistics;
+	std::mutex m_mutex;
+	std::condition_variable m_wakeup;
+	bool m_stop{false};
+	std::thread m_thread;
+};
+
+// Splits a memory-mapped file into one chunk per thread, computes partial
+// statistics (created by `make_set`) for each chunk in parallel and merges
+// them into `statistics`.
+template <typename Set, typename MakeSet>
+bool read_parallel(const char* path, const Options& options, MakeSet&& make_set, Set& statistics,
+		InputError& error) {
+	const InputFormat format = options.format;
+	error.source = path;
+	MappedFile file;
+	if (!file.open(path, error.reason)) {
+		return false;
+	}
+	std::vector<InputChunk> chunks = split_input(file, format, options.threads);
+	std::vector<Set> partials;
+	std::vector<InputError> errors(chunks.size(), error);
+	std::vector<char> ok(chunks.size(), false);
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		partials.push_back(make_set());
+	}
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		workers.emplace_back([&, i] {
+			auto feed = [&](const double* data, size_t count) {
+				partials[i].update(data, count);
+			};
+			ok[i] = read_chunk(file, chunks[i], format, feed, errors[i]);
+		});
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		if (!ok[i]) {
+			error = errors[i];
+			resolve_error_line(file, chunks[i], error);
+			return false;
+		}
+		ProfileScope scope{ProfileStage::Merge};
+		statistics.merge(partials[i]);
+	}
+	return true;
+}
+
+// Reads text from stdin through the reader/parser/aggregator pipeline, with
+// one statistics set per aggregator thread, and merges them into `statistics`.
+template <typename Set, typename MakeSet>
+bool read_stdin_pipelined(const Options& options, MakeSet&& make_set, Set& statistics, InputError& error) {
+	PipelineConfig config = make_pipeline_config(options.threads);
+	// Every aggregator would keep its own copy of stored samples, and merging
+	// them would double the peak. Use a single aggregator instead.
+	if (statistics.stores_samples()) {
+		config.parsers += config.aggregators - 1;
+		config.aggregators = 1;
+	}
+	std::vector<Set> partials;
+	for (size_t i = 0; i < config.aggregators; ++i) {
+		partials.push_back(make_set());
+	}
+	auto update = [](Set& partial, const double* data, size_t count) {
+		partial.update(data, count);
+	};
+	if (!read_pipelined(STDIN_FILENO, config, partials, update, error)) {
+		return false;
+	}
+	ProfileScope scope{ProfileStage::Merge};
+	for (const Set& partial : partials) {
+		statistics.merge(partial);
+	}
+	return true;
+}
+
+// Merges a state written by --emit-state into `statistics`
+template <typename Set, typename MakeSet>
+bool read_state(const char* input, MakeSet&& make_set, Set& statistics, InputError& error) {
+	bool is_stdin = std::strcmp(input, "-") == 0;
+	std::ifstream file;
+	if (!is_stdin) {
+		error.source = input;
+		file.open(input, std::ios::binary);
+		if (!file) {
+			error.reason = std::string{"can't open: "} + std::strerror(errno);
+			return false;
+		}
+	}
+	ProfileScope scope{ProfileStage::Merge};
+	Set partial = make_set();
+	if (!load_state(partial, is_stdin ? std::cin : file, error.reason)) {
+		return false;
+	}
+	statistics.merge(partial);
+	return true;
+}
+
+template <typename Set>
+bool emit_state(const Set& statistics, const char* path) {
+	if (std::strcmp(path, "-") == 0) {
+		save_state(statistics, std::cout);
+		std::cout.flush();
+		return static_cast<bool>(std::cout);
+	}
+	std::ofstream out{path, std::ios::binary};
+	save_state(statistics, out);
+	out.flush();
+	if (!out) {
+		std::cerr << "Failed to write state to " << path << "\n";
+		return false;
+	}
+	return true;
+}
+
+// Fails if samples had to be skipped because they don't fit the sample type
+template <typename Set>
+bool check_sample_type(const Set&) {
+	return true;
+}
+
+// Reports the samples that didn't fit the sample type T, if any
+template <typename T>
+bool check_rejected(size_t rejected, double first_rejected) {
+	if (rejected == 0) {
+		return true;
+	}
+	InputError error;
+	std::ostringstream reason;
+	reason << rejected << " samples don't fit --type " << SampleTraits<T>::name << ", e.g. " << first_rejected;
+	error.reason = reason.str();
+	std::cerr << error.describe() << "\n";
+	return false;
+}
+
+template <typename Set>
+bool check_sample_type(const ConvertingSet<Set>& statistics) {
+	return check_rejected<typename Set::sample_type>(statistics.rejected(), statistics.first_rejected());
+}
+
+// Reads every input into a statistics set created by `make_set` and prints it
+template <typename Set, typename MakeSet>
+int run(const Options& options, MakeSet&& make_set) {
+	Set statistics = make_set();
+	Reporter<Set> reporter{statistics, options.emit_every};
+
+	// Feed whole blocks of every input to every statistic
+	auto feed = [&](const double* data, size_t count) {
+		if (reporter.enabled()) {
+			auto lock = reporter.lock();
+			statistics.update(data, count);
+		} else {
+			statistics.update(data, count);
+		}
+	};
+	for (const char* input : options.inputs) {
+		InputError error;
+		bool is_stdin = std::strcmp(input, "-") == 0;
+		bool ok;
+		if (options.merge_state) {
+			ok = read_state(input, make_set, statistics, error);
+		} else if (options.threads > 1 && !is_stdin) {
+			ok = read_parallel(input, options, make_set, statistics, error);
+		} else if (options.threads > 1 && options.format == InputFormat::Text) {
+			ok = read_stdin_pipelined(options, make_set, statistics, error);
+		} else {
+			ok = read_samples(input, options.format, feed, error);
+		}
+		// Handle invalid input data
+		if (!ok) {
+			std::cerr << error.describe() << "\n";
+			return 1;
+		}
+	}
+	if (!check_sample_type(statistics)) {
+		return 1;
+	}
+
+	// Print results if any, unless the state goes to stdout instead
+	auto lock = reporter.lock();
+	bool state_to_stdout = options.emit_state && std::strcmp(options.emit_state, "-") == 0;
+	if (!state_to_stdout) {
+		print_all(statistics);
+	}
+
+	if (options.emit_state && !emit_state(statistics, options.emit_state)) {
+		return 1;
+	}
+	if (options.save_histogram && !save_histogram(*find_histogram(statistics), options.save_histogram)) {
+		return 1;
+	}
+	return 0;
+}
+
+// Reads "key value" lines from every input and prints the statistics of
+// the set made by `make_set` for every key, key by key; they are computed
+// per key column by column (see KeyedStatistics). With --threads, every file
+// is split into chunks of lines aggregated in parallel, each thread into a
+// partial result that is merged into the total (and emptied) whenever it
+// has taken max_partial_samples samples or holds max_partial_keys keys.
+template <typename Set, typename MakeSet>
+int run_keyed(const Options& options, MakeSet&& make_set) {
+	using T = typename Set::sample_type;
+	constexpr size_t max_partial_samples = size_t{1} << 20;
+	constexpr size_t max_partial_keys = size_t{1} << 16;
+	const KeyedLayout<T> layout = KeyedLayout<T>::of(make_set());
+	KeyedStatistics<T> statistics{layout};
+	for (const char* input : options.inputs) {
+		InputError error;
+		bool ok;
+		if (options.threads > 1 && std::strcmp(input, "-") != 0) {
+			error.source = input;
+			MappedFile file;
+			ok = file.open(input, error.reason);
+			std::vector<InputChunk> chunks = ok ? split_lines(file, options.threads) : std::vector<InputChunk>{};
+			std::vector<InputError> errors(chunks.size(), error);
+			std::vector<char> chunk_ok(chunks.size(), false);
+			std::mutex merge_mutex;
+			auto merge = [&](KeyedStatistics<T>& partial) {
+				ProfileScope scope{ProfileStage::Merge};
+				std::lock_guard<std::mutex> lock{merge_mutex};
+				statistics.merge(partial);
+				partial.clear();
+			};
+			run_tasks(chunks.size(), chunks.size(), [&](size_t i) {
+				KeyedStatistics<T> partial{layout};
+				auto feed = [&](std::string_view key, double value) {
+					partial.update(key, value);
+					if (partial.samples() >= max_partial_samples || partial.size() >= max_partial_keys) {
+						merge(partial);
+					}
+				};
+				chunk_ok[i] = read_keyed_chunk(file, chunks[i], feed, errors[i]);
+				merge(partial);
+			});
+			for (size_t i = 0; i < chunks.size() && ok; ++i) {
+				if (!chunk_ok[i]) {
+					error = errors[i];
+					resolve_error_line(file, chunks[i], error);
+					ok = false;
+				}
+			}
+		} else {
+			auto feed = [&](std::string_view key, double value) { statistics.update(key, value); };
+			ok = read_keyed_samples(input, feed, error);
+		}
+		if (!ok) {
+			std::cerr << error.describe() << "\n";
+			return 1;
+		}
+	}
+	statistics.flush();
+
+	if (!check_rejected<T>(statistics.rejected(), statistics.first_rejected())) {
+		return 1;
+	}
+	ProfileScope scope{ProfileStage::Report};
+	statistics.for_each_result([](std::string_view key, const char* name, double value) {
+		std::cout << key << " " << name << " = " << value << "\n";
+	});
+	std::cout.flush();
+	return 0;
+}
+
+// Receives samples on `options.listen` until SIGINT or SIGTERM, with a
+// reactor and a shard of statistics (created by `make_set`) per thread, then
+// prints the results. --emit-every prints them periodically meanwhile.
+template <typename Set, typename MakeSet>
+int serve(const Options& options, MakeSet&& make_set) {
+	ServerAddress address;
+	ServerAddress::parse(options.listen, address);
+
+	// Blocked before the reactors start, so only sigwait() below sees them
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	IngestServer<Set> server{options.format, make_set};
+	std::string error;
+	if (!server.start(address, options.threads, error)) {
+		std::cerr << "Failed to listen on " << error << "\n";
+		return 1;
+	}
+	std::cerr << "Listening on " << address.describe() << " (UDP and TCP), " << options.threads << " reactors\n";
+	if (options.emit_every > 0) {
+		auto period = std::chrono::duration<double>(options.emit_every);
+		auto seconds = std::chrono::duration_cast<std::chrono::seconds>(period);
+		auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(period - seconds);
+		timespec timeout{static_cast<time_t>(seconds.count()), static_cast<long>(nanoseconds.count())};
+		while (sigtimedwait(&signals, nullptr, &timeout) < 0) {
+			if (errno == EAGAIN) {
+				std::cout << server.report() << std::endl;
+			}
+		}
+	} else {
+		int signal;
+		sigwait(&signals, &signal);
+	}
+	server.stop();
+
+	Set statistics = server.snapshot();
+	if (server.dropped() != 0) {
+		std::cerr << "Dropped " << server.dropped() << " malformed datagrams or partial samples\n";
+	}
+	if (!check_sample_type(statistics)) {
+		return 1;
+	}
+	print_all(statistics);
+	return 0;
+}
+
+// Prints the current results of a --listen server
+int query(const Options& options) {
+	ServerAddress address;
+	ServerAddress::parse(options.query, address);
+	if (address.host.empty()) {
+		address.host = "localhost";
+	}
+	std::string report;
+	std::string error;
+	if (!query_server(address, 2000, report, error)) {
+		std::cerr << "Query failed: " << error << "\n";
+		return 1;
+	}
+	std::cout << report << std::flush;
+	return 0;
+}
+
+// Usage: statistics [--stats LIST] [--exact | --histogram] [--format text|f64|f32] [--threads N]
+//                   [--type f64|f32|u32|i64] [--window N|Ts] [--decay N|Ts] [--emit-every SECONDS]
+//                   [--save-histogram OUT] [--merge-histograms]
+//                   [--emit-state OUT] [--merge-state] [--keyed]
+//                   [--listen [HOST:]PORT | --query [HOST:]PORT]
+//                   [--profile | --profile-json FILE] [FILE...]
+// `--stats` selects what to report, e.g. "min,max,p99.9" (see parse_statistics_list),
+// by default min, max, mean, std and the 90th, 95th and 50th percentiles.
+// `--exact` keeps every sample for bit-exact percentiles (small inputs only),
+// `--histogram` computes them from a log-bucketed histogram (< 0.4% relative
+// error). `--save-histogram` writes that histogram to OUT; with
+// `--merge-histograms` the inputs are such files, and the percentiles of
+// their combined samples are reported.
+// `--type` computes on float or integer samples instead of double: integer
+// sums are exact, and --exact keeps 4 bytes per f32/u32 sample instead of 8.
+// Input that doesn't fit the type is an error.
+// `--emit-state` writes the final state of every statistic to OUT ("-":
+// stdout, instead of the report); with `--merge-state` the inputs are such
+// states, merged as if their samples had been read by this run. Both ends
+// must request the same statistics with the same percentile mode.
+// Files are memory-mapped; without files (or with "-") stdin is read.
+// `--threads` splits each file between N workers (0: one per core); text on
+// stdin is then read, parsed and aggregated by overlapping pipeline stages.
+// `--window` reports over the last N samples or T seconds only, `--decay`
+// weights samples down with the given half-life. `--emit-every` prints the
+// current results periodically while input is still arriving.
+// `--keyed` reads "key value" lines instead (e.g. "GET/index 12.5") and
+// reports the statistics of every key, sorted by key, as "KEY NAME = VALUE"
+// lines: all groups are computed in one pass over the input.
+// `--listen` runs as a server instead of reading inputs: UDP datagrams and
+// TCP streams to PORT carry binary samples (--format f64 or f32), a "query"
+// datagram is answered with the current report, and the final one is printed
+// on SIGINT or SIGTERM. `--threads` is the number of reactors, each with its
+// own sockets and statistics, merged per query. `--query` sends that query
+// and prints the reply, e.g. `generate --format f64 | nc HOST PORT` feeds a
+// server and `statistics --query HOST:PORT` reads it.
+// STATISTICS_HUGE_PAGES=1 backs the samples kept by --exact with huge pages.
+// `--profile` prints where the time went (read, parse, convert, aggregate
+// per statistic, merge, report), allocations and peak memory to stderr at
+// exit, `--profile-json` writes that to FILE ("-": stderr) as JSON. Both
+// need a build with -DSTATISTICS_PROFILE=ON.
+bool parse_options(int argc, char* argv[], Options& options) {
+	for (int i = 1; i < argc; ++i) {
+		bool has_value = i + 1 < argc;
+		if (std::strcmp(argv[i], "--exact") == 0) {
+			options.pct_mode = Pct::Mode::Exact;
+		} else if (std::strcmp(argv[i], "--profile") == 0 ||
+				(std::strcmp(argv[i], "--profile-json") == 0 && has_value)) {
+#if defined(STATISTICS_PROFILE)
+			options.profile = true;
+			if (std::strcmp(argv[i], "--profile-json") == 0) {
+				options.profile_json = argv[++i];
+			}
+#else
+			std::cerr << argv[i] << " needs a build with -DSTATISTICS_PROFILE=ON\n";
+			return false;
+#endif
+		} else if (std::strcmp(argv[i], "--type") == 0 && has_value) {
+			if (!parse_sample_type(argv[++i], options.type)) {
+				std::cerr << "Unknown sample type: " << argv[i] << "\n";
+				return false;
+			}
+		} else if (std::strcmp(argv[i], "--histogram") == 0) {
+			options.pct_mode = Pct::Mode::Histogram;
+		} else if (std::strcmp(argv[i], "--save-histogram") == 0 && has_value) {
+			options.save_histogram = argv[++i];
+		} else if (std::strcmp(argv[i], "--merge-histograms") == 0) {
+			options.merge_histograms = true;
+		} else if (std::strcmp(argv[i], "--emit-state") == 0 && has_value) {
+			options.emit_state = argv[++i];
+		} else if (std::strcmp(argv[i], "--merge-state") == 0) {
+			options.merge_state = true;
+		} else if (std::strcmp(argv[i], "--keyed") == 0) {
+			options.keyed = true;
+		} else if ((std::strcmp(argv[i], "--listen") == 0 || std::strcmp(argv[i], "--query") == 0) && has_value) {
+			const char*& target = argv[i][2] == 'l' ? options.listen : options.query;
+			ServerAddress address;
+			target = argv[++i];
+			if (!ServerAddress::parse(argv[i], address)) {
+				std::cerr << "Invalid address: " << argv[i] << "\n";
+				return false;
+			}
+		} else if (std::strcmp(argv[i], "--stats") == 0 && has_value) {
+			options.statistics.clear();
+			if (!parse_statistics_list(argv[++i], options.statistics)) {
+				return false;
+			}
+		} else if (std::strcmp(argv[i], "--threads") == 0 && has_value) {
+			options.threads = std::strtoul(argv[++i], nullptr, 10);
+			if (options.threads == 0) {
+				options.threads = std::max(1u, std::thread::hardware_concurrency());
+			}
+		} else if (std::strcmp(argv[i], "--format") == 0 && has_value) {
+			if (!parse_input_format(argv[++i], options.format)) {
+				std::cerr << "Unknown input format: " << argv[i] << "\n";
+				return false;
+			}
+		} else if ((std::strcmp(argv[i], "--window") == 0 || std::strcmp(argv[i], "--decay") == 0) && has_value) {
+			WindowSpec& spec = argv[i][2] == 'w' ? options.window : options.decay;
+			if (!WindowSpec::parse(argv[++i], spec)) {
+				std::cerr << "Invalid window: " << argv[i] << "\n";
+				return false;
+			}
+		} else if (std::strcmp(argv[i], "--emit-every") == 0 && has_value) {
+			options.emit_every = std::strtod(argv[++i], nullptr);
+			if (!(options.emit_every > 0)) {
+				std::cerr << "Invalid report period: " << argv[i] << "\n";
+				return false;
+			}
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			std::cerr << "Unknown option: " << argv[i] << "\n";
+			return false;
+		} else {
+			options.inputs.push_back(argv[i]);
+		}
+	}
+	if (options.query) {
+		return true;
+	}
+	if (options.listen && (!options.inputs.empty() || options.format == InputFormat::Text || options.window ||
+			options.decay || options.emit_state || options.merge_state || options.merge_histograms ||
+			options.save_histogram || options.keyed)) {
+		std::cerr << "--listen needs --format f64 or f32 and can't be combined with input files, --window, "
+			"--decay, --emit-state, --merge-state, --keyed or the histogram files\n";
+		return false;
+	}
+	if (options.inputs.empty()) {
+		options.inputs.push_back("-");
+	}
+	if (options.window && options.decay) {
+		std::cerr << "--window and --decay can't be combined\n";
+		return false;
+	}
+	// Windows follow one stream in arrival order, partial results can't be merged
+	if (options.threads > 1 && (options.window || options.decay || (options.emit_every > 0 && !options.listen))) {
+		std::cerr << "--window, --decay and --emit-every need single-threaded input\n";
+		return false;
+	}
+	if (options.type != SampleType::F64 && (options.window || options.decay)) {
+		std::cerr << "--window and --decay need --type f64\n";
+		return false;
+	}
+	if ((options.emit_state || options.merge_state) && (options.window || options.decay)) {
+		std::cerr << "--emit-state and --merge-state can't be combined with --window or --decay\n";
+		return false;
+	}
+	if (options.keyed && (options.format != InputFormat::Text || options.window || options.decay ||
+			options.emit_every > 0 || options.emit_state || options.merge_state || options.merge_histograms ||
+			options.save_histogram)) {
+		std::cerr << "--keyed reads text and can't be combined with --format, --window, --decay, "
+			"--emit-every, --emit-state, --merge-state or the histogram files\n";
+		return false;
+	}
+	if (options.merge_state && options.merge_histograms) {
+		std::cerr << "--merge-state and --merge-histograms can't be combined\n";
+		return false;
+	}
+	if (options.merge_histograms) {
+		for (const StatisticSpec& spec : options.statistics) {
+			if (spec.kind != "pct") {
+				std::cerr << "--merge-histograms only reports percentiles\n";
+				return false;
+			}
+		}
+		return true;
+	}
+	if (options.save_histogram) {
+		if (options.pct_mode == Pct::Mode::Exact || options.window || options.decay) {
+			std::cerr << "--save-histogram can't be combined with --exact, --window or --decay\n";
+			return false;
+		}
+		bool has_percentile = options.statistics.empty();
+		for (const StatisticSpec& spec : options.statistics) {
+			has_percentile = has_percentile || spec.kind == "pct";
+		}
+		if (!has_percentile) {
+			std::cerr << "--save-histogram needs a percentile in --stats\n";
+			return false;
+		}
+		options.pct_mode = Pct::Mode::Histogram;
+	}
+	DynamicStatisticsSet check;
+	return make_statistics(options, check);
+}
+
+// Runs what the options ask for, returns the exit status
+int run_options(const Options& options) {
+	if (options.merge_histograms) {
+		return merge_histograms(options);
+	}
+	if (options.query) {
+		return query(options);
+	}
+	// Runs the input through sets made by make_set(): served, keyed or plain
+	auto run_with = [&](auto make_set) {
+		using Set = decltype(make_set());
+		if (options.listen) {
+			return serve<Set>(options, make_set);
+		}
+		return options.keyed ? run_keyed<Set>(options, make_set) : run<Set>(options, make_set);
+	};
+	// Statistics on samples converted to --type
+	auto typed = [&](auto sample) {
+		using T = decltype(sample);
+		using Set = ConvertingSet<BasicDynamicStatisticsSet<T>>;
+		return run_with([&] { return Set{make_statistics<T>(options)}; });
+	};
+	if (uses_default_statistics(options)) {
+		return run_with([] { return DefaultStatistics{}; });
+	}
+	switch (options.type) {
+	case SampleType::F32:
+		return typed(float{});
+	case SampleType::U32:
+		return typed(uint32_t{});
+	case SampleType::I64:
+		return typed(int64_t{});
+	case SampleType::F64:
+		break;
+	}
+	return run_with([&] { return make_statistics(options); });
+}
+
+#if defined(STATISTICS_PROFILE)
+bool report_profile(const Options& options) {
+	Profiler::instance().set_allocations(allocation_count.load(), allocated_bytes.load());
+	if (!options.profile_json) {
+		Profiler::instance().report(std::cerr);
+		return true;
+	}
+	if (std::strcmp(options.profile_json, "-") == 0) {
+		Profiler::instance().report_json(std::cerr);
+		return true;
+	}
+	std::ofstream out{options.profile_json};
+	Profiler::instance().report_json(out);
+	if (!out) {
+		std::cerr << "Failed to write the profile to " << options.profile_json << "\n";
+		return false;
+	}
+	return true;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+
+	Options options;
+	if (!parse_options(argc, argv, options)) {
+		return 1;
+	}
+
+#if defined(STATISTICS_PROFILE)
+	if (options.profile) {
+		Profiler::instance().enable();
+		int status = run_options(options);
+		return report_profile(options) ? status : 1;
+	}
+#endif
+	return run_options(options);
+}
@@ -0,0 +1,1124 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "histogram.h"
+#include "kernels.h"
+#include "sample_arena.h"
+#include "sample_type.h"
+#include "serialize.h"
+#include "sort.h" // pdq_sort, buffered_inplace_merge
+#include "tdigest.h"
+
+// Statistics on samples of type T (see SampleTraits); whatever the sample
+// type, results are reported as double.
+template <typename T>
+class BasicStatistics {
+public:
+	using sample_type = T;
+
+	virtual ~BasicStatistics() {}
+
+	virtual void update(T next) = 0;
+	// Batch entry point: one virtual call per block instead of per sample.
+	// Implementations process the block in a tight non-virtual loop.
+	virtual void update(const T* data, size_t count) = 0;
+	// Same as above; statistics that can use the block summary shared between
+	// all statistics (see SampleBlock) override this one.
+	virtual void update(const BasicSampleBlock<T>& block) {
+		update(block.data(), block.size());
+	}
+	// Folds in the partial result of another statistic of the same type (e.g.
+	// one computed by another thread). Throws std::bad_cast on a type mismatch.
+	virtual void merge(const BasicStatistics& other) = 0;
+	virtual double eval() const = 0;
+	virtual const char * name() const = 0;
+	// True if memory grows with the number of samples seen
+	virtual bool stores_samples() const {
+		return false;
+	}
+	// Compact binary snapshot of the state (see serialize.h). A snapshot
+	// loaded into a fresh statistic of the same type merges like a partial
+	// result of another thread. Throws std::logic_error if there is none.
+	virtual void save(std::ostream& /*out*/) const {
+		throw std::logic_error(std::string{name()} + " has no snapshot format");
+	}
+	// Replaces the state with a snapshot; false if it is malformed
+	virtual bool load(std::istream& /*in*/) {
+		throw std::logic_error(std::string{name()} + " has no snapshot format");
+	}
+};
+
+using IStatistics = BasicStatistics<double>;
+
+template <typename T>
+class BasicMin : public BasicStatistics<T> {
+public:
+	BasicMin() : m_min{std::numeric_limits<T>::max()} {
+	}
+
+	void update(T next) override {
+		if (next < m_min) {
+			m_min = next;
+		}
+	}
+
+	void update(const T* data, size_t count) override {
+		update(BasicSampleBlock<T>{data, count});
+	}
+
+	void update(const BasicSampleBlock<T>& block) override {
+		update(block.summary().min);
+	}
+
+	void merge(const BasicStatistics<T>& other) override {
+		update(dynamic_cast<const BasicMin&>(other).m_min);
+	}
+
+	double eval() const override {
+		return m_min;
+	}
+
+	const char * name() const override {
+		return "min";
+	}
+
+	void save(std::ostream& out) const override {
+		write_value<T>(out, m_min);
+	}
+
+	bool load(std::istream& in) override {
+		m_min = read_value<T>(in);
+		return static_cast<bool>(in);
+	}
+
+private:
+	T m_min;
+};
+
+using Min = BasicMin<double>;
+
+template <typename T>
+class BasicMax : public BasicStatistics<T> {
+public:
+	BasicMax() : m_max{std::numeric_limits<T>::lowest()} {
+	}
+
+	void update(T next) override {
+		if (next > m_max) {
+			m_max = next;
+		}
+	}
+
+	void update(const T* data, size_t count) override {
+		update(BasicSampleBlock<T>{data, count});
+	}
+
+	void update(const BasicSampleBlock<T>& block) override {
+		update(block.summary().max);
+	}
+
+	void merge(const BasicStatistics<T>& other) override {
+		update(dynamic_cast<const BasicMax&>(other).m_max);
+	}
+
+	double eval() const override {
+		return m_max;
+	}
+
+	const char * name() const override {
+		return "max";
+	}
+
+	void save(std::ostream& out) const override {
+		write_value<T>(out, m_max);
+	}
+
+	bool load(std::istream& in) override {
+		m_max = read_value<T>(in);
+		return static_cast<bool>(in);
+	}
+
+private:
+	T m_max;
+};
+
+using Max = BasicMax<double>;
+
+// Sums in the widened sum type of the samples, exact for integers
+template <typename T>
+class BasicMean : public BasicStatistics<T> {
+public:
+	using sum_type = typename SampleTraits<T>::sum_type;
+
+	BasicMean() : m_count{0}, m_sum{0} {
+	}
+
+    void update(T next) override {
+		m_sum += next;
+		++m_count;
+	}
+
+    void update(const T* data, size_t count) override {
+		update(BasicSampleBlock<T>{data, count});
+	}
+
+    void update(const BasicSampleBlock<T>& block) override {
+		m_sum += block.summary().sum;
+		m_count += block.size();
+	}
+
+    void merge(const BasicStatistics<T>& other) override {
+		const BasicMean& mean = dynamic_cast<const BasicMean&>(other);
+		m_sum += mean.m_sum;
+		m_count += mean.m_count;
+	}
+
+    double eval() const override {
+		if (m_count == 0) {
+			return NAN;
+		}
+		return {static_cast<double>(m_sum) / m_count};
+	}
+
+    const char* name() const override {
+		return "mean";
+	};
+
+    void save(std::ostream& out) const override {
+		write_value<uint64_t>(out, m_count);
+		write_sum(out, m_sum);
+	}
+
+    bool load(std::istream& in) override {
+		m_count = read_value<uint64_t>(in);
+		m_sum = read_sum<sum_type>(in);
+		return static_cast<bool>(in);
+	}
+
+private:
+    size_t m_count{0};
+    sum_type m_sum{0};
+};
+
+using Mean = BasicMean<double>;
+
+// One-pass central moments (Welford, extended to 3rd/4th order by Pebay).
+// Constant memory and numerically stable, can be read at any time.
+template <unsigned Order>
+class Moments {
+	static_assert(Order >= 2 && Order <= 4, "Moments supports orders 2..4");
+
+public:
+	Moments() = default;
+
+	// From its parts, e.g. kept in separate columns (see KeyedStatistics)
+	Moments(size_t count, double mean, double m2, double m3 = 0, double m4 = 0)
+		: m_count{count}, m_mean{mean}, m_m2{m2}, m_m3{m3}, m_m4{m4} {
+	}
+
+	void add(double next) {
+		double n1 = static_cast<double>(m_count);
+		++m_count;
+		double n = static_cast<double>(m_count);
+		double delta = next - m_mean;
+		double delta_n = delta / n;
+		double term1 = delta * delta_n * n1;
+		m_mean += delta_n;
+		if constexpr (Order >= 4) {
+			double delta_n2 = delta_n * delta_n;
+			m_m4 += term1 * delta_n2 * (n * n - 3 * n + 3) + 6 * delta_n2 * m_m2 - 4 * delta_n * m_m3;
+		}
+		if constexpr (Order >= 3) {
+			m_m3 += term1 * delta_n * (n - 2) - 3 * delta_n * m_m2;
+		}
+		m_m2 += term1;
+	}
+
+	// Block update: moments of the block are computed in two passes over the
+	// (cache-hot) block and then combined with the running ones.
+	template <typename T>
+	void add(const T* data, size_t count) {
+		if (count == 0) {
+			return;
+		}
+		double sum = 0;
+		for (size_t i = 0; i < count; ++i) {
+			sum += static_cast<double>(data[i]);
+		}
+		Moments block;
+		block.m_count = count;
+		block.m_mean = sum / count;
+		double m2 = 0, m3 = 0, m4 = 0;
+		for (size_t i = 0; i < count; ++i) {
+			double d = static_cast<double>(data[i]) - block.m_mean;
+			double d2 = d * d;
+			m2 += d2;
+			if constexpr (Order >= 3) {
+				m3 += d2 * d;
+			}
+			if constexpr (Order >= 4) {
+				m4 += d2 * d2;
+			}
+		}
+		block.m_m2 = m2;
+		block.m_m3 = m3;
+		block.m_m4 = m4;
+		merge(block);
+	}
+
+	// Block update from a precomputed summary (second order only)
+	template <typename T>
+	void add(const BasicBlockSummary<T>& summary) {
+		static_assert(Order == 2, "a block summary only carries second order moments");
+		if (summary.count == 0) {
+			return;
+		}
+		Moments block;
+		block.m_count = summary.count;
+		double shifted_mean = summary.shifted_sum / summary.count;
+		block.m_mean = summary.shift + shifted_mean;
+		block.m_m2 = std::max(0.0, summary.shifted_sumsq - summary.shifted_sum * shifted_mean);
+		merge(block);
+	}
+
+	// Combines two partial results (Chan et al., Pebay)
+	void merge(const Moments& other) {
+		if (other.m_count == 0) {
+			return;
+		}
+		if (m_count == 0) {
+			*this = other;
+			return;
+		}
+		double na = static_cast<double>(m_count);
+		double nb = static_cast<double>(other.m_count);
+		double n = na + nb;
+		double delta = other.m_mean - m_mean;
+		double delta2 = delta * delta;
+		if constexpr (Order >= 4) {
+			m_m4 += other.m_m4 + delta2 * delta2 * na * nb * (na * na - na * nb + nb * nb) / (n * n * n)
+				+ 6 * delta2 * (na * na * other.m_m2 + nb * nb * m_m2) / (n * n)
+				+ 4 * delta * (na * other.m_m3 - nb * m_m3) / n;
+		}
+		if constexpr (Order >= 3) {
+			m_m3 += other.m_m3 + delta2 * delta * na * nb * (na - nb) / (n * n)
+				+ 3 * delta * (na * other.m_m2 - nb * m_m2) / n;
+		}
+		m_m2 += other.m_m2 + delta2 * na * nb / n;
+		m_mean += delta * nb / n;
+		m_count += other.m_count;
+	}
+
+	size_t count() const {
+		return m_count;
+	}
+
+	double mean() const {
+		return m_count == 0 ? NAN : m_mean;
+	}
+
+	// Sums of the 2nd..4th powers of the deviations from the mean
+	double m2() const {
+		return m_m2;
+	}
+
+	double m3() const {
+		return m_m3;
+	}
+
+	double m4() const {
+		return m_m4;
+	}
+
+	// Population variance
+	double variance() const {
+		return m_count == 0 ? NAN : m_m2 / m_count;
+	}
+
+	double skewness() const {
+		static_assert(Order >= 3, "skewness needs 3rd order moments");
+		if (m_count == 0) {
+			return NAN;
+		}
+		return std::sqrt(static_cast<double>(m_count)) * m_m3 / std::pow(m_m2, 1.5);
+	}
+
+	// Excess kurtosis (0 for a normal distribution)
+	double kurtosis() const {
+		static_assert(Order >= 4, "kurtosis needs 4th order moments");
+		if (m_count == 0) {
+			return NAN;
+		}
+		return m_count * m_m4 / (m_m2 * m_m2) - 3;
+	}
+
+	// Count, mean and the central moment sums up to Order
+	void save(std::ostream& out) const {
+		write_value<uint64_t>(out, m_count);
+		write_value<double>(out, m_mean);
+		write_value<double>(out, m_m2);
+		if constexpr (Order >= 3) {
+			write_value<double>(out, m_m3);
+		}
+		if constexpr (Order >= 4) {
+			write_value<double>(out, m_m4);
+		}
+	}
+
+	bool load(std::istream& in) {
+		m_count = read_value<uint64_t>(in);
+		m_mean = read_value<double>(in);
+		m_m2 = read_value<double>(in);
+		if constexpr (Order >= 3) {
+			m_m3 = read_value<double>(in);
+		}
+		if constexpr (Order >= 4) {
+			m_m4 = read_value<double>(in);
+		}
+		return static_cast<bool>(in);
+	}
+
+private:
+	size_t m_count{0};
+	double m_mean{0};
+	double m_m2{0};
+	double m_m3{0};
+	double m_m4{0};
+};
+
+template <typename T>
+class BasicStd : public BasicStatistics<T> {
+public:
+	BasicStd() = default;
+
+    void update(T next) override {
+		m_moments.add(static_cast<double>(next));
+	}
+
+    void update(const T* data, size_t count) override {
+		update(BasicSampleBlock<T>{data, count});
+	}
+
+    void update(const BasicSampleBlock<T>& block) override {
+		m_moments.add(block.summary());
+	}
+
+    void merge(const BasicStatistics<T>& other) override {
+		m_moments.merge(dynamic_cast<const BasicStd&>(other).m_moments);
+	}
+
+    double eval() const override {
+		return std::sqrt(m_moments.variance());
+	}
+
+    const char* name() const override {
+		return "std";
+	};
+
+    void save(std::ostream& out) const override {
+		m_moments.save(out);
+	}
+
+    bool load(std::istream& in) override {
+		return m_moments.load(in);
+	}
+
+private:
+	Moments<2> m_moments;
+};
+
+using Std = BasicStd<double>;
+
+template <typename T>
+class BasicVar : public BasicStatistics<T> {
+public:
+	using BasicStatistics<T>::update;
+
+    void update(T next) override {
+		m_moments.add(static_cast<double>(next));
+	}
+
+    void update(const T* data, size_t count) override {
+		m_moments.add(data, count);
+	}
+
+    void merge(const BasicStatistics<T>& other) override {
+		m_moments.merge(dynamic_cast<const BasicVar&>(other).m_moments);
+	}
+
+    double eval() const override {
+		return m_moments.variance();
+	}
+
+    const char* name() const override {
+		return "var";
+	};
+
+    void save(std::ostream& out) const override {
+		m_moments.save(out);
+	}
+
+    bool load(std::istream& in) override {
+		return m_moments.load(in);
+	}
+
+private:
+	Moments<2> m_moments;
+};
+
+using Var = BasicVar<double>;
+
+template <typename T>
+class BasicSkew : public BasicStatistics<T> {
+public:
+	using BasicStatistics<T>::update;
+
+    void update(T next) override {
+		m_moments.add(static_cast<double>(next));
+	}
+
+    void update(const T* data, size_t count) override {
+		m_moments.add(data, count);
+	}
+
+    void merge(const BasicStatistics<T>& other) override {
+		m_moments.merge(dynamic_cast<const BasicSkew&>(other).m_moments);
+	}
+
+    double eval() const override {
+		return m_moments.skewness();
+	}
+
+    const char* name() const override {
+		return "skew";
+	};
+
+    void save(std::ostream& out) const override {
+		m_moments.save(out);
+	}
+
+    bool load(std::istream& in) override {
+		return m_moments.load(in);
+	}
+
+private:
+	Moments<3> m_moments;
+};
+
+using Skew = BasicSkew<double>;
+
+template <typename T>
+class BasicKurt : public BasicStatistics<T> {
+public:
+	using BasicStatistics<T>::update;
+
+    void update(T next) override {
+		m_moments.add(static_cast<double>(next));
+	}
+
+    void update(const T* data, size_t count) override {
+		m_moments.add(data, count);
+	}
+
+    void merge(const BasicStatistics<T>& other) override {
+		m_moments.merge(dynamic_cast<const BasicKurt&>(other).m_moments);
+	}
+
+    double eval() const override {
+		return m_moments.kurtosis();
+	}
+
+    const char* name() const override {
+		return "kurt";
+	};
+
+    void save(std::ostream& out) const override {
+		m_moments.save(out);
+	}
+
+    bool load(std::istream& in) override {
+		return m_moments.load(in);
+	}
+
+private:
+	Moments<4> m_moments;
+};
+
+using Kurt = BasicKurt<double>;
+
+// Sample storage behind Pct: answers percentile queries over everything added.
+// One store may back any number of Pct objects (see PctGroup).
+template <typename T>
+class BasicQuantileStore {
+public:
+	virtual ~BasicQuantileStore() {}
+
+	virtual void add(T next) = 0;
+	virtual void add(const T* data, size_t count) = 0;
+	// Throws std::bad_cast unless `other` is the same kind of store
+	virtual void merge(const BasicQuantileStore& other) = 0;
+	virtual double quantile(float percent) const = 0;
+	// Announces a percentile that will be queried, so stores can answer all of
+	// them in one pass
+	virtual void expect(float /*percent*/) {
+	}
+	virtual bool stores_samples() const {
+		return false;
+	}
+	// Changes whenever the samples behind the store change, so a quantile
+	// computed at one version still holds until the next (see BasicPct::eval).
+	// 0: the answer may change without new samples (e.g. windows that move
+	// with time), nothing may be cached.
+	virtual uint64_t version() const {
+		return 0;
+	}
+	// Snapshot of the store, like IStatistics::save()/load()
+	virtual void save(std::ostream& /*out*/) const {
+		throw std::logic_error("this percentile store has no snapshot format");
+	}
+	virtual bool load(std::istream& /*in*/) {
+		throw std::logic_error("this percentile store has no snapshot format");
+	}
+};
+
+using QuantileStore = BasicQuantileStore<double>;
+
+// Radix selection for integer samples: narrows [first, last) to the elements
+// sharing the leading digits of the element of rank `pos`, one byte at a
+// time, moving smaller and larger ones out of the way. The work doesn't
+// depend on the value distribution, and [first, last) ends up partitioned
+// around `pos` exactly like after std::nth_element.
+template <typename Iterator>
+void radix_select(Iterator first, Iterator pos, Iterator last) {
+	using T = typename std::iterator_traits<Iterator>::value_type;
+	using Key = std::make_unsigned_t<T>;
+	static_assert(std::is_integral<T>::value, "radix selection needs integer samples");
+	// Flipping the sign bit orders signed values like their unsigned keys
+	constexpr Key flip = std::is_signed<T>::value ? Key{1} << (sizeof(T) * 8 - 1) : 0;
+	for (int shift = sizeof(T) * 8 - 8; shift >= 0 && last - first > 1; shift -= 8) {
+		if (last - first <= 64) {
+			std::nth_element(first, pos, last);
+			return;
+		}
+		auto digit = [&](T value) { return ((static_cast<Key>(value) ^ flip) >> shift) & 0xff; };
+		size_t counts[256] = {};
+		for (Iterator it = first; it != last; ++it) {
+			++counts[digit(*it)];
+		}
+		size_t rank = pos - first, bucket = 0;
+		while (rank >= counts[bucket]) {
+			rank -= counts[bucket++];
+		}
+		if (counts[bucket] == static_cast<size_t>(last - first)) {
+			continue; // all share this digit, nothing to split off
+		}
+		Iterator lower = std::partition(first, last, [&](T value) { return digit(value) < bucket; });
+		Iterator upper = std::partition(lower, last, [&](T value) { return digit(value) == bucket; });
+		first = lower;
+		last = upper;
+	}
+}
+
+// Keeps every sample: exact, but O(n) memory. Ingestion is a plain O(1)
+// append to pooled blocks that never move (see ChunkedSamples); the work happens when a percentile is read, by selection
+// (std::nth_element) rather than a full sort. Every selected rank stays a
+// partition point, so later ranks only partition the range between their
+// neighbours: all expected percentiles are found in one narrowing cascade.
+// Integer samples are selected by radix_select instead of nth_element.
+//
+// Selection starts over whenever samples were added, which is the cheapest
+// for a single report but O(n) per report when results are read again and
+// again while samples keep coming (--emit-every). The second time that
+// happens the store switches to incremental mode: the samples are sorted
+// once and then kept as a sorted main run, a sorted delta run and a tail of
+// new samples. A query sorts the tail, merges it into the delta, and finds
+// the rank across both runs by binary search. The delta is only merged into
+// the main run once it exceeds 1/delta_ratio of it, so a report costs time
+// in the order of the samples added since the last merge, not O(n).
+template <typename T>
+class BasicExactStore : public BasicQuantileStore<T> {
+public:
+	static constexpr size_t delta_ratio = 16;
+
+	void add(T next) override {
+		values.push_back(next);
+		m_pivots.clear();
+		++m_version;
+	}
+
+	void add(const T* data, size_t count) override {
+		values.append(data, count);
+		if (count != 0) {
+			m_pivots.clear();
+			++m_version;
+		}
+	}
+
+	void merge(const BasicQuantileStore<T>& other) override {
+		const auto& exact = dynamic_cast<const BasicExactStore&>(other);
+		exact.drop_nan();
+		exact.values.for_each_block([&](const T* data, size_t count) { add(data, count); });
+	}
+
+	void expect(float percent) override {
+		m_expected.push_back(percent);
+		std::sort(m_expected.begin(), m_expected.end());
+	}
+
+	bool stores_samples() const override {
+		return true;
+	}
+
+	uint64_t version() const override {
+		return m_version;
+	}
+
+	// The samples themselves: O(n), like the store
+	void save(std::ostream& out) const override {
+		drop_nan();
+		write_tag(out, "EXCT");
+		write_value<uint64_t>(out, values.size());
+		for (T value : values) {
+			write_value<T>(out, value);
+		}
+	}
+
+	bool load(std::istream& in) override {
+		if (!expect_tag(in, "EXCT")) {
+			return false;
+		}
+		uint64_t size = read_value<uint64_t>(in);
+		values.clear();
+		for (uint64_t i = 0; in && i < size; ++i) {
+			values.push_back(read_value<T>(in));
+		}
+		m_pivots.clear();
+		m_checked = 0;
+		m_selected = false;
+		m_incremental = false;
+		m_sorted = 0;
+		m_delta = 0;
+		++m_version;
+		return static_cast<bool>(in);
+	}
+
+	double quantile(float percent) const override {
+		drop_nan();
+		if (values.empty()) {
+			return NAN;
+		}
+		if (!m_incremental && m_pivots.empty()) {
+			// Selected before, and samples came in since: keep them sorted from now on
+			m_incremental = m_selected;
+			m_selected = true;
+		}
+		if (m_incremental) {
+			absorb();
+			return sorted_rank(rank(percent));
+		}
+		if (m_pivots.empty()) {
+			// Select the expected ranks in ascending order, each on a shrinking range
+			for (float expected : m_expected) {
+				select(rank(expected));
+			}
+		}
+		return select(rank(percent));
+	}
+
+private:
+	size_t rank(float percent) const {
+		size_t size = values.size();
+		size_t pos = floor(size * percent / 100.0);
+		if (pos >= size) {
+			pos = size - 1;
+		}
+		return pos;
+	}
+
+	// Puts the element of rank `pos` in place, partitioning only the range
+	// between the closest ranks already selected
+	double select(size_t pos) const {
+		auto next = std::lower_bound(m_pivots.begin(), m_pivots.end(), pos);
+		if (next != m_pivots.end() && *next == pos) {
+			return values[pos];
+		}
+		size_t first = next == m_pivots.begin() ? 0 : *(next - 1) + 1;
+		size_t last = next == m_pivots.end() ? values.size() : *next;
+		if constexpr (std::is_integral<T>::value) {
+			radix_select(values.begin() + first, values.begin() + pos, values.begin() + last);
+		} else {
+			std::nth_element(values.begin() + first, values.begin() + pos, values.begin() + last);
+		}
+		m_pivots.insert(next, pos);
+		return values[pos];
+	}
+
+	// Sorts the new samples into the delta run, and the delta into the main
+	// run once it has grown past 1/delta_ratio of it. The merges borrow one
+	// pool block as their buffer, so they don't need memory for another copy
+	// of the samples.
+	void absorb() const {
+		const size_t tail = m_sorted + m_delta;
+		if (tail == values.size() && m_delta * delta_ratio <= m_sorted) {
+			return;
+		}
+		BlockPool& pool = BlockPool::shared();
+		T* buffer = static_cast<T*>(pool.acquire());
+		const size_t buffer_size = BlockPool::block_bytes / sizeof(T);
+		if (tail != values.size()) {
+			pdq_sort(values.begin() + tail, values.end());
+			buffered_inplace_merge(values.begin() + m_sorted, values.begin() + tail, values.end(), buffer, buffer_size);
+			m_delta = values.size() - m_sorted;
+		}
+		if (m_delta * delta_ratio > m_sorted) {
+			buffered_inplace_merge(values.begin(), values.begin() + m_sorted, values.end(), buffer, buffer_size);
+			m_sorted = values.size();
+			m_delta = 0;
+		}
+		pool.release(buffer);
+	}
+
+	// Element of rank `pos` of the main and delta runs together: the split
+	// of the pos + 1 smallest between the runs is found by binary search
+	double sorted_rank(size_t pos) const {
+		const size_t main = m_sorted;
+		const size_t delta = m_delta;
+		auto in_main = [&](size_t i) { return values[i]; };
+		auto in_delta = [&](size_t j) { return values[main + j]; };
+		const size_t take = pos + 1;
+		size_t low = take > delta ? take - delta : 0;
+		size_t high = std::min(take, main);
+		while (low < high) {
+			size_t i = low + (high - low) / 2;
+			size_t j = take - i;
+			if (j > 0 && in_delta(j - 1) > in_main(i)) {
+				low = i + 1; // the main run has more of the smallest
+			} else {
+				high = i;
+			}
+		}
+		const size_t i = low;
+		const size_t j = take - i;
+		if (i == 0) {
+			return in_delta(j - 1);
+		}
+		if (j == 0) {
+			return in_main(i - 1);
+		}
+		return std::max(in_main(i - 1), in_delta(j - 1));
+	}
+
+	// NaN has no rank; drop it before selecting (iostream input never has it)
+	void drop_nan() const {
+		if (!std::is_floating_point<T>::value || m_checked == values.size()) {
+			return;
+		}
+		auto end = std::remove_if(values.begin() + m_checked, values.end(),
+			[](T value) { return std::isnan(static_cast<double>(value)); });
+		values.truncate(end - values.begin());
+		m_checked = values.size();
+	}
+
+	mutable BasicChunkedSamples<T> values;
+	mutable std::vector<size_t> m_pivots; // ranks already in their sorted position, ascending
+	mutable size_t m_checked{0};
+	mutable bool m_selected{false};    // queried by selection before
+	mutable bool m_incremental{false}; // values are kept as main and delta runs
+	mutable size_t m_sorted{0};        // size of the sorted main run at the front
+	mutable size_t m_delta{0};         // size of the sorted delta run behind it
+	uint64_t m_version{1};
+	std::vector<float> m_expected;
+};
+
+using ExactStore = BasicExactStore<double>;
+
+// Bounded-memory estimate backed by a t-digest
+template <typename T>
+class BasicSketchStore : public BasicQuantileStore<T> {
+public:
+	explicit BasicSketchStore(double compression) : m_digest{compression} {
+	}
+
+	void add(T next) override {
+		m_digest.add(static_cast<double>(next));
+		++m_version;
+	}
+
+	void add(const T* data, size_t count) override {
+		if constexpr (std::is_same<T, double>::value) {
+			m_digest.add(data, count);
+		} else {
+			for (size_t i = 0; i < count; ++i) {
+				m_digest.add(static_cast<double>(data[i]));
+			}
+		}
+		m_version += count != 0;
+	}
+
+	void merge(const BasicQuantileStore<T>& other) override {
+		m_digest.merge(dynamic_cast<const BasicSketchStore&>(other).m_digest);
+		++m_version;
+	}
+
+	double quantile(float percent) const override {
+		return m_digest.quantile(percent);
+	}
+
+	uint64_t version() const override {
+		return m_version;
+	}
+
+	void save(std::ostream& out) const override {
+		m_digest.save(out);
+	}
+
+	bool load(std::istream& in) override {
+		++m_version;
+		return m_digest.load(in);
+	}
+
+private:
+	TDigest m_digest;
+	uint64_t m_version{1};
+};
+
+using SketchStore = BasicSketchStore<double>;
+
+// Log-bucketed histogram: fixed memory, O(1) updates and a bounded relative
+// error instead of TDigest's rank error; can be saved and merged offline.
+template <typename T>
+class BasicHistogramStore : public BasicQuantileStore<T> {
+public:
+	BasicHistogramStore() = default;
+
+	explicit BasicHistogramStore(LogHistogram histogram) : m_histogram{std::move(histogram)} {
+	}
+
+	void add(T next) override {
+		m_histogram.add(static_cast<double>(next));
+		++m_version;
+	}
+
+	void add(const T* data, size_t count) override {
+		if constexpr (std::is_same<T, double>::value) {
+			m_histogram.add(data, count);
+		} else {
+			for (size_t i = 0; i < count; ++i) {
+				m_histogram.add(static_cast<double>(data[i]));
+			}
+		}
+		m_version += count != 0;
+	}
+
+	void merge(const BasicQuantileStore<T>& other) override {
+		m_histogram.merge(dynamic_cast<const BasicHistogramStore&>(other).m_histogram);
+		++m_version;
+	}
+
+	double quantile(float percent) const override {
+		return m_histogram.quantile(percent);
+	}
+
+	uint64_t version() const override {
+		return m_version;
+	}
+
+	void save(std::ostream& out) const override {
+		m_histogram.save(out);
+	}
+
+	bool load(std::istream& in) override {
+		++m_version;
+		return m_histogram.load(in);
+	}
+
+	const LogHistogram& histogram() const {
+		return m_histogram;
+	}
+
+private:
+	LogHistogram m_histogram;
+	uint64_t m_version{1};
+};
+
+using HistogramStore = BasicHistogramStore<double>;
+
+enum class PctMode {
+	Sketch,   // bounded memory, approximate (default)
+	Exact,    // stores all samples, for small inputs
+	Histogram // fixed memory, bounded relative error, mergeable offline
+};
+
+template <typename T>
+class BasicPct : public BasicStatistics<T> {
+public:
+	using BasicStatistics<T>::update;
+	using Mode = PctMode;
+	using Store = BasicQuantileStore<T>;
+
+	static std::shared_ptr<Store> make_store(Mode mode,
+			double compression = TDigest::default_compression) {
+		if (mode == Mode::Exact) {
+			return std::make_shared<BasicExactStore<T>>();
+		}
+		if (mode == Mode::Histogram) {
+			return std::make_shared<BasicHistogramStore<T>>();
+		}
+		return std::make_shared<BasicSketchStore<T>>(compression);
+	}
+
+	BasicPct() = delete;
+	BasicPct(float percent, Mode mode = Mode::Sketch, double compression = TDigest::default_compression)
+		: BasicPct(percent, make_store(mode, compression), true) {
+	}
+
+	// Reports `percent` from a store that may be shared with other Pct objects.
+	// Only the one with `feeds_store` set forwards its updates to the store.
+	BasicPct(float percent, std::shared_ptr<Store> store, bool feeds_store, std::string name = {})
+		: store_{std::move(store)}, feeds_store_{feeds_store} {
+		if (percent < 0) {
+			percent_ = 0;
+		} else if ( percent > 100 ) {
+			percent_ = 100;
+		} else percent_ = percent;
+		if (name.empty()) {
+			name_ = "pct(" + std::to_string(percent_) + ")";
+		} else {
+			name_ = std::move(name);
+		}
+		store_->expect(percent_);
+	};
+
+    void update(T next) override {
+		if (feeds_store_) {
+			store_->add(next);
+		}
+	}
+
+    void update(const T* data, size_t count) override {
+		if (feeds_store_) {
+			store_->add(data, count);
+		}
+	}
+
+    // Only the feeding Pct of a group merges, the store is shared by the others
+    void merge(const BasicStatistics<T>& other) override {
+		if (feeds_store_) {
+			store_->merge(*dynamic_cast<const BasicPct&>(other).store_);
+		}
+	}
+
+    // Cached until the store has changed: reports between updates are free
+    double eval() const override {
+		uint64_t version = store_->version();
+		if (version == 0 || version != cached_version_) {
+			cached_ = store_->quantile(percent_);
+			cached_version_ = version;
+		}
+		return cached_;
+	}
+
+    const char* name() const override {
+
+		return name_.c_str();
+	};
+
+    bool stores_samples() const override {
+		return store_->stores_samples();
+	}
+
+    // The shared store is saved once, by the feeding Pct of the group
+    void save(std::ostream& out) const override {
+		if (feeds_store_) {
+			store_->save(out);
+		}
+	}
+
+    bool load(std::istream& in) override {
+		return !feeds_store_ || store_->load(in);
+	}
+
+	const Store& store() const {
+		return *store_;
+	}
+
+	float percent() const {
+		return percent_;
+	}
+
+private:
+	std::shared_ptr<Store> store_;
+	bool feeds_store_;
+	float percent_;
+	std::string name_;
+	mutable double cached_{0};
+	mutable uint64_t cached_version_{0};
+};
+
+using Pct = BasicPct<double>;
+
+class Pct90 : public Pct {
+public:
+	explicit Pct90(Mode mode = Mode::Sketch) : Pct(90, mode) {
+	};
+
+	// Reports from a store shared with other percentiles, see SharedPct
+	Pct90(std::shared_ptr<Store> store, bool feeds_store) : Pct(90, std::move(store), feeds_store) {
+	}
+
+    const char* name() const override {
+		return "pct90";
+	};
+};
+
+class Pct95 : public Pct {
+public:
+	explicit Pct95(Mode mode = Mode::Sketch) : Pct(95, mode) {
+	};
+
+	// Reports from a store shared with other percentiles, see SharedPct
+	Pct95(std::shared_ptr<Store> store, bool feeds_store) : Pct(95, std::move(store), feeds_store) {
+	}
+
+    const char* name() const override {
+		return "pct95";
+	};
+};
+
+// Any number of percentiles answered from a single sample store (or sketch),
+// so samples are ingested once instead of once per requested percentile.
+template <typename T>
+class BasicPctGroup {
+public:
+	explicit BasicPctGroup(PctMode mode = PctMode::Sketch,
+			double compression = TDigest::default_compression)
+		: m_store{BasicPct<T>::make_store(mode, compression)} {
+	}
+
+	explicit BasicPctGroup(std::shared_ptr<BasicQuantileStore<T>> store) : m_store{std::move(store)} {
+	}
+
+	// The first Pct created by the group feeds the shared store, so every
+	// Pct of the group must receive the same updates.
+	std::unique_ptr<BasicPct<T>> add(float percent, std::string name = {}) {
+		bool feeds_store = !m_has_feeder;
+		m_has_feeder = true;
+		return std::make_unique<BasicPct<T>>(percent, m_store, feeds_store, std::move(name));
+	}
+
+private:
+	std::shared_ptr<BasicQuantileStore<T>> m_store;
+	bool m_has_feeder{false};
+};
+
+using PctGroup = BasicPctGroup<double>;
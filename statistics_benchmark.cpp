@@ -0,0 +1,425 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>        // open
+#include <spawn.h>        // posix_spawn
+#include <sys/resource.h> // getrusage
+#include <sys/wait.h>     // wait4
+#include <unistd.h>
+
+#include "benchmark.h"
+#include "counting_new.h" // allocations per benchmark, next to the blocks taken from the BlockPool
+#include "distributions.h"
+#include "sample_arena.h"
+#include "sample_output.h"
+#include "statistics.h"
+#include "statistics_set.h"
+
+extern char** environ;
+
+// Resets the peak resident set size of the process (Linux 4.0+), so the
+// peak of one benchmark can be read on its own; false if not supported
+bool reset_peak_rss() {
+	int fd = ::open("/proc/self/clear_refs", O_WRONLY);
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = ::write(fd, "5", 1) == 1;
+	::close(fd);
+	return ok;
+}
+
+// A "Vm...:" entry of /proc/self/status in bytes, 0 if missing
+size_t memory_status(const char* key) {
+	std::ifstream status{"/proc/self/status"};
+	std::string line;
+	size_t length = std::strlen(key);
+	while (std::getline(status, line)) {
+		if (line.compare(0, length, key) == 0) {
+			return std::strtoull(line.c_str() + length, nullptr, 10) * 1024;
+		}
+	}
+	return 0;
+}
+
+// Peak resident set size in bytes since the last reset_peak_rss()
+size_t peak_rss() {
+	if (size_t peak = memory_status("VmHWM:")) {
+		return peak;
+	}
+	rusage usage{};
+	::getrusage(RUSAGE_SELF, &usage);
+	return static_cast<size_t>(usage.ru_maxrss) * 1024;
+}
+
+struct ThroughputResult {
+	std::string name;
+	uint64_t samples{0}; // per run
+	uint64_t runs{0};
+	double seconds{0};   // per run
+	size_t peak_rss{0};  // bytes
+	size_t rss_growth{0}; // peak_rss above the resident size before the runs
+	bool counts_allocations{false};
+	uint64_t allocations{0};     // per run
+	uint64_t allocated_bytes{0}; // per run, operator new and BlockPool blocks
+
+	double samples_per_second() const {
+		return seconds > 0 ? static_cast<double>(samples) / seconds : 0;
+	}
+
+	double ns_per_sample() const {
+		return samples ? seconds * 1e9 / static_cast<double>(samples) : 0;
+	}
+};
+
+// Input of the in-process benchmarks: a fixed pool of log-normal samples
+// (latency-like, in microseconds), fed over and over to reach any input size
+// without generating it in the timed region or holding it in memory
+class SamplePool {
+public:
+	static constexpr size_t pool_size = size_t{1} << 20;
+	static constexpr size_t block_size = 4096;
+
+	explicit SamplePool(uint64_t seed) : m_values(pool_size) {
+		Xoshiro256 engine{seed};
+		generate_samples({SampleDistribution::Kind::LogNormal, 4, 1}, engine, m_values.data(), pool_size);
+	}
+
+	// Calls f(data, count) with blocks adding up to `samples` samples
+	template <typename F>
+	void feed(uint64_t samples, F&& f) const {
+		size_t offset = 0;
+		for (uint64_t done = 0; done < samples;) {
+			size_t n = static_cast<size_t>(std::min<uint64_t>(block_size, samples - done));
+			n = std::min(n, pool_size - offset);
+			f(m_values.data() + offset, n);
+			done += n;
+			offset = (offset + n) % pool_size;
+		}
+	}
+
+private:
+	std::vector<double> m_values;
+};
+
+// Runs `body()` `runs` times and reports per-run time, allocations and the
+// peak RSS reached
+template <typename Body>
+ThroughputResult measure(std::string name, uint64_t samples, uint64_t runs, Body&& body) {
+	using clock = std::chrono::steady_clock;
+	ThroughputResult result;
+	result.name = std::move(name);
+	result.samples = samples;
+	result.runs = runs;
+	result.counts_allocations = true;
+	reset_peak_rss();
+	size_t rss_before = memory_status("VmRSS:");
+	uint64_t allocations = allocation_count.load();
+	uint64_t bytes = allocated_bytes.load() + BlockPool::shared().acquired_bytes();
+	auto start = clock::now();
+	for (uint64_t run = 0; run < runs; ++run) {
+		body();
+	}
+	auto end = clock::now();
+	result.seconds = std::chrono::duration<double>(end - start).count() / runs;
+	result.allocations = (allocation_count.load() - allocations) / runs;
+	result.allocated_bytes = (allocated_bytes.load() + BlockPool::shared().acquired_bytes() - bytes) / runs;
+	result.peak_rss = peak_rss();
+	result.rss_growth = result.peak_rss > rss_before ? result.peak_rss - rss_before : 0;
+	return result;
+}
+
+// Enough runs of small inputs for a stable time, one run of large ones
+uint64_t runs_for(uint64_t samples) {
+	return std::max<uint64_t>(1, 1000000 / samples);
+}
+
+struct StatisticCase {
+	const char* name;
+	std::function<std::unique_ptr<IStatistics>()> make;
+};
+
+std::vector<StatisticCase> statistic_cases() {
+	return {
+		{"Min", [] { return std::make_unique<Min>(); }},
+		{"Max", [] { return std::make_unique<Max>(); }},
+		{"Mean", [] { return std::make_unique<Mean>(); }},
+		{"Std", [] { return std::make_unique<Std>(); }},
+		{"Var", [] { return std::make_unique<Var>(); }},
+		{"Skew", [] { return std::make_unique<Skew>(); }},
+		{"Kurt", [] { return std::make_unique<Kurt>(); }},
+		{"Pct90(sketch)", [] { return std::make_unique<Pct>(90, Pct::Mode::Sketch); }},
+		{"Pct90(histogram)", [] { return std::make_unique<Pct>(90, Pct::Mode::Histogram); }},
+		{"Pct90(exact)", [] { return std::make_unique<Pct>(90, Pct::Mode::Exact); }},
+	};
+}
+
+using DefaultSet = StatisticsSet<Min, Max, Mean, Std, SharedPct<Pct90, Pct95, StaticPct<50>>>;
+
+DynamicStatisticsSet make_default_dynamic_set(PctGroup& percentiles) {
+	DynamicStatisticsSet set;
+	set.add(std::make_unique<Min>());
+	set.add(std::make_unique<Max>());
+	set.add(std::make_unique<Mean>());
+	set.add(std::make_unique<Std>());
+	set.add(percentiles.add(90));
+	set.add(percentiles.add(95));
+	set.add(percentiles.add(50));
+	return set;
+}
+
+// Update and eval of a single statistic, through the batch API
+void run_statistic_suite(const SamplePool& pool, uint64_t samples, const std::string& filter,
+		std::vector<ThroughputResult>& results) {
+	for (const StatisticCase& statistic : statistic_cases()) {
+		std::string name = std::string{statistic.name} + "/" + std::to_string(samples);
+		if (name.find(filter) == std::string::npos) {
+			continue;
+		}
+		results.push_back(measure(name, samples, runs_for(samples), [&] {
+			std::unique_ptr<IStatistics> accumulator = statistic.make();
+			pool.feed(samples, [&](const double* data, size_t n) { accumulator->update(data, n); });
+			double value = accumulator->eval();
+			do_not_optimize(value);
+		}));
+	}
+}
+
+// The default report of `statistics`, with the compile-time and the
+// runtime-configured set
+void run_set_suite(const SamplePool& pool, uint64_t samples, const std::string& filter,
+		std::vector<ThroughputResult>& results) {
+	auto evaluate = [](const auto& set) {
+		set.for_each([](const auto& statistic) {
+			double value = statistic.eval();
+			do_not_optimize(value);
+		});
+	};
+	std::string name = "StatisticsSet<default>/" + std::to_string(samples);
+	if (name.find(filter) != std::string::npos) {
+		results.push_back(measure(name, samples, runs_for(samples), [&] {
+			DefaultSet set;
+			pool.feed(samples, [&](const double* data, size_t n) { set.update(data, n); });
+			evaluate(set);
+		}));
+	}
+	name = "DynamicStatisticsSet<default>/" + std::to_string(samples);
+	if (name.find(filter) != std::string::npos) {
+		results.push_back(measure(name, samples, runs_for(samples), [&] {
+			PctGroup percentiles;
+			DynamicStatisticsSet set = make_default_dynamic_set(percentiles);
+			pool.feed(samples, [&](const double* data, size_t n) { set.update(data, n); });
+			evaluate(set);
+		}));
+	}
+}
+
+// Writes `samples` samples from the pool to a temporary file
+bool write_input(const SamplePool& pool, uint64_t samples, InputFormat format, std::string& path) {
+	char name[] = "/tmp/statistics_benchmark_XXXXXX";
+	int fd = ::mkstemp(name);
+	if (fd < 0) {
+		std::cerr << "Can't create an input file: " << std::strerror(errno) << "\n";
+		return false;
+	}
+	path = name;
+	SampleWriter writer{fd, format};
+	pool.feed(samples, [&](const double* data, size_t n) { writer.write(data, n); });
+	bool ok = writer.flush();
+	::close(fd);
+	if (!ok) {
+		std::cerr << "Can't write " << path << ": " << writer.error() << "\n";
+	}
+	return ok;
+}
+
+// Runs the statistics executable on a file and measures it from the
+// outside: wall time and the child's peak RSS (its allocations aren't seen)
+bool run_executable(const std::string& executable, std::vector<std::string> arguments,
+		ThroughputResult& result) {
+	using clock = std::chrono::steady_clock;
+	std::vector<char*> argv{const_cast<char*>(executable.c_str())};
+	for (std::string& argument : arguments) {
+		argv.push_back(&argument[0]);
+	}
+	argv.push_back(nullptr);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	auto start = clock::now();
+	pid_t pid;
+	int error = posix_spawn(&pid, executable.c_str(), &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (error != 0) {
+		std::cerr << "Can't run " << executable << ": " << std::strerror(error) << "\n";
+		return false;
+	}
+	int status = 0;
+	rusage usage{};
+	if (::wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << executable << " failed\n";
+		return false;
+	}
+	auto end = clock::now();
+	result.seconds = std::chrono::duration<double>(end - start).count();
+	result.peak_rss = static_cast<size_t>(usage.ru_maxrss) * 1024;
+	return true;
+}
+
+// The whole statistics program, parsing included, on text and binary input
+bool run_end_to_end_suite(const SamplePool& pool, uint64_t samples, const std::string& executable,
+		const std::string& filter, std::vector<ThroughputResult>& results) {
+	const std::pair<const char*, InputFormat> formats[] = {{"text", InputFormat::Text}, {"f64", InputFormat::F64}};
+	for (const auto& format : formats) {
+		std::string name = std::string{"statistics --format "} + format.first + "/" + std::to_string(samples);
+		if (name.find(filter) == std::string::npos) {
+			continue;
+		}
+		std::string path;
+		if (!write_input(pool, samples, format.second, path)) {
+			return false;
+		}
+		ThroughputResult result;
+		result.name = name;
+		result.samples = samples;
+		result.runs = 1;
+		bool ok = run_executable(executable, {"--format", format.first, path}, result);
+		::unlink(path.c_str());
+		if (!ok) {
+			return false;
+		}
+		results.push_back(result);
+	}
+	return true;
+}
+
+void print_result(std::ostream& out, const ThroughputResult& result) {
+	char line[256];
+	std::snprintf(line, sizeof(line), "%-40s %10.3g samples/s %8.3g ns/sample  peak RSS %8.3g MiB",
+		result.name.c_str(), result.samples_per_second(), result.ns_per_sample(),
+		static_cast<double>(result.peak_rss) / (1 << 20));
+	out << line;
+	if (result.counts_allocations) {
+		std::snprintf(line, sizeof(line), " (+%.3g)", static_cast<double>(result.rss_growth) / (1 << 20));
+		out << line;
+		std::snprintf(line, sizeof(line), "  allocated %8.3g MiB in %llu allocations",
+			static_cast<double>(result.allocated_bytes) / (1 << 20),
+			static_cast<unsigned long long>(result.allocations));
+		out << line;
+	}
+	out << "\n";
+}
+
+void write_json(std::ostream& out, const std::vector<ThroughputResult>& results) {
+	std::streamsize precision = out.precision(10);
+	out << "{\n  \"benchmarks\": [";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const ThroughputResult& result = results[i];
+		out << (i == 0 ? "\n" : ",\n")
+			<< "    {\"name\": \"" << json_escape(result.name) << "\""
+			<< ", \"samples\": " << result.samples
+			<< ", \"runs\": " << result.runs
+			<< ", \"seconds\": " << result.seconds
+			<< ", \"samples_per_second\": " << result.samples_per_second()
+			<< ", \"ns_per_sample\": " << result.ns_per_sample()
+			<< ", \"peak_rss_bytes\": " << result.peak_rss;
+		if (result.counts_allocations) {
+			out << ", \"rss_growth_bytes\": " << result.rss_growth
+				<< ", \"allocations\": " << result.allocations
+				<< ", \"allocated_bytes\": " << result.allocated_bytes;
+		}
+		out << "}";
+	}
+	out << "\n  ]\n}\n";
+	out.precision(precision);
+}
+
+// Usage: statistics_benchmark [--sizes N,...] [--filter TEXT] [--statistics PATH]
+//                             [--no-end-to-end] [--seed N] [--json FILE]
+// Measures every statistic (update through the batch API, then eval), the
+// default compile-time and runtime statistics sets, and the statistics
+// program itself on text and f64 files, for each input size (default
+// 1e3..1e7 in powers of ten; 1e8 and 1e9 are accepted, but exact
+// percentiles then need 8 bytes per sample and the end-to-end text input
+// ~20 bytes per sample of /tmp). Reports samples/s, ns/sample, peak RSS and,
+// in process, how far the peak grew above the RSS before the benchmark
+// (blocks pooled by earlier benchmarks stay resident) and the bytes and
+// number of allocations (operator new plus BlockPool blocks) per run. --filter keeps benchmarks whose name contains
+// TEXT; --json writes the results as JSON to FILE ("-": stdout instead of
+// the text report) for regression gates.
+int main(int argc, char* argv[]) {
+	std::vector<uint64_t> sizes{1000, 10000, 100000, 1000000, 10000000};
+	std::string filter;
+	std::string executable = STATISTICS_EXECUTABLE;
+	bool end_to_end = true;
+	uint64_t seed = 0;
+	const char* json_path = nullptr;
+	for (int i = 1; i < argc; ++i) {
+		bool has_value = i + 1 < argc;
+		if (std::strcmp(argv[i], "--sizes") == 0 && has_value) {
+			sizes.clear();
+			for (const char* text = argv[++i]; *text != '\0';) {
+				char* end = nullptr;
+				double size = std::strtod(text, &end); // accepts 1e9
+				if (end == text || size < 1 || (*end != ',' && *end != '\0')) {
+					std::cerr << "Invalid sizes: " << argv[i] << "\n";
+					return 1;
+				}
+				sizes.push_back(static_cast<uint64_t>(size));
+				text = *end == ',' ? end + 1 : end;
+			}
+		} else if (std::strcmp(argv[i], "--filter") == 0 && has_value) {
+			filter = argv[++i];
+		} else if (std::strcmp(argv[i], "--statistics") == 0 && has_value) {
+			executable = argv[++i];
+		} else if (std::strcmp(argv[i], "--no-end-to-end") == 0) {
+			end_to_end = false;
+		} else if (std::strcmp(argv[i], "--seed") == 0 && has_value) {
+			seed = std::strtoull(argv[++i], nullptr, 0);
+		} else if (std::strcmp(argv[i], "--json") == 0 && has_value) {
+			json_path = argv[++i];
+		} else {
+			std::cerr << "Unknown option: " << argv[i] << "\n";
+			return 1;
+		}
+	}
+
+	bool json_to_stdout = json_path != nullptr && std::strcmp(json_path, "-") == 0;
+	SamplePool pool{seed};
+	std::vector<ThroughputResult> results;
+	for (uint64_t samples : sizes) {
+		size_t first = results.size();
+		run_statistic_suite(pool, samples, filter, results);
+		run_set_suite(pool, samples, filter, results);
+		if (end_to_end && !run_end_to_end_suite(pool, samples, executable, filter, results)) {
+			return 1;
+		}
+		for (size_t r = first; r < results.size() && !json_to_stdout; ++r) {
+			print_result(std::cout, results[r]);
+		}
+	}
+
+	if (json_to_stdout) {
+		write_json(std::cout, results);
+	} else if (json_path != nullptr) {
+		std::ofstream out{json_path};
+		write_json(out, results);
+		if (!out) {
+			std::cerr << "Failed to write " << json_path << "\n";
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "kernels.h"
+#include "profile.h"
+#include "statistics.h"
+
+// Percentile fixed at compile time, for use in a StatisticsSet
+template <unsigned Percent>
+class StaticPct : public Pct {
+	static_assert(Percent <= 100, "a percentile must be within 0..100");
+
+public:
+	explicit StaticPct(Mode mode = Mode::Sketch) : Pct(Percent, mode) {
+	}
+
+	StaticPct(std::shared_ptr<Store> store, bool feeds_store) : Pct(Percent, std::move(store), feeds_store) {
+	}
+};
+
+// Percentiles of a StatisticsSet answered from one shared store, the
+// compile-time counterpart of PctGroup: every sample is ingested once, however
+// many percentiles are reported.
+//
+//     StatisticsSet<Min, Max, SharedPct<Pct90, Pct95, StaticPct<50>>> set;
+//
+// The first percentile feeds, merges, saves and loads the store. The set's
+// for_each() visits each percentile as if it were a member of the set itself.
+template <typename... Percentiles>
+class SharedPct {
+	using First = std::tuple_element_t<0, std::tuple<Percentiles...>>;
+
+public:
+	using sample_type = typename First::sample_type;
+	using Store = BasicQuantileStore<sample_type>;
+
+	explicit SharedPct(PctMode mode = PctMode::Sketch)
+		: SharedPct(BasicPct<sample_type>::make_store(mode), std::index_sequence_for<Percentiles...>{}) {
+	}
+
+	void update(sample_type next) {
+		first().First::update(next);
+	}
+
+	void update(const BasicSampleBlock<sample_type>& block) {
+		first().First::update(block.data(), block.size());
+	}
+
+	void merge(const SharedPct& other) {
+		first().First::merge(other.first());
+	}
+
+	// For the --profile report: the names of all percentiles
+	const char* name() const {
+		return m_name.c_str();
+	}
+
+	template <typename F>
+	void for_each(F&& f) const {
+		std::apply([&](const Percentiles&... percentiles) { (f(percentiles), ...); }, m_percentiles);
+	}
+
+	template <typename F>
+	void for_each(F&& f) {
+		std::apply([&](Percentiles&... percentiles) { (f(percentiles), ...); }, m_percentiles);
+	}
+
+private:
+	template <size_t... I>
+	SharedPct(const std::shared_ptr<Store>& store, std::index_sequence<I...>)
+		: m_percentiles{Percentiles{store, I == 0}...} {
+		for_each([&](const auto& percentile) {
+			m_name += (m_name.empty() ? "" : ",") + std::string{percentile.name()};
+		});
+	}
+
+	First& first() {
+		return std::get<0>(m_percentiles);
+	}
+
+	const First& first() const {
+		return std::get<0>(m_percentiles);
+	}
+
+	std::tuple<Percentiles...> m_percentiles;
+	std::string m_name;
+};
+
+template <typename Statistic>
+struct IsSharedPct : std::false_type {};
+
+template <typename... Percentiles>
+struct IsSharedPct<SharedPct<Percentiles...>> : std::true_type {};
+
+// Statistics known at build time, held by value. Calls are qualified with the
+// concrete type, so nothing goes through the vtable and everything can be
+// inlined: the per-sample update expands to one fused loop body, and the block
+// update shares one SampleBlock (one fused min/max/sum sweep) between all of them.
+//
+//     StatisticsSet<Min, Max, Mean, Std, StaticPct<90>> set;
+//     set.update(data, count);
+//     set.for_each([](const IStatistics& s) { std::cout << s.name() << " = " << s.eval() << "\n"; });
+template <typename... Statistics>
+class StatisticsSet {
+public:
+	using sample_type = typename std::tuple_element_t<0, std::tuple<Statistics...>>::sample_type;
+
+	void update(sample_type next) {
+		update_each(next, std::index_sequence_for<Statistics...>{});
+	}
+
+	void update(const sample_type* data, size_t count) {
+		ProfileScope scope{ProfileStage::Aggregate, count};
+		update_block(BasicSampleBlock<sample_type>{data, count}, std::index_sequence_for<Statistics...>{});
+	}
+
+	void merge(const StatisticsSet& other) {
+		merge_each(other, std::index_sequence_for<Statistics...>{});
+	}
+
+	bool stores_samples() const {
+		bool stores = false;
+		for_each([&](const auto& statistic) { stores = stores || statistic.stores_samples(); });
+		return stores;
+	}
+
+	// Calls f(const BasicStatistics<sample_type>&) for every statistic, in
+	// declaration order, and for every percentile of a SharedPct member
+	template <typename F>
+	void for_each(F&& f) const {
+		std::apply([&](const Statistics&... statistics) { (visit(statistics, f), ...); }, m_statistics);
+	}
+
+	template <typename F>
+	void for_each(F&& f) {
+		std::apply([&](Statistics&... statistics) { (visit(statistics, f), ...); }, m_statistics);
+	}
+
+private:
+	template <typename Statistic, typename F>
+	static void visit(Statistic& statistic, F& f) {
+		if constexpr (IsSharedPct<std::remove_const_t<Statistic>>::value) {
+			statistic.for_each(f);
+		} else {
+			f(statistic);
+		}
+	}
+
+	template <size_t... I>
+	void update_each(sample_type next, std::index_sequence<I...>) {
+		(std::get<I>(m_statistics).Statistics::update(next), ...);
+	}
+
+	template <size_t... I>
+	void update_block(const BasicSampleBlock<sample_type>& block, std::index_sequence<I...>) {
+		(profile_statistic(I, std::get<I>(m_statistics), block.size(),
+			[&] { std::get<I>(m_statistics).Statistics::update(block); }), ...);
+	}
+
+	template <size_t... I>
+	void merge_each(const StatisticsSet& other, std::index_sequence<I...>) {
+		(std::get<I>(m_statistics).Statistics::merge(std::get<I>(other.m_statistics)), ...);
+	}
+
+	std::tuple<Statistics...> m_statistics;
+};
+
+// Type-erased counterpart of StatisticsSet for sets chosen at runtime: the
+// same interface on top of a list of IStatistics objects.
+template <typename T>
+class BasicDynamicStatisticsSet {
+public:
+	using sample_type = T;
+
+	BasicDynamicStatisticsSet() = default;
+
+	explicit BasicDynamicStatisticsSet(std::vector<std::unique_ptr<BasicStatistics<T>>> statistics)
+		: m_statistics{std::move(statistics)} {
+	}
+
+	void add(std::unique_ptr<BasicStatistics<T>> statistic) {
+		m_statistics.push_back(std::move(statistic));
+	}
+
+	void update(T next) {
+		for (auto& statistic : m_statistics) {
+			statistic->update(next);
+		}
+	}
+
+	// One virtual call per statistic and block; the block summary is shared
+	void update(const T* data, size_t count) {
+		ProfileScope scope{ProfileStage::Aggregate, count};
+		BasicSampleBlock<T> block{data, count};
+		for (size_t i = 0; i < m_statistics.size(); ++i) {
+			BasicStatistics<T>& statistic = *m_statistics[i];
+			profile_statistic(i, statistic, count, [&] { statistic.update(block); });
+		}
+	}
+
+	void merge(const BasicDynamicStatisticsSet& other) {
+		for (size_t i = 0; i < m_statistics.size(); ++i) {
+			m_statistics[i]->merge(*other.m_statistics[i]);
+		}
+	}
+
+	template <typename F>
+	void for_each(F&& f) const {
+		for (const auto& statistic : m_statistics) {
+			f(*statistic);
+		}
+	}
+
+	template <typename F>
+	void for_each(F&& f) {
+		for (auto& statistic : m_statistics) {
+			f(*statistic);
+		}
+	}
+
+	size_t size() const {
+		return m_statistics.size();
+	}
+
+	bool stores_samples() const {
+		for (const auto& statistic : m_statistics) {
+			if (statistic->stores_samples()) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	std::vector<std::unique_ptr<BasicStatistics<T>>> m_statistics;
+};
+
+using DynamicStatisticsSet = BasicDynamicStatisticsSet<double>;
+
+// Feeds a set of statistics on another sample type (e.g. integer
+// nanoseconds) from the double samples the input readers produce. Samples
+// that don't fit the type (see is_representable) are counted and skipped.
+template <typename Set>
+class ConvertingSet {
+public:
+	using sample_type = typename Set::sample_type;
+
+	explicit ConvertingSet(Set statistics) : m_statistics{std::move(statistics)} {
+	}
+
+	void update(double next) {
+		if (accept(next)) {
+			m_statistics.update(static_cast<sample_type>(next));
+		}
+	}
+
+	void update(const double* data, size_t count) {
+		size_t kept = 0;
+		{
+			ProfileScope scope{ProfileStage::Convert, count};
+			m_buffer.resize(count);
+			for (size_t i = 0; i < count; ++i) {
+				// An out of range float to integer conversion is undefined, check first
+				if (accept(data[i])) {
+					m_buffer[kept++] = static_cast<sample_type>(data[i]);
+				}
+			}
+		}
+		m_statistics.update(m_buffer.data(), kept);
+	}
+
+	void merge(const ConvertingSet& other) {
+		m_statistics.merge(other.m_statistics);
+		if (m_rejected == 0) {
+			m_first_rejected = other.m_first_rejected;
+		}
+		m_rejected += other.m_rejected;
+	}
+
+	template <typename F>
+	void for_each(F&& f) const {
+		m_statistics.for_each(f);
+	}
+
+	template <typename F>
+	void for_each(F&& f) {
+		m_statistics.for_each(f);
+	}
+
+	bool stores_samples() const {
+		return m_statistics.stores_samples();
+	}
+
+	size_t rejected() const {
+		return m_rejected;
+	}
+
+	double first_rejected() const {
+		return m_first_rejected;
+	}
+
+private:
+	bool accept(double value) {
+		if (is_representable<sample_type>(value)) {
+			return true;
+		}
+		if (m_rejected++ == 0) {
+			m_first_rejected = value;
+		}
+		return false;
+	}
+
+	Set m_statistics;
+	std::vector<sample_type> m_buffer;
+	size_t m_rejected{0};
+	double m_first_rejected{0};
+};
+
+// Snapshot of a whole set: "STAT", format version, sample type, number of
+// statistics, then the name and the state (IStatistics::save) of each one
+template <typename Set>
+void save_state(const Set& set, std::ostream& out) {
+	uint32_t count = 0;
+	set.for_each([&](const auto&) { ++count; });
+	write_tag(out, "STAT");
+	write_value<uint32_t>(out, 1);
+	write_string(out, SampleTraits<typename Set::sample_type>::name);
+	write_value<uint32_t>(out, count);
+	set.for_each([&](const auto& statistic) {
+		write_string(out, statistic.name());
+		statistic.save(out);
+	});
+}
+
+// Loads a snapshot written by save_state() into a set built the same way
+// (same statistics in the same order); `reason` says what didn't match
+template <typename Set>
+bool load_state(Set& set, std::istream& in, std::string& reason) {
+	uint32_t count = 0;
+	set.for_each([&](const auto&) { ++count; });
+	if (!expect_tag(in, "STAT") || read_value<uint32_t>(in) != 1) {
+		reason = "not a statistics snapshot";
+		return false;
+	}
+	if (read_string(in) != SampleTraits<typename Set::sample_type>::name) {
+		reason = "snapshot of another sample type than requested";
+		return false;
+	}
+	if (read_value<uint32_t>(in) != count) {
+		reason = "snapshot holds other statistics than requested";
+		return false;
+	}
+	set.for_each([&](auto& statistic) {
+		if (!reason.empty()) {
+			return;
+		}
+		if (read_string(in) != statistic.name()) {
+			reason = "snapshot holds other statistics than requested";
+		} else if (!statistic.load(in)) {
+			reason = std::string{"malformed state of "} + statistic.name();
+		}
+	});
+	return reason.empty();
+}
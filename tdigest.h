@@ -0,0 +1,305 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <vector>
+
+#include "serialize.h"
+
+// Merging t-digest (Dunning & Ertl): a bounded-memory streaming quantile sketch.
+// Samples are buffered and periodically folded into a sorted list of centroids.
+// The compression parameter trades memory for accuracy: the digest keeps at most
+// about `compression` centroids, and tail quantiles stay the most accurate.
+class TDigest {
+public:
+	static constexpr double default_compression = 200;
+
+	explicit TDigest(double compression = default_compression)
+		: m_compression{compression < 10 ? 10 : compression} {
+		m_buffer_limit = static_cast<size_t>(m_compression * 5);
+		m_buffer.reserve(m_buffer_limit);
+	}
+
+	void add(double value) {
+		if (std::isnan(value)) {
+			return;
+		}
+		m_buffer.push_back(value);
+		if (m_buffer.size() >= m_buffer_limit) {
+			compress();
+		}
+	}
+
+	void add(const double* data, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			if (!std::isnan(data[i])) {
+				m_buffer.push_back(data[i]);
+			}
+			if (m_buffer.size() >= m_buffer_limit) {
+				compress();
+			}
+		}
+	}
+
+	// Adds `value` as if it had been seen `weight` times (weight > 0), e.g.
+	// for samples that have already partly decayed
+	void add(double value, double weight) {
+		if (std::isnan(value) || !(weight > 0)) {
+			return;
+		}
+		m_weighted.push_back({value, weight});
+		m_weighted_total += weight;
+		m_whole &= weight == std::floor(weight);
+		if (m_buffer.size() + m_weighted.size() >= m_buffer_limit) {
+			compress();
+		}
+	}
+
+	void merge(const TDigest& other) {
+		other.compress();
+		compress();
+		if (other.m_count == 0) {
+			return;
+		}
+		m_merged.assign(m_centroids.begin(), m_centroids.end());
+		m_merged.insert(m_merged.end(), other.m_centroids.begin(), other.m_centroids.end());
+		std::sort(m_merged.begin(), m_merged.end());
+		m_count += other.m_count;
+		m_whole &= other.m_whole;
+		m_min = std::min(m_min, other.m_min);
+		m_max = std::max(m_max, other.m_max);
+		rebuild();
+	}
+
+	// Multiplies every weight by `factor` (0 < factor <= 1): older samples then
+	// count less than the ones added afterwards (exponential decay).
+	void scale(double factor) {
+		compress();
+		for (Centroid& c : m_centroids) {
+			c.weight *= factor;
+		}
+		m_count *= factor;
+		m_whole &= factor == 1;
+	}
+
+	void clear() {
+		m_buffer.clear();
+		m_weighted.clear();
+		m_weighted_total = 0;
+		m_centroids.clear();
+		m_count = 0;
+		m_whole = true;
+		m_min = std::numeric_limits<double>::max();
+		m_max = std::numeric_limits<double>::lowest();
+	}
+
+	// Snapshot of the compressed centroids (see serialize.h)
+	void save(std::ostream& out) const {
+		compress();
+		write_tag(out, "TDIG");
+		write_value<double>(out, m_compression);
+		write_value<double>(out, m_count);
+		write_value<double>(out, m_min);
+		write_value<double>(out, m_max);
+		write_value<uint64_t>(out, m_centroids.size());
+		for (const Centroid& c : m_centroids) {
+			write_value<double>(out, c.mean);
+			write_value<double>(out, c.weight);
+		}
+	}
+
+	// Replaces the digest with a snapshot written by save()
+	bool load(std::istream& in) {
+		if (!expect_tag(in, "TDIG")) {
+			return false;
+		}
+		TDigest loaded{read_value<double>(in)};
+		loaded.m_count = read_value<double>(in);
+		loaded.m_min = read_value<double>(in);
+		loaded.m_max = read_value<double>(in);
+		uint64_t size = read_value<uint64_t>(in);
+		for (uint64_t i = 0; in && i < size; ++i) {
+			double mean = read_value<double>(in);
+			double weight = read_value<double>(in);
+			loaded.m_centroids.push_back({mean, weight});
+			loaded.m_whole &= weight == std::floor(weight);
+		}
+		if (!in || !std::is_sorted(loaded.m_centroids.begin(), loaded.m_centroids.end())) {
+			in.setstate(std::ios::failbit);
+			return false;
+		}
+		*this = std::move(loaded);
+		return true;
+	}
+
+	double count() const {
+		return m_count + static_cast<double>(m_buffer.size()) + m_weighted_total;
+	}
+
+	size_t centroid_count() const {
+		compress();
+		return m_centroids.size();
+	}
+
+	// Returns the value where the cumulative weight of the sorted samples
+	// reaches `percent` of the total; with unit weights that is the sample at
+	// rank floor(count * percent / 100), the one the exact sorted-vector
+	// percentile reports. Targets that fall on centroids of at most unit weight
+	// (single samples) are exact, all others are interpolated between centroid
+	// centers.
+	double quantile(double percent) const {
+		compress();
+		if (!(m_count > 0)) {
+			return NAN;
+		}
+		double target = std::clamp(m_count * percent / 100.0, 0.0, m_count);
+		double first = 0;
+		double last = m_count;
+		if (m_whole) {
+			// Whole samples: aim at the middle of the one at rank floor(target),
+			// with min and max in the middle of the first and last sample
+			target = std::min(std::floor(target), m_count - 1) + 0.5;
+			first = 0.5;
+			last = m_count - 0.5;
+		}
+
+		// Each centroid spans [cumulative, cumulative + weight) of the total
+		// weight and is centered in the middle of that span
+		double cumulative = 0;
+		double prev_center = first;
+		double prev_mean = m_min;
+		for (const Centroid& c : m_centroids) {
+			if (c.weight <= 1 && cumulative <= target && target < cumulative + c.weight) {
+				return c.mean;
+			}
+			double center = cumulative + c.weight / 2;
+			if (target <= center) {
+				if (center == prev_center) {
+					return c.mean;
+				}
+				double t = (target - prev_center) / (center - prev_center);
+				return prev_mean + t * (c.mean - prev_mean);
+			}
+			cumulative += c.weight;
+			prev_center = center;
+			prev_mean = c.mean;
+		}
+		if (last <= prev_center) {
+			return prev_mean;
+		}
+		double t = (target - prev_center) / (last - prev_center);
+		return prev_mean + t * (m_max - prev_mean);
+	}
+
+private:
+	struct Centroid {
+		double mean;
+		double weight;
+
+		bool operator<(const Centroid& other) const {
+			return mean < other.mean;
+		}
+	};
+
+	// Folds buffered samples into the centroid list. Logically const: the
+	// represented distribution doesn't change, only its layout.
+	void compress() const {
+		if (m_buffer.empty() && m_weighted.empty()) {
+			return;
+		}
+		if (!m_weighted.empty()) {
+			// Weighted samples are rare (decayed stores): fold the unit samples
+			// in with them and merge everything as centroids
+			for (double value : m_buffer) {
+				m_weighted.push_back({value, 1});
+			}
+			m_buffer.clear();
+			std::sort(m_weighted.begin(), m_weighted.end());
+			m_min = std::min(m_min, m_weighted.front().mean);
+			m_max = std::max(m_max, m_weighted.back().mean);
+
+			m_merged.clear();
+			m_merged.reserve(m_centroids.size() + m_weighted.size());
+			std::merge(m_centroids.begin(), m_centroids.end(), m_weighted.begin(), m_weighted.end(),
+				std::back_inserter(m_merged));
+			for (const Centroid& c : m_weighted) {
+				m_count += c.weight;
+			}
+			m_weighted.clear();
+			m_weighted_total = 0;
+			rebuild();
+			return;
+		}
+		std::sort(m_buffer.begin(), m_buffer.end());
+		m_min = std::min(m_min, m_buffer.front());
+		m_max = std::max(m_max, m_buffer.back());
+
+		m_merged.clear();
+		m_merged.reserve(m_centroids.size() + m_buffer.size());
+		auto centroid = m_centroids.begin();
+		for (double value : m_buffer) {
+			while (centroid != m_centroids.end() && centroid->mean <= value) {
+				m_merged.push_back(*centroid++);
+			}
+			m_merged.push_back({value, 1});
+		}
+		m_merged.insert(m_merged.end(), centroid, m_centroids.end());
+
+		m_count += static_cast<double>(m_buffer.size());
+		m_buffer.clear();
+		rebuild();
+	}
+
+	// Greedily merges neighbours of m_merged (sorted by mean) into m_centroids
+	// as long as each centroid stays within one unit of the k1 scale function.
+	void rebuild() const {
+		m_centroids.clear();
+		if (m_merged.empty()) {
+			return;
+		}
+		const double total = m_count;
+		double done = 0;
+		Centroid current = m_merged.front();
+		double limit = weight_limit(0, total);
+		for (size_t i = 1; i < m_merged.size(); ++i) {
+			const Centroid& next = m_merged[i];
+			if (done + current.weight + next.weight <= limit) {
+				current.weight += next.weight;
+				current.mean += (next.mean - current.mean) * next.weight / current.weight;
+			} else {
+				done += current.weight;
+				m_centroids.push_back(current);
+				current = next;
+				limit = weight_limit(done, total);
+			}
+		}
+		m_centroids.push_back(current);
+	}
+
+	// Cumulative weight a centroid that starts at `done` may grow to
+	double weight_limit(double done, double total) const {
+		const double pi = 3.14159265358979323846;
+		double q = done / total;
+		double k = m_compression / (2 * pi) * std::asin(2 * q - 1) + 1;
+		double k_max = m_compression / 4;
+		if (k >= k_max) {
+			return total;
+		}
+		return total * (std::sin(k * 2 * pi / m_compression) + 1) / 2;
+	}
+
+	double m_compression;
+	size_t m_buffer_limit;
+	mutable double m_count{0};
+	mutable double m_min{std::numeric_limits<double>::max()};
+	mutable double m_max{std::numeric_limits<double>::lowest()};
+	mutable std::vector<double> m_buffer;
+	mutable std::vector<Centroid> m_weighted;
+	mutable double m_weighted_total{0};
+	bool m_whole{true}; // every weight is a whole number of samples
+	mutable std::vector<Centroid> m_centroids;
+	mutable std::vector<Centroid> m_merged;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs task(0) .. task(count - 1) on `threads` threads
+template <typename Task>
+void run_tasks(size_t count, size_t threads, Task&& task) {
+	threads = std::max<size_t>(1, std::min(threads, count));
+	std::atomic<size_t> next{0};
+	auto work = [&] {
+		for (size_t i = next++; i < count; i = next++) {
+			task(i);
+		}
+	};
+	std::vector<std::thread> workers;
+	for (size_t t = 1; t < threads; ++t) {
+		workers.emplace_back(work);
+	}
+	work();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+// Fixed set of worker threads for run_tasks-style loops that run often, e.g.
+// the phases of a parallel sort, so they don't start and join threads every
+// time. The calling thread works too: a pool of size() n has n - 1 workers.
+// One parallel_for runs at a time; tasks must not throw nor call back into
+// the same pool.
+class ThreadPool {
+public:
+	explicit ThreadPool(size_t threads = std::thread::hardware_concurrency()) {
+		for (size_t t = 1; t < threads; ++t) {
+			m_workers.emplace_back([this] { work(); });
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock{m_mutex};
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (auto& worker : m_workers) {
+			worker.join();
+		}
+	}
+
+	// Pool with a thread per core, started on first use
+	static ThreadPool& shared() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	size_t size() const {
+		return m_workers.size() + 1;
+	}
+
+	// Runs task(0) .. task(count - 1) on the pool and returns when all are done
+	void parallel_for(size_t count, const std::function<void(size_t)>& task) {
+		if (m_workers.empty() || count < 2) {
+			for (size_t i = 0; i < count; ++i) {
+				task(i);
+			}
+			return;
+		}
+		std::lock_guard<std::mutex> run_lock{m_run_mutex};
+		{
+			std::lock_guard<std::mutex> lock{m_mutex};
+			m_task = &task;
+			m_count = count;
+			m_next = 0;
+			m_active = m_workers.size();
+			++m_generation;
+		}
+		m_wake.notify_all();
+		run_items();
+		std::unique_lock<std::mutex> lock{m_mutex};
+		m_done.wait(lock, [this] { return m_active == 0; });
+		m_task = nullptr;
+	}
+
+private:
+	void run_items() {
+		for (size_t i = m_next++; i < m_count; i = m_next++) {
+			(*m_task)(i);
+		}
+	}
+
+	void work() {
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock{m_mutex};
+		while (true) {
+			m_wake.wait(lock, [&] { return m_stop || m_generation != seen; });
+			if (m_stop) {
+				return;
+			}
+			seen = m_generation;
+			lock.unlock();
+			run_items();
+			lock.lock();
+			if (--m_active == 0) {
+				m_done.notify_one();
+			}
+		}
+	}
+
+	std::vector<std::thread> m_workers;
+	std::mutex m_run_mutex; // held for a whole parallel_for
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	const std::function<void(size_t)>* m_task{nullptr};
+	size_t m_count{0};
+	std::atomic<size_t> m_next{0};
+	size_t m_active{0};
+	uint64_t m_generation{0};
+	bool m_stop{false};
+};
@@ -0,0 +1,574 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "statistics.h"
+#include "tdigest.h"
+
+// Length of a sliding window or of a decay half-life: either a number of
+// samples ("1000000") or a duration in seconds ("60s").
+struct WindowSpec {
+	enum class Unit {
+		Samples,
+		Seconds
+	};
+
+	Unit unit{Unit::Samples};
+	double length{0}; // 0: no window
+
+	explicit operator bool() const {
+		return length > 0;
+	}
+
+	static bool parse(const char* text, WindowSpec& spec) {
+		char* end = nullptr;
+		double length = std::strtod(text, &end);
+		if (end == text || !(length > 0)) {
+			return false;
+		}
+		if (*end == 's' && end[1] == '\0') {
+			spec.unit = Unit::Seconds;
+		} else if (*end == '\0') {
+			spec.unit = Unit::Samples;
+		} else {
+			return false;
+		}
+		spec.length = length;
+		return true;
+	}
+};
+
+// Orders samples for window expiry. Sample windows number the samples, time
+// windows stamp them with the steady clock (once per block, in nanoseconds).
+class WindowClock {
+public:
+	explicit WindowClock(const WindowSpec& spec)
+		: m_by_time{spec.unit == WindowSpec::Unit::Seconds},
+		  m_length{static_cast<int64_t>(m_by_time ? spec.length * 1e9 : spec.length)} {
+		if (m_length < 1) {
+			m_length = 1;
+		}
+	}
+
+	// Key of the first of `count` new samples; the others follow `step()` apart
+	int64_t advance(size_t count) {
+		if (m_by_time) {
+			return clock_now();
+		}
+		int64_t key = m_next;
+		m_next += static_cast<int64_t>(count);
+		return key;
+	}
+
+	int64_t step() const {
+		return m_by_time ? 0 : 1;
+	}
+
+	// Key of the newest sample (sample windows) or the current time
+	int64_t now() const {
+		return m_by_time ? clock_now() : m_next - 1;
+	}
+
+	int64_t length() const {
+		return m_length;
+	}
+
+	bool by_time() const {
+		return m_by_time;
+	}
+
+	bool expired(int64_t key, int64_t now) const {
+		return key <= now - m_length;
+	}
+
+private:
+	static int64_t clock_now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	bool m_by_time;
+	int64_t m_length;
+	int64_t m_next{0};
+};
+
+// Windowed results describe the recent past of one stream, there is nothing
+// meaningful to combine them with.
+inline void windowed_merge_unsupported() {
+	throw std::logic_error("windowed statistics can't be merged");
+}
+
+// Min/max over a sliding window with a monotonic deque: every sample is pushed
+// and popped at most once, so updates are O(1) amortized. The front always
+// holds the extremum of the window.
+template <typename Better>
+class WindowedExtremum : public IStatistics {
+public:
+	explicit WindowedExtremum(const WindowSpec& window) : m_clock{window} {
+	}
+
+	void update(double next) override {
+		add(m_clock.advance(1), next);
+		expire(m_clock.now());
+	}
+
+	void update(const double* data, size_t count) override {
+		int64_t key = m_clock.advance(count);
+		int64_t step = m_clock.step();
+		for (size_t i = 0; i < count; ++i, key += step) {
+			add(key, data[i]);
+		}
+		expire(m_clock.now());
+	}
+
+	void merge(const IStatistics&) override {
+		windowed_merge_unsupported();
+	}
+
+	bool stores_samples() const override {
+		return true;
+	}
+
+	double eval() const override {
+		expire(m_clock.now());
+		return m_entries.empty() ? NAN : m_entries.front().second;
+	}
+
+private:
+	void add(int64_t key, double next) {
+		if (std::isnan(next)) {
+			return;
+		}
+		while (!m_entries.empty() && !Better{}(m_entries.back().second, next)) {
+			m_entries.pop_back();
+		}
+		m_entries.emplace_back(key, next);
+	}
+
+	void expire(int64_t now) const {
+		while (!m_entries.empty() && m_clock.expired(m_entries.front().first, now)) {
+			m_entries.pop_front();
+		}
+	}
+
+	WindowClock m_clock;
+	mutable std::deque<std::pair<int64_t, double>> m_entries;
+};
+
+class WindowedMin : public WindowedExtremum<std::less<double>> {
+public:
+	using WindowedExtremum::WindowedExtremum;
+
+	const char* name() const override {
+		return "min";
+	}
+};
+
+class WindowedMax : public WindowedExtremum<std::greater<double>> {
+public:
+	using WindowedExtremum::WindowedExtremum;
+
+	const char* name() const override {
+		return "max";
+	}
+};
+
+// Mean and variance over a sliding window. The window's samples are kept in a
+// ring and the moments are updated incrementally as samples enter and leave.
+class WindowedMoments {
+public:
+	explicit WindowedMoments(const WindowSpec& window) : m_clock{window} {
+	}
+
+	void add(const double* data, size_t count) {
+		int64_t key = m_clock.advance(count);
+		int64_t step = m_clock.step();
+		for (size_t i = 0; i < count; ++i, key += step) {
+			if (std::isnan(data[i])) {
+				continue;
+			}
+			m_entries.emplace_back(key, data[i]);
+			double n = static_cast<double>(m_entries.size());
+			double delta = data[i] - m_mean;
+			m_mean += delta / n;
+			m_m2 += delta * (data[i] - m_mean);
+		}
+		expire(m_clock.now());
+	}
+
+	void expire(int64_t now) {
+		while (!m_entries.empty() && m_clock.expired(m_entries.front().first, now)) {
+			double value = m_entries.front().second;
+			m_entries.pop_front();
+			if (m_entries.empty()) {
+				m_mean = 0;
+				m_m2 = 0;
+				continue;
+			}
+			// Welford's update run backwards
+			double n = static_cast<double>(m_entries.size());
+			double old_mean = m_mean;
+			m_mean -= (value - m_mean) / n;
+			m_m2 -= (value - old_mean) * (value - m_mean);
+		}
+	}
+
+	int64_t now() const {
+		return m_clock.now();
+	}
+
+	double mean() const {
+		return m_entries.empty() ? NAN : m_mean;
+	}
+
+	double variance() const {
+		return m_entries.empty() ? NAN : std::max(0.0, m_m2 / m_entries.size());
+	}
+
+private:
+	WindowClock m_clock;
+	std::deque<std::pair<int64_t, double>> m_entries;
+	double m_mean{0};
+	double m_m2{0};
+};
+
+class WindowedMean : public IStatistics {
+public:
+	explicit WindowedMean(const WindowSpec& window) : m_moments{window} {
+	}
+
+	void update(double next) override {
+		m_moments.add(&next, 1);
+	}
+
+	void update(const double* data, size_t count) override {
+		m_moments.add(data, count);
+	}
+
+	void merge(const IStatistics&) override {
+		windowed_merge_unsupported();
+	}
+
+	bool stores_samples() const override {
+		return true;
+	}
+
+	double eval() const override {
+		m_moments.expire(m_moments.now());
+		return m_moments.mean();
+	}
+
+	const char* name() const override {
+		return "mean";
+	}
+
+private:
+	mutable WindowedMoments m_moments;
+};
+
+class WindowedStd : public IStatistics {
+public:
+	explicit WindowedStd(const WindowSpec& window) : m_moments{window} {
+	}
+
+	void update(double next) override {
+		m_moments.add(&next, 1);
+	}
+
+	void update(const double* data, size_t count) override {
+		m_moments.add(data, count);
+	}
+
+	void merge(const IStatistics&) override {
+		windowed_merge_unsupported();
+	}
+
+	bool stores_samples() const override {
+		return true;
+	}
+
+	double eval() const override {
+		m_moments.expire(m_moments.now());
+		return std::sqrt(m_moments.variance());
+	}
+
+	const char* name() const override {
+		return "std";
+	}
+
+private:
+	mutable WindowedMoments m_moments;
+};
+
+// Percentiles over a sliding window: the window is cut into `panes` buckets,
+// each with its own t-digest, kept in a ring. Expired buckets are recycled and
+// a query merges the live ones, so the answer covers between the window length
+// and one extra bucket of history.
+class WindowedSketchStore : public QuantileStore {
+public:
+	explicit WindowedSketchStore(const WindowSpec& window, size_t panes = 10,
+			double compression = TDigest::default_compression)
+		: m_clock{window}, m_compression{compression} {
+		// Rounded up, so the window never needs more than `panes` of them, plus
+		// the one it starts in
+		const int64_t length = std::max<int64_t>(1, m_clock.length());
+		m_pane_length = (length + static_cast<int64_t>(panes) - 1) / static_cast<int64_t>(panes);
+		m_panes.resize(static_cast<size_t>((length + m_pane_length - 1) / m_pane_length) + 1,
+			Pane{0, TDigest{compression}});
+	}
+
+	void add(double next) override {
+		add(&next, 1);
+	}
+
+	void add(const double* data, size_t count) override {
+		while (count != 0) {
+			size_t take = count;
+			int64_t key;
+			if (m_clock.by_time()) {
+				key = m_clock.advance(count);
+			} else {
+				// Split the block where it crosses into the next pane
+				key = m_clock.now() + 1;
+				int64_t pane_end = key - key % m_pane_length + m_pane_length;
+				take = std::min(count, static_cast<size_t>(pane_end - key));
+				m_clock.advance(take);
+			}
+			rotate(key);
+			m_panes[m_current].digest.add(data, take);
+			m_dirty = true;
+			data += take;
+			count -= take;
+		}
+	}
+
+	void merge(const QuantileStore&) override {
+		windowed_merge_unsupported();
+	}
+
+	double quantile(float percent) const override {
+		int64_t now = m_clock.now();
+		if (m_dirty || now != m_merged_at) {
+			m_merged.clear();
+			for (const Pane& pane : m_panes) {
+				if (!m_clock.expired(pane.start + m_pane_length - 1, now)) {
+					m_merged.merge(pane.digest);
+				}
+			}
+			m_merged_at = now;
+			m_dirty = false;
+		}
+		return m_merged.quantile(percent);
+	}
+
+private:
+	struct Pane {
+		int64_t start;
+		TDigest digest;
+	};
+
+	// Starts a new pane when `key` is past the current one
+	void rotate(int64_t key) {
+		Pane& current = m_panes[m_current];
+		if (key < current.start + m_pane_length && !m_fresh) {
+			return;
+		}
+		if (!m_fresh) {
+			m_current = (m_current + 1) % m_panes.size();
+		}
+		m_fresh = false;
+		m_panes[m_current].start = key - key % m_pane_length;
+		m_panes[m_current].digest.clear();
+	}
+
+	WindowClock m_clock;
+	double m_compression;
+	int64_t m_pane_length;
+	std::vector<Pane> m_panes;
+	size_t m_current{0};
+	bool m_fresh{true};
+	mutable TDigest m_merged{m_compression};
+	mutable int64_t m_merged_at{-1};
+	mutable bool m_dirty{false};
+};
+
+// Exponential decay: a sample's weight halves every `half_life` samples or
+// seconds. Sample decay is applied per sample, time decay once per block.
+class Decay {
+public:
+	explicit Decay(const WindowSpec& half_life)
+		: m_by_time{half_life.unit == WindowSpec::Unit::Seconds},
+		  m_half_life{half_life.length} {
+	}
+
+	// Decay between two consecutive samples (1 for time decay)
+	double step_factor() const {
+		return m_by_time ? 1 : std::exp2(-1 / m_half_life);
+	}
+
+	// Decay for the time passed since the previous call (1 for sample decay)
+	double time_factor() {
+		if (!m_by_time) {
+			return 1;
+		}
+		auto now = std::chrono::steady_clock::now();
+		double factor = 1;
+		if (m_started) {
+			double elapsed = std::chrono::duration<double>(now - m_last).count();
+			factor = std::exp2(-elapsed / m_half_life);
+		}
+		m_started = true;
+		m_last = now;
+		return factor;
+	}
+
+private:
+	bool m_by_time;
+	double m_half_life;
+	bool m_started{false};
+	std::chrono::steady_clock::time_point m_last;
+};
+
+// Exponentially weighted mean and variance (West's weighted incremental update)
+class DecayedMoments {
+public:
+	explicit DecayedMoments(const WindowSpec& half_life) : m_decay{half_life} {
+	}
+
+	void add(const double* data, size_t count) {
+		if (count == 0) {
+			return;
+		}
+		double step_factor = m_decay.step_factor();
+		double factor = m_decay.time_factor() * step_factor;
+		for (size_t i = 0; i < count; ++i) {
+			m_weight = m_weight * factor + 1;
+			m_m2 *= factor;
+			double delta = data[i] - m_mean;
+			m_mean += delta / m_weight;
+			m_m2 += delta * (data[i] - m_mean);
+			factor = step_factor;
+		}
+	}
+
+	double mean() const {
+		return m_weight == 0 ? NAN : m_mean;
+	}
+
+	double variance() const {
+		return m_weight == 0 ? NAN : m_m2 / m_weight;
+	}
+
+private:
+	Decay m_decay;
+	double m_weight{0};
+	double m_mean{0};
+	double m_m2{0};
+};
+
+class DecayedMean : public IStatistics {
+public:
+	explicit DecayedMean(const WindowSpec& half_life) : m_moments{half_life} {
+	}
+
+	void update(double next) override {
+		m_moments.add(&next, 1);
+	}
+
+	void update(const double* data, size_t count) override {
+		m_moments.add(data, count);
+	}
+
+	void merge(const IStatistics&) override {
+		windowed_merge_unsupported();
+	}
+
+	double eval() const override {
+		return m_moments.mean();
+	}
+
+	const char* name() const override {
+		return "mean";
+	}
+
+private:
+	DecayedMoments m_moments;
+};
+
+class DecayedStd : public IStatistics {
+public:
+	explicit DecayedStd(const WindowSpec& half_life) : m_moments{half_life} {
+	}
+
+	void update(double next) override {
+		m_moments.add(&next, 1);
+	}
+
+	void update(const double* data, size_t count) override {
+		m_moments.add(data, count);
+	}
+
+	void merge(const IStatistics&) override {
+		windowed_merge_unsupported();
+	}
+
+	double eval() const override {
+		return std::sqrt(m_moments.variance());
+	}
+
+	const char* name() const override {
+		return "std";
+	}
+
+private:
+	DecayedMoments m_moments;
+};
+
+// Percentiles with exponentially decaying sample weights: the digest's weights
+// are scaled down once per block, and the block's own samples enter already
+// decayed by the samples that follow them.
+class DecayedSketchStore : public QuantileStore {
+public:
+	explicit DecayedSketchStore(const WindowSpec& half_life,
+			double compression = TDigest::default_compression)
+		: m_decay{half_life}, m_digest{compression} {
+	}
+
+	void add(double next) override {
+		add(&next, 1);
+	}
+
+	void add(const double* data, size_t count) override {
+		double step = m_decay.step_factor();
+		m_digest.scale(m_decay.time_factor() * std::pow(step, count));
+		if (step == 1) {
+			m_digest.add(data, count);
+			return;
+		}
+		// The newest sample weighs 1, every older one `step` times less
+		double weight = 1;
+		for (size_t i = count; i-- > 0; weight *= step) {
+			m_digest.add(data[i], weight);
+		}
+	}
+
+	void merge(const QuantileStore&) override {
+		windowed_merge_unsupported();
+	}
+
+	double quantile(float percent) const override {
+		return m_digest.quantile(percent);
+	}
+
+private:
+	Decay m_decay;
+	TDigest m_digest;
+};